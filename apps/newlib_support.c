@@ -86,6 +86,14 @@ caddr_t sbrk(int incr) {
 
     const uint64_t prev_break = program_break;
     program_break += incr;
+
+    // 減算でページ単位の空きができたら、そのページをOSに返す
+    const uint64_t break_page_end = (program_break + 4095) & ~(uint64_t)4095;
+    if (incr < 0 && break_page_end < dpage_end) {
+        if (SyscallUnmapPages(break_page_end, (dpage_end - break_page_end) / 4096).error == 0) {
+            dpage_end = break_page_end;
+        }
+    }
     return (caddr_t)prev_break;
 }
 
@@ -29,3 +29,7 @@ define_syscall OpenFile, 0x8000000c
 define_syscall ReadFile, 0x8000000d
 define_syscall DemandPages, 0x8000000e
 define_syscall MapFile, 0x8000000f
+define_syscall UnmapPages, 0x80000010
+define_syscall DiscardPages, 0x80000011
+define_syscall CancelTimer, 0x80000012
+define_syscall GetCPUFeatures, 0x80000013
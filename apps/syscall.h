@@ -34,12 +34,31 @@ struct SyscallResult SyscallReadEvent(struct AppEvent* events, size_t len);
 
 #define TIMER_ONESHOT_REL 1
 #define TIMER_ONESHOT_ABS 0
+// timeout_msをマイクロ秒として扱う（戻り値もマイクロ秒）。TIMER_ONESHOT_*と組み合わせる
+#define TIMER_USEC 2
+// 戻り値をタイムアウト時刻ではなく、SyscallCancelTimer()に渡すタイマIDにする
+#define TIMER_RETURN_ID 4
 struct SyscallResult SyscallCreateTimer(unsigned int type, int timer_value, unsigned long timeout_ms);
+// タイムアウト済みか取消し済みならEINVAL
+struct SyscallResult SyscallCancelTimer(uint64_t timer_id);
 
 struct SyscallResult SyscallOpenFile(const char* path, int flags);
 struct SyscallResult SyscallReadFile(int fd, void* buf, size_t count);
+#define DEMAND_PAGES_HUGE 1
+#define DEMAND_PAGES_POPULATE 2
 struct SyscallResult SyscallDemandPages(size_t num_pages, int flags);
+#define MAP_FILE_POPULATE 1
+#define MAP_FILE_SHARED 2
 struct SyscallResult SyscallMapFile(int fd, size_t* file_size, int flags);
+// addr : 4KiB境界。デマンドページング、ファイルマッピングの領域のみ
+struct SyscallResult SyscallUnmapPages(uint64_t addr, size_t num_pages);
+struct SyscallResult SyscallDiscardPages(uint64_t addr, size_t num_pages);
+
+// OSがタスク切替えで保存・復帰する拡張状態（XCR0のビット）。対応する命令を使ってよいかはこれで判断する
+#define CPU_FEATURE_SSE 0x02
+#define CPU_FEATURE_AVX 0x04
+#define CPU_FEATURE_AVX512 0xe0
+struct SyscallResult SyscallGetCPUFeatures();
 
 #ifdef __cplusplus
 } // extern "C"
@@ -0,0 +1,40 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include "../syscall.h"
+
+// TLBの効き具合を測る : num_pagesページを1バイトずつ読む周回を、msecの間に何回できるか数える
+// 別のターミナルでアプリを動かしてタスク切り替えを起こしつつ、pcid on / pcid off で比較する
+extern "C" void main(int argc, char** argv) {
+    size_t num_pages = 512;
+    unsigned long duration_ms = 3000;
+    if (argc >= 2) {
+        num_pages = atoi(argv[1]);
+    }
+    if (argc >= 3) {
+        duration_ms = atoi(argv[2]);
+    }
+
+    SyscallResult res = SyscallDemandPages(num_pages, DEMAND_PAGES_POPULATE);
+    if (res.error) {
+        printf("failed to allocate %lu pages\n", num_pages);
+        exit(1);
+    }
+    volatile char* buf = reinterpret_cast<char*>(res.value);
+
+    auto [tick_start, timer_freq] = SyscallGetCurrentTick();
+    const unsigned long tick_end = tick_start + duration_ms * timer_freq / 1000;
+    unsigned long rounds = 0, tick = tick_start;
+    while (tick < tick_end) {
+        for (size_t i = 0; i < num_pages; i++) {
+            static_cast<void>(buf[i * 4096]); // volatileなので読み込みは省略されない
+        }
+        ++rounds;
+        tick = SyscallGetCurrentTick().value;
+    }
+
+    const unsigned long elapsed_ms = (tick - tick_start) * 1000 / timer_freq;
+    printf("%lu pages x %lu rounds in %lu ms (%lu pages/ms)\n",
+           num_pages, rounds, elapsed_ms, elapsed_ms ? num_pages * rounds / elapsed_ms : 0);
+    exit(0);
+}
@@ -72,6 +72,7 @@ namespace acpi {
     }
 
     const FADT* g_fadt;
+    const MADT* g_madt;
 
     void Initialize(const RSDP& rsdp) {
         if (!rsdp.IsValid()) {
@@ -99,6 +100,42 @@ namespace acpi {
             Log(kError, "FADT is not found\n");
             exit(1);
         }
+
+        // MADTはAPの起動にだけ使うので、なくてもBSPだけで動作を続ける
+        g_madt = nullptr;
+        for (int i = 0; i < xsdt.Count(); i++) {
+            const auto& entry = xsdt[i];
+            if (entry.IsValid("APIC")) { // APIC is the signature of MADT
+                g_madt = reinterpret_cast<const MADT*>(&entry);
+                break;
+            }
+        }
+        if (g_madt == nullptr) {
+            Log(kWarn, "MADT is not found\n");
+        }
+    }
+
+    size_t ListLocalAPICIDs(uint8_t* ids, size_t max_ids) {
+        if (g_madt == nullptr) {
+            return 0;
+        }
+
+        size_t count = 0;
+        auto p = reinterpret_cast<const uint8_t*>(g_madt + 1);
+        const auto end = reinterpret_cast<const uint8_t*>(g_madt) + g_madt->header.length;
+        while (p + 2 <= end && p[1] >= 2) {
+            if (p[0] == 0) { // Processor Local APIC
+                const auto& lapic = *reinterpret_cast<const MADTLocalAPIC*>(p);
+                if (lapic.flags & 1) {
+                    if (count < max_ids) {
+                        ids[count] = lapic.apic_id;
+                    }
+                    ++count;
+                }
+            }
+            p += p[1];
+        }
+        return count;
     }
 
     void WaitMillisecondes(unsigned long msec) {
@@ -118,4 +155,16 @@ namespace acpi {
         while (IoIn32(g_fadt->pm_tmr_blk) < end)
             ;
     }
+
+    uint32_t PMTimerCount() {
+        return IoIn32(g_fadt->pm_tmr_blk);
+    }
+
+    unsigned long MicrosecondsSince(uint32_t start) {
+        const bool pm_timer_32 = (g_fadt->flags >> 8) & 1;
+        const uint32_t mask = pm_timer_32 ? 0xffffffffu : 0x00ffffffu;
+        // 1周していても差分は正しく求まる
+        const uint64_t count = (PMTimerCount() - start) & mask;
+        return count * 1000000 / kPMTimerFreq;
+    }
 } // namespace acpi
\ No newline at end of file
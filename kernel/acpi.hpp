@@ -74,11 +74,41 @@ namespace acpi {
     } __attribute__((packed));
 
     extern const FADT* g_fadt;
+
+    /// MADT : Multiple APIC Description Table
+    /// 割り込みコントローラー（Local APIC、I/O APIC）の一覧。CPUコアごとにLocal APICのエントリがある
+    struct MADT {
+        DescriptionHeader header;
+
+        uint32_t lapic_address;
+        uint32_t flags;
+        // この後ろに可変長のエントリ（先頭2byteが種別と長さ）が並ぶ
+    } __attribute__((packed));
+
+    /// MADTのエントリのうち、Local APIC（種別0）
+    struct MADTLocalAPIC {
+        uint8_t type;
+        uint8_t length;
+        uint8_t processor_id;
+        uint8_t apic_id;
+        /// bit 0 : 有効、bit 1 : 後から有効にできる
+        uint32_t flags;
+    } __attribute__((packed));
+
+    /// MADTが見つからなければnullptr
+    extern const MADT* g_madt;
     /// ACPI PMタイマの周波数 : 3.579545MHz
     /// 24ビットカウンタなら約4.7秒で1周して0になる
     const int kPMTimerFreq = 3579545;
 
     void Initialize(const RSDP& rsdp);
+    /// MADTに記載された、有効なCPUコアのLocal APIC IDを列挙する
+    /// return : CPUコアの数（max_idsを超える分はidsに書き込まない）
+    size_t ListLocalAPICIDs(uint8_t* ids, size_t max_ids);
     /// 指定したミリ秒が経過するのを待機
     void WaitMillisecondes(unsigned long msec);
+    /// PMタイマの現在のカウント値
+    uint32_t PMTimerCount();
+    /// startのカウント値からの経過時間（マイクロ秒）。PMタイマが1周するより短い時間を測ること
+    unsigned long MicrosecondsSince(uint32_t start);
 } // namespace acpi
\ No newline at end of file
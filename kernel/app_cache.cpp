@@ -0,0 +1,133 @@
+#include "app_cache.hpp"
+
+#include <algorithm>
+
+#include "interrupt.hpp"
+#include "page_cache.hpp"
+
+namespace {
+    /// アプリ用の仮想アドレス空間の先頭
+    const uint64_t kAppSpaceBegin = 0xffff800000000000;
+} // namespace
+
+WithError<AppLoadInfo> AppImageCache::Instantiate(fat::DirectoryEntry& file_entry, PageMapEntry* pml4) {
+    InterruptGuard guard;
+    auto it = std::find_if(images_.begin(), images_.end(),
+                           [&](const Image& image) { return image.file_entry == &file_entry; });
+    if (it == images_.end()) {
+        return {{}, MAKE_ERROR(Error::kNoSuchEntry)};
+    }
+    // ディレクトリエントリが別のファイルのものになっている
+    if (it->first_cluster != file_entry.FirstCluster() || it->file_size != file_entry.file_size) {
+        Evict(it - images_.begin());
+        return {{}, MAKE_ERROR(Error::kNoSuchEntry)};
+    }
+
+    ++it->hits;
+    it->last_use = ++use_clock_;
+    AppLoadInfo app_load = it->app_load;
+    app_load.pml4 = pml4;
+    // 遅延ロードするアプリはページフォルト時にページキャッシュから共有される
+    // ロード済みならアプリ領域（[256, 511]）をコピー（物理フレームのコピーはしない）
+    auto err = MAKE_ERROR(Error::kSuccess);
+    if (it->app_load.segments.empty()) {
+        err = CopyPageMaps(pml4, it->app_load.pml4, 4, 256);
+    }
+    // 遅延ロードするアプリは前回の実行でページキャッシュが増えているかもしれない
+    Shrink();
+    return {app_load, err};
+}
+
+void AppImageCache::Insert(fat::DirectoryEntry& file_entry, const AppLoadInfo& app_load) {
+    InterruptGuard guard;
+    const size_t template_frames =
+        app_load.pml4 ? 1 + CountPageMapFrames(app_load.pml4, LinearAddress4Level{kAppSpaceBegin}) : 0;
+    images_.push_back(Image{
+        &file_entry,
+        file_entry.FirstCluster(),
+        file_entry.file_size,
+        app_load,
+        template_frames,
+        0,
+        ++use_clock_,
+    });
+    Shrink();
+}
+
+void AppImageCache::Invalidate(fat::DirectoryEntry* file_entry) {
+    InterruptGuard guard;
+    for (size_t i = 0; i < images_.size(); i++) {
+        if (images_[i].file_entry == file_entry) {
+            Evict(i);
+            return;
+        }
+    }
+}
+
+void AppImageCache::SetBudget(size_t frames) {
+    InterruptGuard guard;
+    budget_frames_ = frames;
+    Shrink();
+}
+
+std::vector<AppImageStat> AppImageCache::Stat() const {
+    InterruptGuard guard;
+    std::vector<const Image*> images;
+    for (const auto& image : images_) {
+        images.push_back(&image);
+    }
+    std::sort(images.begin(), images.end(),
+              [](const Image* a, const Image* b) { return a->last_use > b->last_use; });
+
+    std::vector<AppImageStat> stats;
+    for (const auto image : images) {
+        stats.push_back({image->file_entry, image->hits, ResidentFrames(*image), !image->app_load.segments.empty()});
+    }
+    return stats;
+}
+
+size_t AppImageCache::ResidentFrames(const Image& image) const {
+    if (image.app_load.pml4) {
+        return image.template_frames;
+    }
+    return g_page_cache ? g_page_cache->FilePages(reinterpret_cast<uint64_t>(image.file_entry)) : 0;
+}
+
+void AppImageCache::Shrink() {
+    while (images_.size() > 1) {
+        size_t total = 0;
+        for (const auto& image : images_) {
+            total += ResidentFrames(image);
+        }
+        if (total <= budget_frames_) {
+            return;
+        }
+
+        size_t victim = 0;
+        uint64_t newest = 0;
+        for (size_t i = 0; i < images_.size(); i++) {
+            newest = std::max(newest, images_[i].last_use);
+            if (images_[i].last_use < images_[victim].last_use) {
+                victim = i;
+            }
+        }
+        if (images_[victim].last_use == newest) {
+            return;
+        }
+        Evict(victim);
+    }
+}
+
+void AppImageCache::Evict(size_t index) {
+    Image& image = images_[index];
+    if (image.app_load.pml4) {
+        // 起動中のアプリと共有しているフレームは参照カウントが残るので解放されない
+        CleanPageMaps(image.app_load.pml4, LinearAddress4Level{kAppSpaceBegin});
+        FreePageMap(image.app_load.pml4);
+    } else if (g_page_cache) {
+        g_page_cache->Invalidate(reinterpret_cast<uint64_t>(image.file_entry));
+    }
+    images_.erase(images_.begin() + index);
+}
+
+AppImageCache* g_app_images;
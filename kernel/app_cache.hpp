@@ -0,0 +1,80 @@
+/// アプリイメージキャッシュ : 一度起動したアプリのロード結果を保持し、次回の起動を速くする
+/// 保持する量には上限があり、超えたら最も長く使われていないアプリから破棄する
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "error.hpp"
+#include "fat.hpp"
+#include "paging.hpp"
+#include "vma.hpp"
+
+/// アプリをロードした後の状態
+struct AppLoadInfo {
+    /// アプリのLOADセグメントの最終アドレス
+    /// デマンドページングのアドレス範囲開始点として使用
+    uint64_t vaddr_end;
+    /// アプリのエントリポイントのアドレス
+    uint64_t entry;
+    /// アプリ固有の階層ページング構造
+    /// キャッシュの要素では、LOADセグメントをロード済みの階層ページング構造（遅延ロードするアプリはnullptr）
+    PageMapEntry* pml4;
+    /// 遅延ロードするLOADセグメント。空ならpml4にロード済み
+    std::vector<VirtualMemoryArea> segments;
+};
+
+/// キャッシュしているアプリの情報
+struct AppImageStat {
+    fat::DirectoryEntry* file_entry;
+    /// キャッシュから起動した回数
+    uint64_t hits;
+    /// 保持しているフレーム数
+    /// ロード済みなら階層ページング構造とLOADセグメント、遅延ロードならページキャッシュ中のページ
+    size_t resident_frames;
+    bool lazy;
+};
+
+class AppImageCache {
+public:
+    /// 保持するフレームの合計の上限の初期値（16MiB）
+    static const size_t kDefaultBudgetFrames = 4096;
+
+    /// キャッシュにあれば、アプリ領域をpml4に設定して（ロード済みなら階層ページング構造をコピーして）返す
+    /// 無ければkNoSuchEntry
+    WithError<AppLoadInfo> Instantiate(fat::DirectoryEntry& file_entry, PageMapEntry* pml4);
+    /// ロード結果を登録し、上限を超えていれば古いものを破棄する
+    void Insert(fat::DirectoryEntry& file_entry, const AppLoadInfo& app_load);
+    /// ファイルが書き換えられたので破棄する
+    void Invalidate(fat::DirectoryEntry* file_entry);
+    void SetBudget(size_t frames);
+    size_t Budget() const { return budget_frames_; }
+    /// 最近使われた順
+    std::vector<AppImageStat> Stat() const;
+
+private:
+    struct Image {
+        fat::DirectoryEntry* file_entry;
+        /// 登録時のファイルの先頭クラスタと大きさ（ディレクトリエントリが別のファイルに再利用されたことを検出する）
+        unsigned long first_cluster;
+        uint32_t file_size;
+        AppLoadInfo app_load;
+        /// ロード済みのアプリの階層ページング構造が使っているフレーム数（登録時に数える）
+        size_t template_frames;
+        uint64_t hits;
+        uint64_t last_use;
+    };
+
+    std::vector<Image> images_{};
+    size_t budget_frames_{kDefaultBudgetFrames};
+    uint64_t use_clock_{0};
+
+    size_t ResidentFrames(const Image& image) const;
+    /// 上限を超えていれば、最も長く使われていないものから破棄する（直近に使ったものは残す）
+    void Shrink();
+    void Evict(size_t index);
+};
+
+extern AppImageCache* g_app_images;
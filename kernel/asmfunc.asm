@@ -88,6 +88,16 @@ GetCR2:
     mov rax, cr2
     ret
 
+global GetCR4  ; uint64_t GetCR4();
+GetCR4:
+    mov rax, cr4
+    ret
+
+global SetCR4  ; void SetCR4(uint64_t value);
+SetCR4:
+    mov cr4, rdi
+    ret
+
 global SetCR3  ; void SetCR3(uint64_t value);
 SetCR3:
     mov cr3, rdi
@@ -114,6 +124,8 @@ KernelMain:
 
 ; 現在実行中のコンテキストを第2引数（RSI）が指すメモリ領域に保存し、
 ; 第1引数（RDI）が指すメモリ領域からCPUのレジスタを復帰
+extern g_cr3_noflush
+
 global SwitchContext
 SwitchContext:  ; void SwitchContext(void* next_ctx, void* current_ctx);
     mov [rsi + 0x40], rax
@@ -152,7 +164,7 @@ SwitchContext:  ; void SwitchContext(void* next_ctx, void* current_ctx);
     mov dx, gs
     mov [rsi + 0x38], rdx
 
-    fxsave [rsi + 0xc0]
+    ; FPU/SSEの状態は保存しない。CR0.TSを立てておき、次に使われたときに#NMで切り替える
     ; fall through to RestoreContext
 
 global RestoreContext
@@ -164,10 +176,13 @@ RestoreContext:  ; void RestoreContext(void* task_context);
     push qword [rdi + 0x20] ; CS
     push qword [rdi + 0x08] ; RIP
 
-    ; コンテキストの復帰
-    fxrstor [rdi + 0xc0]
-
+    ; コンテキストの復帰（FPU/SSEの状態は#NMで復帰する）
+    ; PCIDが割り当てられていれば（CR3[11:0] != 0）、g_cr3_noflushでTLBを消さずに切り替える
     mov rax, [rdi + 0x00]
+    test rax, 0xfff
+    jz .load_cr3
+    or rax, [rel g_cr3_noflush]
+.load_cr3:
     mov cr3, rax
     mov rax, [rdi + 0x30]
     mov fs, ax
@@ -220,9 +235,9 @@ IntHandlerLAPICTimer:  ; void IntHandlerLAPICTimer();
     push rbp
     mov rbp, rsp
 
-    ; スタック上に TaskContext 型の構造を構築する
+    ; スタック上に InterruptContext 型の構造を構築する
+    ; fxsave_areaはCR0.TSが立っていなければ（FPUが割り込まれたタスクのものなら）後で埋める
     sub rsp, 512
-    fxsave [rsp]
     push r15
     push r14
     push r13
@@ -248,7 +263,16 @@ IntHandlerLAPICTimer:  ; void IntHandlerLAPICTimer();
     push rax                 ; FS
     push qword [rbp + 0x28]  ; SS
     push qword [rbp + 0x10]  ; CS
-    push rbp                 ; reserved1
+    ; 割り込み処理のC++のコードもSSEレジスタを使うので、割り込まれたタスクのx87/SSEの状態を退避しておく
+    ; C++のコードはレガシーSSE命令しか使わず、AVX以降の状態は書き換えないので、FXSAVEで足りる
+    mov rax, cr0
+    xor edx, edx
+    test rax, 8              ; CR0.TS
+    jnz .fpu_not_owned
+    fxsave [rbp - 512]
+    mov edx, 1
+.fpu_not_owned:
+    push rdx                 ; fpu_saved
     push qword [rbp + 0x18]  ; RFLAGS
     push qword [rbp + 0x08]  ; RIP
     push rcx                 ; CR3
@@ -256,6 +280,10 @@ IntHandlerLAPICTimer:  ; void IntHandlerLAPICTimer();
     mov rdi, rsp
     call LAPICTimerOnInterrupt
 
+    cmp qword [rsp + 0x18], 0  ; fpu_saved
+    je .fpu_restored
+    fxrstor [rbp - 512]
+.fpu_restored:
     add rsp, 8*8  ; CR3 から GS までを無視
     pop rax
     pop rbx
@@ -272,12 +300,78 @@ IntHandlerLAPICTimer:  ; void IntHandlerLAPICTimer();
     pop r13
     pop r14
     pop r15
-    fxrstor [rsp]
 
     mov rsp, rbp
     pop rbp
     iretq
 
+extern FPUOnDeviceNotAvailable
+; uint8_t* FPUOnDeviceNotAvailable();
+extern g_fpu_owner_state
+extern g_fpu_save_mode
+
+; CR0.TSが立っている間にFPU/SSE/AVX命令を実行すると起こる（#NM）
+; 前の所有者の状態をその保存領域に書き出してから、現在のタスクの状態を復帰する
+global IntHandlerNM
+IntHandlerNM:  ; void IntHandlerNM();
+    push rax
+    push rcx
+    push rdx
+    push rsi
+    push rdi
+    push r8
+    push r9
+    push r10
+    push r11
+
+    clts
+    ; C++のコード（SSEレジスタを使いうる）を呼ぶ前に保存する
+    ; 前の所有者の保存領域 = g_fpu_owner_state[Local APIC ID]
+    mov rax, 0xfee00020
+    mov ecx, [rax]
+    shr ecx, 24
+    lea rax, [rel g_fpu_owner_state]
+    mov rdi, [rax + rcx * 8]
+    test rdi, rdi
+    jz .saved
+    mov eax, -1  ; 保存する状態 : XCR0で有効なものすべて
+    mov edx, -1
+    mov ecx, [rel g_fpu_save_mode]
+    cmp ecx, 1
+    je .xsave
+    ja .xsaveopt
+    fxsave [rdi]
+    jmp .saved
+.xsave:
+    xsave [rdi]
+    jmp .saved
+.xsaveopt:
+    xsaveopt [rdi]
+.saved:
+
+    call FPUOnDeviceNotAvailable
+    cmp dword [rel g_fpu_save_mode], 0
+    jne .xrstor
+    fxrstor [rax]  ; 現在のタスクの状態
+    jmp .restored
+.xrstor:
+    mov rdi, rax
+    mov eax, -1
+    mov edx, -1
+    xrstor [rdi]
+.restored:
+
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rdi
+    pop rsi
+    pop rdx
+    pop rcx
+    pop rax
+    iretq
+
 global LoadTR
 LoadTR:  ; void LoadTR(uint16_t sel);
     ltr di
@@ -378,3 +472,65 @@ global InvalidateTLB  ; void InvalidateTLB(uint64_t addr);
 InvalidateTLB:
     invlpg [rdi]
     ret
+
+global InvalidatePCID  ; void InvalidatePCID(uint64_t type, uint64_t pcid);
+InvalidatePCID:
+    ; INVPCID記述子 : [0, 8) PCID, [8, 16) リニアアドレス
+    push 0
+    push rsi
+    invpcid rdi, [rsp]
+    add rsp, 16
+    ret
+
+; APの起動コード（トランポリン）
+; BSPが[APTrampoline, APTrampolineEnd)を1MiB未満のフレームにコピーし、SIPIでその先頭からAPを動かす
+; APはリアルモード（CS = コピー先 >> 4, IP = 0）で動き出すので、ロングモードに移行してからAPMain()を呼ぶ
+; コピー先で動くよう、データはすべてAPTrampolineからの相対位置で参照する
+; APBootParamsの中身（smp.cppのAPBootParams構造体）はBSPがコピー先に書き込む
+bits 16
+global APTrampoline
+APTrampoline:
+    cli
+    mov ax, cs
+    mov ds, ax
+
+    ; 一時的なGDT（64bitモード用のコードセグメントとデータセグメントだけ）
+    o32 lgdt [APBootParams - APTrampoline + 0x18]
+
+    ; CR4.PAE、CR3、IA32_EFER.LMEを設定してからページングを有効にするとロングモードになる
+    mov eax, [APBootParams - APTrampoline + 0x30]  ; CR4
+    mov cr4, eax
+    mov eax, [APBootParams - APTrampoline + 0x2c]  ; CR3
+    mov cr3, eax
+    mov ecx, 0xc0000080  ; IA32_EFER
+    rdmsr
+    or eax, 0x0100       ; LME
+    wrmsr
+    mov eax, [APBootParams - APTrampoline + 0x28]  ; CR0（PE、PGを含む）
+    mov cr0, eax
+
+    ; 64bitモード用のコードセグメントにfar jumpする（飛び先はコピー先のAPTrampoline64）
+    o32 jmp far [APBootParams - APTrampoline + 0x20]
+
+bits 64
+global APTrampoline64
+APTrampoline64:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    mov rsp, [rel APBootParams + 0x38]  ; スタック
+    mov edi, [rel APBootParams + 0x34]  ; CPU番号
+    mov rax, [rel APBootParams + 0x40]  ; APMain
+    call rax
+.fin:
+    hlt
+    jmp .fin
+
+align 8
+global APBootParams
+APBootParams:
+    times 0x48 db 0
+global APTrampolineEnd
+APTrampolineEnd:
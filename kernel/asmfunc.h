@@ -18,6 +18,8 @@ uint64_t GetCR0();
 void SetCR0(uint64_t value);
 /// 例外が発生したメモリアドレスを取得
 uint64_t GetCR2();
+uint64_t GetCR4();
+void SetCR4(uint64_t value);
 /// CR3レジスタを設定し、自前の階層ページング構造が利用可能となる
 /// 再設定することで別のページング構造に切り替えることも可能
 void SetCR3(uint64_t value);
@@ -30,6 +32,8 @@ void RestoreContext(void* ctx);
 int CallApp(int argc, char** argv, uint16_t ss, uint64_t rip, uint64_t rsp, uint64_t* os_stack_ptr);
 /// LAPICタイマ用割り込みハンドラ
 void IntHandlerLAPICTimer();
+/// #NM（Device Not Available）用割り込みハンドラ。FPU/SSEの状態を現在のタスクのものに切り替える
+void IntHandlerNM();
 /// TRレジスタを設定
 void LoadTR(uint16_t sel);
 /// 指定のモデル固有レジスタに値を設定
@@ -46,4 +50,10 @@ void ExitApp(uint64_t rsp, int32_t ret_val);
 /// CPUに内蔵されている、仮想アドレスを物理アドレスに変換する処理を高速化する装置
 /// 一度解決した仮想アドレスを登録するので、階層ページング構造をたどる処理をスキップできる
 void InvalidateTLB(uint64_t addr);
+/// INVPCID命令でTLBを無効化する
+/// type : 0 = 指定PCIDの指定アドレス、1 = 指定PCIDのすべて、2 = グローバルを含む全PCID、3 = グローバル以外の全PCID
+void InvalidatePCID(uint64_t type, uint64_t pcid);
+/// APの起動コード。[APTrampoline, APTrampolineEnd)を1MiB未満のフレームにコピーして使う
+/// APTrampoline64はロングモードに入った後の部分、APBootParamsはBSPが書き込むパラメータ
+extern char APTrampoline[], APTrampoline64[], APBootParams[], APTrampolineEnd[];
 }
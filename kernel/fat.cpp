@@ -5,6 +5,9 @@
 #include <cstring>
 #include <utility>
 
+#include "app_cache.hpp"
+#include "page_cache.hpp"
+
 namespace {
     /// 指定パスを '/' で区切った最初の要素をpath_elemにコピー
     /// 指定パスの次の要素を返す
@@ -336,6 +339,13 @@ namespace fat {
 
         wr_off_ += total;
         fat_entry_.file_size = wr_off_;
+        // キャッシュしているページは古くなった
+        if (g_page_cache) {
+            g_page_cache->Invalidate(FileID());
+        }
+        if (g_app_images) {
+            g_app_images->Invalidate(&fat_entry_);
+        }
         return total;
     }
 
@@ -353,4 +363,65 @@ namespace fat {
         fd.rd_cluster_off_ = offset;
         return fd.Read(buf, len);
     }
+
+    void* FileDescriptor::PageFrame(size_t offset) {
+        // ファイル末尾を含むページはクラスタの残りを見せないようにコピーさせる
+        if (offset % 4096 != 0 || offset + 4096 > fat_entry_.file_size) {
+            return nullptr;
+        }
+
+        if (pf_cluster_ == 0 || offset < pf_off_) {
+            pf_off_ = 0;
+            pf_cluster_ = fat_entry_.FirstCluster();
+        }
+        while (pf_off_ + g_bytes_per_cluster <= offset) {
+            pf_off_ += g_bytes_per_cluster;
+            pf_cluster_ = NextCluster(pf_cluster_);
+            if (pf_cluster_ == kEndOfClusterchain) {
+                pf_cluster_ = 0;
+                return nullptr;
+            }
+        }
+
+        uint8_t* head = GetSectorByCluster<uint8_t>(pf_cluster_) + (offset - pf_off_);
+        if (reinterpret_cast<uintptr_t>(head) % 4096 != 0) {
+            return nullptr;
+        }
+        // ページが複数のクラスタにまたがる場合は、それらが連続したクラスタであること
+        unsigned long cluster = pf_cluster_;
+        for (size_t end = pf_off_ + g_bytes_per_cluster; end < offset + 4096; end += g_bytes_per_cluster) {
+            const auto next = NextCluster(cluster);
+            if (next != cluster + 1) {
+                return nullptr;
+            }
+            cluster = next;
+        }
+        return head;
+    }
+
+    size_t FileDescriptor::Store(const void* buf, size_t len, size_t offset) {
+        if (offset >= fat_entry_.file_size) {
+            return 0;
+        }
+        len = std::min(len, fat_entry_.file_size - offset);
+
+        unsigned long cluster = fat_entry_.FirstCluster();
+        while (offset >= g_bytes_per_cluster) {
+            offset -= g_bytes_per_cluster;
+            cluster = NextCluster(cluster);
+        }
+
+        const uint8_t* buf8 = reinterpret_cast<const uint8_t*>(buf);
+        size_t total = 0;
+        while (total < len) {
+            uint8_t* sec = GetSectorByCluster<uint8_t>(cluster);
+            size_t n = std::min(len - total, g_bytes_per_cluster - offset);
+            memcpy(&sec[offset], &buf8[total], n);
+            total += n;
+
+            offset = 0;
+            cluster = NextCluster(cluster);
+        }
+        return total;
+    }
 } // namespace fat
@@ -171,6 +171,12 @@ namespace fat {
         size_t Size() const override { return fat_entry_.file_size; }
         /// 指定位置からファイルを読む
         size_t Load(void* buf, size_t len, size_t offset) override;
+        /// 指定位置からファイルを上書きする（ファイルサイズは変えない）
+        size_t Store(const void* buf, size_t len, size_t offset) override;
+        /// ディレクトリエントリのアドレス（ボリュームイメージ内で一意）
+        uint64_t FileID() const override { return reinterpret_cast<uint64_t>(&fat_entry_); }
+        /// ボリュームイメージ内でファイルのページがクラスタ境界に揃っていれば、その位置
+        void* PageFrame(size_t offset) override;
 
     private:
         /// ファイルへの参照
@@ -187,5 +193,9 @@ namespace fat {
         unsigned long wr_cluster_ = 0;
         /// 書き込み時のクラスタ先頭からのオフセット（byte単位）
         size_t wr_cluster_off_ = 0;
+        /// PageFrame()で最後に辿ったクラスタの先頭のファイル内オフセットとクラスタ番号
+        /// 先頭から順にページを調べるときにクラスタチェーンを毎回先頭から辿らずに済む
+        size_t pf_off_ = 0;
+        unsigned long pf_cluster_ = 0;
     };
 } // namespace fat
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
 
 #include "error.hpp"
 
@@ -14,6 +15,13 @@ public:
 
     /// Load() reads file content without changing internal offset
     virtual size_t Load(void* buf, size_t len, size_t offset) = 0;
+    /// Store() overwrites file content within the current size without changing internal offset
+    virtual size_t Store(const void* buf, size_t len, size_t offset) { return 0; }
+    /// ページキャッシュのキーとなるファイルの識別子。0ならキャッシュしない
+    virtual uint64_t FileID() const { return 0; }
+    /// offsetからの4KiBがメモリ上の4KiB境界から連続して置かれていれば、その先頭（コピーせずにマップできる）
+    /// そうでなければnullptr
+    virtual void* PageFrame(size_t offset) { return nullptr; }
 };
 
 /// 指定ファイルディスクリプタに文字列を書き込む
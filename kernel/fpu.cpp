@@ -0,0 +1,137 @@
+#include "fpu.hpp"
+
+#include <cpuid.h>
+#include <cstring>
+
+#include "asmfunc.h"
+#include "logger.hpp"
+#include "slab.hpp"
+
+namespace {
+    /// CR4.OSXSAVE : XSAVE系の命令とXCR0を使えるようにする
+    const uint64_t kCR4OSXSAVE = 1ul << 18;
+
+    /// 保存方法（asmfunc.asmのIntHandlerNMと合わせる）
+    enum FPUSaveMode : int {
+        kFXSave = 0,
+        kXSave = 1,
+        /// 前回のXRSTOR以降に変更されていない状態は書き込まない
+        kXSaveOpt = 2,
+    };
+
+    uint64_t g_xfeatures = kXFeatureX87 | kXFeatureSSE;
+    size_t g_state_bytes = 512;
+    /// 保存領域の大きさはCPUIDで決まるので、InitializeFPU()で作る
+    SlabCache* g_fpu_state_cache = nullptr;
+
+    void SetXCR0(uint64_t value) {
+        __asm__ volatile("xsetbv" : : "c"(0), "a"(static_cast<uint32_t>(value)), "d"(static_cast<uint32_t>(value >> 32)));
+    }
+} // namespace
+
+extern "C" {
+    int g_fpu_save_mode = kFXSave;
+    std::array<uint8_t*, 256> g_fpu_owner_state{};
+}
+
+void InitializeFPU() {
+    unsigned int eax, ebx, ecx, edx;
+    // CPUID.01H:ECX[26] = XSAVE
+    __get_cpuid(1, &eax, &ebx, &ecx, &edx);
+    const bool avx = (ecx >> 28) & 1;
+    if (((ecx >> 26) & 1) == 0 || __get_cpuid_max(0, nullptr) < 0xd) {
+        Log(kWarn, "FPU: XSAVE is not supported, saving SSE state with FXSAVE\n");
+    } else {
+        // CPUID.(EAX=0DH, ECX=0):EDX:EAX = XCR0に設定できるビット
+        __cpuid_count(0xd, 0, eax, ebx, ecx, edx);
+        const uint64_t supported = (static_cast<uint64_t>(edx) << 32) | eax;
+        uint64_t xfeatures = kXFeatureX87 | kXFeatureSSE;
+        if (avx && (supported & kXFeatureAVX)) {
+            xfeatures |= kXFeatureAVX;
+            // CPUID.(EAX=07H, ECX=0):EBX[16] = AVX512F。AVX-512の3つの状態は揃えて有効にする
+            __cpuid_count(7, 0, eax, ebx, ecx, edx);
+            if (((ebx >> 16) & 1) && (supported & kXFeatureAVX512) == kXFeatureAVX512) {
+                xfeatures |= kXFeatureAVX512;
+            }
+        }
+
+        SetCR4(GetCR4() | kCR4OSXSAVE);
+        SetXCR0(xfeatures);
+        g_xfeatures = xfeatures;
+        // CPUID.(EAX=0DH, ECX=0):EBX = 現在のXCR0で必要な保存領域の大きさ
+        __cpuid_count(0xd, 0, eax, ebx, ecx, edx);
+        g_state_bytes = ebx;
+        // CPUID.(EAX=0DH, ECX=1):EAX[0] = XSAVEOPT
+        __cpuid_count(0xd, 1, eax, ebx, ecx, edx);
+        g_fpu_save_mode = (eax & 1) ? kXSaveOpt : kXSave;
+    }
+
+    g_fpu_state_cache = new SlabCache{"FPUState", g_state_bytes, 64};
+    Log(kInfo, "FPU: %s, XCR0 = %#lx (%s%s), %lu bytes per task\n",
+        g_fpu_save_mode == kXSaveOpt ? "XSAVEOPT" : g_fpu_save_mode == kXSave ? "XSAVE" : "FXSAVE",
+        g_xfeatures,
+        g_xfeatures & kXFeatureAVX ? "AVX" : "SSE",
+        g_xfeatures & kXFeatureAVX512 ? ", AVX-512" : "",
+        g_state_bytes);
+}
+
+void InitializeAPFPU() {
+    if (g_fpu_save_mode == kFXSave) {
+        return;
+    }
+    // XCR0はCPUコアごとのレジスタ。BSPと同じ状態を保存するので、保存領域の大きさも同じ
+    SetCR4(GetCR4() | kCR4OSXSAVE);
+    SetXCR0(g_xfeatures);
+}
+
+uint64_t EnabledXFeatures() {
+    return g_xfeatures;
+}
+
+size_t FPUStateBytes() {
+    return g_state_bytes;
+}
+
+uint8_t* AllocateFPUState() {
+    auto state = static_cast<uint8_t*>(g_fpu_state_cache->Allocate());
+    if (state == nullptr) {
+        return nullptr;
+    }
+    // XSAVEヘッダ（offset 512）も0にする。XSTATE_BVが0の状態はXRSTORで初期値になる
+    memset(state, 0, g_state_bytes);
+    // x87の例外をすべてマスクし、MXCSRのすべての例外をマスクする
+    *reinterpret_cast<uint16_t*>(&state[0]) = 0x37f;
+    *reinterpret_cast<uint32_t*>(&state[24]) = 0x1f80;
+    if (g_fpu_save_mode != kFXSave) {
+        // 上の2つを復帰させる
+        *reinterpret_cast<uint64_t*>(&state[512]) = kXFeatureX87 | kXFeatureSSE;
+    }
+    return state;
+}
+
+void FreeFPUState(uint8_t* state) {
+    g_fpu_state_cache->Free(state);
+}
+
+void SaveFPUState(uint8_t* state) {
+    switch (g_fpu_save_mode) {
+    case kXSaveOpt:
+        __asm__ volatile("xsaveopt (%0)" : : "r"(state), "a"(~0u), "d"(~0u) : "memory");
+        break;
+    case kXSave:
+        __asm__ volatile("xsave (%0)" : : "r"(state), "a"(~0u), "d"(~0u) : "memory");
+        break;
+    default:
+        __asm__ volatile("fxsave (%0)" : : "r"(state) : "memory");
+        break;
+    }
+}
+
+void SetLegacyFPUState(uint8_t* state, const std::array<uint8_t, 512>& fxsave_area) {
+    // 先頭512バイト（x87とSSE）はFXSAVEとXSAVEで同じ形式
+    memcpy(state, fxsave_area.data(), fxsave_area.size());
+    if (g_fpu_save_mode != kFXSave) {
+        // XSAVEOPTは初期状態の要素を書き込まずXSTATE_BVのビットを落とすので、写した内容を復帰させるよう立て直す
+        *reinterpret_cast<uint64_t*>(&state[512]) |= kXFeatureX87 | kXFeatureSSE;
+    }
+}
@@ -0,0 +1,38 @@
+/// FPU/SSE/AVXの状態の保存と復帰
+/// XSAVE : XCR0で有効にした状態（x87、SSE、AVX、AVX-512など）をまとめて保存する命令。保存領域の大きさはCPUID.0DHで決まる
+/// XSAVEが使えないCPUではFXSAVE（x87とSSEのみ、512バイト）で保存する
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+/// XCR0のビット : 保存・復帰する状態の種類
+const uint64_t kXFeatureX87 = 1ul << 0;
+const uint64_t kXFeatureSSE = 1ul << 1;
+const uint64_t kXFeatureAVX = 1ul << 2;
+/// opmask、ZMM0-15の上位256ビット、ZMM16-31
+const uint64_t kXFeatureAVX512 = 0b111ul << 5;
+
+/// CPUが対応する状態をXCR0で有効にし、保存方法と保存領域の大きさを決める（BSPで、タスクを作る前に呼ぶ）
+void InitializeFPU();
+/// BSPと同じ状態をAPでも有効にする（AP自身が呼ぶ）
+void InitializeAPFPU();
+
+/// OSが保存・復帰する状態（XCR0の値。XSAVEが使えなければx87とSSEのみ）
+uint64_t EnabledXFeatures();
+/// 保存領域の大きさ（64バイト境界に置く）
+size_t FPUStateBytes();
+
+/// 初期状態の保存領域を確保する。確保できなければnullptr
+uint8_t* AllocateFPUState();
+void FreeFPUState(uint8_t* state);
+/// 現在のFPUレジスタの内容を保存する（CR0.TSを外してから呼ぶ）
+void SaveFPUState(uint8_t* state);
+/// FXSAVEで保存したx87/SSEの部分だけを差し替える。AVXなどの拡張部分はそのまま
+void SetLegacyFPUState(uint8_t* state, const std::array<uint8_t, 512>& fxsave_area);
+
+/// 各CPUコアのFPUの所有者の保存領域（添字はLocal APIC ID、所有者がいなければnullptr）
+/// #NMの入口（asmfunc.asm）で、C++のコードがSSEレジスタを使う前に前の所有者の状態を保存するのに使う
+extern "C" std::array<uint8_t*, 256> g_fpu_owner_state;
@@ -0,0 +1,354 @@
+#include "heap.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "interrupt.hpp"
+#include "memory_manager.hpp"
+
+/// ブロック : ヘッダ（16byte）とそれに続くデータ領域
+/// プール : [プールヘッダ][ブロック]...[番兵ブロック]
+struct TlsfHeap::Block {
+    /// ブロック全体の大きさ（ヘッダを含む、kAlignの倍数）と下位4ビットのフラグ
+    size_t size_flags;
+    /// 物理的に直前のブロック（プールの先頭ならnullptr）
+    Block* prev_phys;
+    /// 以下は空きブロックのみ有効（使用中はデータ領域）
+    Block* next_free;
+    Block* prev_free;
+
+    size_t Size() const;
+    bool IsFree() const;
+    bool IsLast() const;
+    Block* NextPhys();
+    void* Payload();
+};
+
+namespace {
+    const size_t kHeaderBytes = 16;
+    /// 空きリストのポインタを格納できる最小の大きさ
+    const size_t kMinBlockBytes = 32;
+    const size_t kPoolHeaderBytes = 16;
+    const size_t kFlagFree = 1;
+    /// 番兵ブロック
+    const size_t kFlagLast = 2;
+    const size_t kFlagMask = 0xf;
+
+    /// プールの先頭に置く情報
+    struct PoolHeader {
+        size_t frames;
+        size_t reserved;
+    };
+    static_assert(sizeof(PoolHeader) == kPoolHeaderBytes);
+
+    constexpr size_t RoundUp(size_t value, size_t align) {
+        return (value + align - 1) & ~(align - 1);
+    }
+
+    int HighestBit(size_t value) {
+        return 63 - __builtin_clzl(value);
+    }
+
+    /// sizeの属する分類
+    void MappingInsert(size_t size, int& fl, int& sl) {
+        if (size < (size_t{1} << TlsfHeap::kFLShift)) {
+            fl = 0;
+            sl = size / TlsfHeap::kAlign;
+        } else {
+            const int f = HighestBit(size);
+            sl = (size >> (f - TlsfHeap::kSLLog2)) ^ TlsfHeap::kSLCount;
+            fl = f - TlsfHeap::kFLShift + 1;
+        }
+    }
+
+    /// その分類のどのブロックもsize以上となるよう、sizeを次の分類の境界まで切り上げる
+    size_t RoundUpToClass(size_t size) {
+        if (size < (size_t{1} << TlsfHeap::kFLShift)) {
+            return size;
+        }
+        const size_t step = size_t{1} << (HighestBit(size) - TlsfHeap::kSLLog2);
+        return RoundUp(size, step);
+    }
+} // namespace
+
+size_t TlsfHeap::Block::Size() const {
+    return size_flags & ~kFlagMask;
+}
+
+bool TlsfHeap::Block::IsFree() const {
+    return size_flags & kFlagFree;
+}
+
+bool TlsfHeap::Block::IsLast() const {
+    return size_flags & kFlagLast;
+}
+
+TlsfHeap::Block* TlsfHeap::Block::NextPhys() {
+    return reinterpret_cast<Block*>(reinterpret_cast<uintptr_t>(this) + Size());
+}
+
+void* TlsfHeap::Block::Payload() {
+    return reinterpret_cast<uint8_t*>(this) + kHeaderBytes;
+}
+
+void* TlsfHeap::Allocate(size_t bytes, size_t align) {
+    if (bytes > (size_t{1} << (kFLIndexMax - 2))) {
+        return nullptr;
+    }
+    align = std::max(align, kAlign);
+    const size_t size = std::max(RoundUp(bytes + kHeaderBytes, kAlign), kMinBlockBytes);
+    // アラインメント調整で先頭を切り捨てても足りるように余分に探す
+    const size_t search = align > kAlign ? size + align + kMinBlockBytes : size;
+
+    InterruptGuard guard;
+    Block* block = TakeFree(search);
+    if (block == nullptr) {
+        if (!Grow(search)) {
+            return nullptr;
+        }
+        block = TakeFree(search);
+    }
+
+    if (align > kAlign) {
+        const auto payload = reinterpret_cast<uintptr_t>(block->Payload());
+        auto aligned = RoundUp(payload, align);
+        if (aligned != payload) {
+            // 切り捨てる先頭部分は単独の空きブロックにできる大きさが必要
+            while (aligned - payload < kMinBlockBytes) {
+                aligned += align;
+            }
+            const size_t lead = aligned - payload;
+            auto next = reinterpret_cast<Block*>(aligned - kHeaderBytes);
+            next->size_flags = block->Size() - lead;
+            next->prev_phys = block;
+            next->NextPhys()->prev_phys = next;
+            block->size_flags = lead;
+            // 直前のブロックは使用中（空きブロックは常に結合済み）なのでそのまま戻せる
+            InsertFree(block);
+            block = next;
+        }
+    }
+
+    TrimTail(block, size);
+    used_bytes_ += block->Size();
+    used_bytes_peak_ = std::max(used_bytes_peak_, used_bytes_);
+    return block->Payload();
+}
+
+void TlsfHeap::Free(void* p) {
+    if (p == nullptr) {
+        return;
+    }
+
+    InterruptGuard guard;
+    auto block = reinterpret_cast<Block*>(reinterpret_cast<uintptr_t>(p) - kHeaderBytes);
+    used_bytes_ -= block->Size();
+    block = Merge(block);
+    // プール全体が空いた。1つは次の確保に備えて残す
+    if (block->prev_phys == nullptr && block->NextPhys()->IsLast() && pools_ > 1) {
+        ReleasePool(block);
+    } else {
+        InsertFree(block);
+    }
+}
+
+void* TlsfHeap::Reallocate(void* p, size_t bytes) {
+    if (p == nullptr) {
+        return Allocate(bytes);
+    }
+    if (bytes > (size_t{1} << (kFLIndexMax - 2))) {
+        return nullptr;
+    }
+    const size_t size = std::max(RoundUp(bytes + kHeaderBytes, kAlign), kMinBlockBytes);
+
+    InterruptGuard guard;
+    auto block = reinterpret_cast<Block*>(reinterpret_cast<uintptr_t>(p) - kHeaderBytes);
+    const size_t old_size = block->Size();
+
+    // 直後の空きブロックを取り込めばその場で伸ばせる
+    Block* next = block->NextPhys();
+    if (old_size < size && next->IsFree() && old_size + next->Size() >= size) {
+        RemoveFree(next);
+        block->size_flags = old_size + next->Size();
+        block->NextPhys()->prev_phys = block;
+    }
+
+    if (block->Size() >= size) {
+        TrimTail(block, size);
+        used_bytes_ = used_bytes_ - old_size + block->Size();
+        used_bytes_peak_ = std::max(used_bytes_peak_, used_bytes_);
+        return p;
+    }
+
+    void* new_p = Allocate(bytes);
+    if (new_p == nullptr) {
+        return nullptr;
+    }
+    memcpy(new_p, p, old_size - kHeaderBytes);
+    Free(p);
+    return new_p;
+}
+
+HeapStat TlsfHeap::Stat() const {
+    InterruptGuard guard;
+    size_t largest = 0;
+    if (fl_bitmap_) {
+        const int fl = HighestBit(fl_bitmap_);
+        const int sl = HighestBit(sl_bitmaps_[fl]);
+        for (Block* b = free_lists_[fl][sl]; b; b = b->next_free) {
+            largest = std::max(largest, b->Size());
+        }
+    }
+    return {
+        heap_bytes_,
+        heap_bytes_peak_,
+        used_bytes_,
+        used_bytes_peak_,
+        free_bytes_,
+        largest,
+        pools_,
+    };
+}
+
+void TlsfHeap::InsertFree(Block* block) {
+    int fl, sl;
+    MappingInsert(block->Size(), fl, sl);
+
+    Block*& head = free_lists_[fl][sl];
+    block->size_flags |= kFlagFree;
+    block->prev_free = nullptr;
+    block->next_free = head;
+    if (head) {
+        head->prev_free = block;
+    }
+    head = block;
+    fl_bitmap_ |= uint64_t{1} << fl;
+    sl_bitmaps_[fl] |= 1u << sl;
+    free_bytes_ += block->Size();
+}
+
+void TlsfHeap::RemoveFree(Block* block) {
+    int fl, sl;
+    MappingInsert(block->Size(), fl, sl);
+
+    if (block->prev_free) {
+        block->prev_free->next_free = block->next_free;
+    } else {
+        free_lists_[fl][sl] = block->next_free;
+        if (block->next_free == nullptr) {
+            sl_bitmaps_[fl] &= ~(1u << sl);
+            if (sl_bitmaps_[fl] == 0) {
+                fl_bitmap_ &= ~(uint64_t{1} << fl);
+            }
+        }
+    }
+    if (block->next_free) {
+        block->next_free->prev_free = block->prev_free;
+    }
+    block->size_flags &= ~kFlagFree;
+    free_bytes_ -= block->Size();
+}
+
+TlsfHeap::Block* TlsfHeap::TakeFree(size_t size) {
+    int fl, sl;
+    MappingInsert(RoundUpToClass(size), fl, sl);
+    if (fl >= kFLCount) {
+        return nullptr;
+    }
+
+    uint32_t sl_map = sl_bitmaps_[fl] & (~0u << sl);
+    if (sl_map == 0) {
+        const uint64_t fl_map = fl_bitmap_ & (~uint64_t{0} << (fl + 1));
+        if (fl_map == 0) {
+            return nullptr;
+        }
+        fl = __builtin_ctzl(fl_map);
+        sl_map = sl_bitmaps_[fl];
+    }
+    sl = __builtin_ctz(sl_map);
+
+    Block* block = free_lists_[fl][sl];
+    RemoveFree(block);
+    return block;
+}
+
+void TlsfHeap::TrimTail(Block* block, size_t size) {
+    if (block->Size() < size + kMinBlockBytes) {
+        return;
+    }
+    auto rest = reinterpret_cast<Block*>(reinterpret_cast<uintptr_t>(block) + size);
+    rest->size_flags = block->Size() - size;
+    rest->prev_phys = block;
+    rest->NextPhys()->prev_phys = rest;
+    block->size_flags = size;
+    InsertFree(Merge(rest));
+}
+
+TlsfHeap::Block* TlsfHeap::Merge(Block* block) {
+    Block* prev = block->prev_phys;
+    if (prev && prev->IsFree()) {
+        RemoveFree(prev);
+        prev->size_flags = prev->Size() + block->Size();
+        block = prev;
+        block->NextPhys()->prev_phys = block;
+    }
+
+    Block* next = block->NextPhys();
+    if (next->IsFree()) {
+        RemoveFree(next);
+        block->size_flags = block->Size() + next->Size();
+        block->NextPhys()->prev_phys = block;
+    }
+    return block;
+}
+
+bool TlsfHeap::Grow(size_t size) {
+    // メモリ管理の初期化前
+    if (g_memory_manager == nullptr) {
+        return false;
+    }
+
+    const size_t bytes = RoundUpToClass(size) + kPoolHeaderBytes + kHeaderBytes;
+    const size_t frames = std::max<size_t>((bytes + kBytesPerFrame - 1) / kBytesPerFrame, kMinPoolFrames);
+    const auto [frame, err] = g_memory_manager->Allocate(frames);
+    if (err) {
+        return false;
+    }
+
+    auto pool = reinterpret_cast<PoolHeader*>(frame.Frame());
+    pool->frames = frames;
+    auto block = reinterpret_cast<Block*>(reinterpret_cast<uintptr_t>(pool) + kPoolHeaderBytes);
+    block->size_flags = frames * kBytesPerFrame - kPoolHeaderBytes - kHeaderBytes;
+    block->prev_phys = nullptr;
+    Block* sentinel = block->NextPhys();
+    sentinel->size_flags = kHeaderBytes | kFlagLast;
+    sentinel->prev_phys = block;
+    InsertFree(block);
+
+    heap_bytes_ += frames * kBytesPerFrame;
+    heap_bytes_peak_ = std::max(heap_bytes_peak_, heap_bytes_);
+    ++pools_;
+    return true;
+}
+
+void TlsfHeap::ReleasePool(Block* block) {
+    const auto pool_addr = reinterpret_cast<uintptr_t>(block) - kPoolHeaderBytes;
+    const size_t frames = reinterpret_cast<PoolHeader*>(pool_addr)->frames;
+    g_memory_manager->Free(FrameID{pool_addr / kBytesPerFrame}, frames);
+    heap_bytes_ -= frames * kBytesPerFrame;
+    --pools_;
+}
+
+TlsfHeap g_kernel_heap;
+
+extern "C" void* KernelHeapAllocate(size_t bytes, size_t align) {
+    return g_kernel_heap.Allocate(bytes, align);
+}
+
+extern "C" void KernelHeapFree(void* p) {
+    g_kernel_heap.Free(p);
+}
+
+extern "C" void* KernelHeapReallocate(void* p, size_t bytes) {
+    return g_kernel_heap.Reallocate(p, bytes);
+}
@@ -0,0 +1,85 @@
+/// カーネルヒープ : TLSF（Two-Level Segregated Fit）によるmalloc/freeの実装
+/// 必要に応じてBitmapMemoryManagerからフレーム単位で領域（プール）を取得し、
+/// プール全体が空けば返却する
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+/// ヒープの統計情報（byte単位）
+struct HeapStat {
+    /// 物理フレームから取得している領域の合計
+    size_t heap_bytes;
+    size_t heap_bytes_peak;
+    /// 使用中のブロックの合計（ブロックヘッダを含む）
+    size_t used_bytes;
+    size_t used_bytes_peak;
+    /// 空きブロックの合計
+    size_t free_bytes;
+    /// 最大の空きブロック（free_bytesとの比が断片化の指標になる）
+    size_t largest_free_bytes;
+    size_t pools;
+};
+
+/// 空きブロックを大きさで2段階に分類して管理し、確保・解放を定数時間で行う
+/// 第1段階は大きさの最上位ビット、第2段階はその下位kSLLog2ビットで分類する
+class TlsfHeap {
+public:
+    /// 返すアドレスのアラインメント
+    static constexpr size_t kAlign = 16;
+    static const int kSLLog2 = 4;
+    static const int kSLCount = 1 << kSLLog2;
+    /// 第1段階の分類の上限（2^kFLIndexMax byte未満のブロックを扱う）
+    static const int kFLIndexMax = 40;
+    static const int kFLShift = kSLLog2 + 4; // 4 = log2(kAlign)
+    static const int kFLCount = kFLIndexMax - kFLShift + 1;
+    /// 一度に取得するプールの最小フレーム数（64KiB）
+    static constexpr size_t kMinPoolFrames = 16;
+
+    /// constexprなので静的変数として定数初期化され、グローバルコンストラクタを必要としない
+    constexpr TlsfHeap() {}
+
+    /// alignは2のべき乗。確保できなければnullptr
+    void* Allocate(size_t bytes, size_t align = kAlign);
+    void Free(void* p);
+    void* Reallocate(void* p, size_t bytes);
+    HeapStat Stat() const;
+
+private:
+    struct Block;
+
+    /// 空きリストを持つ第1段階の分類
+    uint64_t fl_bitmap_{0};
+    /// 第1段階ごとの、空きリストを持つ第2段階の分類
+    std::array<uint32_t, kFLCount> sl_bitmaps_{};
+    std::array<std::array<Block*, kSLCount>, kFLCount> free_lists_{};
+
+    size_t heap_bytes_{0}, heap_bytes_peak_{0};
+    size_t used_bytes_{0}, used_bytes_peak_{0};
+    size_t free_bytes_{0};
+    size_t pools_{0};
+
+    void InsertFree(Block* block);
+    void RemoveFree(Block* block);
+    /// size以上の空きブロックを探して空きリストから外す
+    Block* TakeFree(size_t size);
+    /// blockの先頭sizeバイトを残し、後ろを空きブロックとして返却
+    void TrimTail(Block* block, size_t size);
+    /// 物理的に隣接する空きブロックと結合
+    Block* Merge(Block* block);
+    /// size以上のブロックを含むプールを追加
+    bool Grow(size_t size);
+    /// 空になったプールをフレームごと返却
+    void ReleasePool(Block* block);
+};
+
+extern TlsfHeap g_kernel_heap;
+
+/// newlib_support.cのmalloc系関数から呼ばれる
+extern "C" {
+    void* KernelHeapAllocate(size_t bytes, size_t align);
+    void KernelHeapFree(void* p);
+    void* KernelHeapReallocate(void* p, size_t bytes);
+}
@@ -39,6 +39,11 @@ namespace {
         NotifyEndOfInterrupt();
     }
 
+    /// 起こされたアイドルタスクがhltの後で待機列を確認するので、ここでは何もしない
+    __attribute__((interrupt)) void IntHandlerWakeup(InterruptFrame* frame) {
+        NotifyEndOfInterrupt();
+    }
+
     void PrintHex(uint64_t value, int width, Vector2D<int> pos) {
         for (int i = 0; i < width; i++) {
             int x = (value >> 4 * (width - i - 1)) & 0xfu;
@@ -122,7 +127,6 @@ namespace {
     FaultHandlerNoError(OF);
     FaultHandlerNoError(BR);
     FaultHandlerNoError(UD);
-    FaultHandlerNoError(NM);
     FaultHandlerWithError(DF);
     FaultHandlerWithError(TS);
     FaultHandlerWithError(NP);
@@ -145,6 +149,7 @@ void InitializeInterrupt() {
     };
     // IDTをCPUに登録
     set_idt_entry(InterruptVector::kXHCI, IntHandlerXHCI);
+    set_idt_entry(InterruptVector::kWakeup, IntHandlerWakeup);
     // タイマ割り込みでISTを使うよう設定する
     SetIDTEntry(g_idt[InterruptVector::kLAPICTimer],
                 MakeIDTAttr(DescriptorType::kInterruptGate,
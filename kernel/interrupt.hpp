@@ -42,6 +42,8 @@ public:
     enum Number {
         kXHCI = 0x40,
         kLAPICTimer = 0x41,
+        /// アイドル中のCPUコアを起こすIPI
+        kWakeup = 0x42,
     };
 };
 
@@ -85,4 +87,23 @@ void SetIDTEntry(InterruptDescriptor& desc,
 
 void NotifyEndOfInterrupt();
 
+/// スコープの間だけ割り込みを禁止し、抜けるときに元の状態（RFLAGS.IF）に戻す
+/// 割り込みハンドラからも呼ばれうる処理（メモリ確保など）で使う
+class InterruptGuard {
+public:
+    InterruptGuard() {
+        __asm__ volatile("pushfq\n\tpopq %0\n\tcli" : "=r"(rflags_) : : "memory");
+    }
+    ~InterruptGuard() {
+        if (rflags_ & (1u << 9)) { // IF
+            __asm__ volatile("sti" : : : "memory");
+        }
+    }
+    InterruptGuard(const InterruptGuard&) = delete;
+    InterruptGuard& operator=(const InterruptGuard&) = delete;
+
+private:
+    uint64_t rflags_;
+};
+
 void InitializeInterrupt();
@@ -12,10 +12,24 @@ namespace {
         auto it = std::remove_if(c.begin(), c.end(), pred);
         c.erase(it, c.end());
     }
+
+    SlabCache g_layer_cache{"Layer", sizeof(Layer), alignof(Layer)};
 } // namespace
 
 Layer::Layer(unsigned int id) : id_{id} {}
 
+void* Layer::operator new(size_t size) {
+    void* p = g_layer_cache.Allocate();
+    if (p == nullptr) {
+        std::get_new_handler()();
+    }
+    return p;
+}
+
+void Layer::operator delete(void* p) {
+    g_layer_cache.Free(p);
+}
+
 unsigned int Layer::ID() const {
     return id_;
 }
@@ -270,11 +284,11 @@ void InitializeLayer() {
     const auto screen_size = ScreenSize();
 
     // 背景ウィンドウ
-    auto bg_window = std::make_shared<Window>(screen_size.x, screen_size.y, g_screen_config.pixel_format);
+    auto bg_window = MakeSlabShared<Window>(screen_size.x, screen_size.y, g_screen_config.pixel_format);
     DrawDesktop(*bg_window->Writer());
 
     // コンソール
-    auto console_window = std::make_shared<Window>(Console::kColumns * 8, Console::kRows * 16, g_screen_config.pixel_format);
+    auto console_window = MakeSlabShared<Window>(Console::kColumns * 8, Console::kRows * 16, g_screen_config.pixel_format);
     // レイヤーマネージャーの準備が整ったので、コンソールをレイヤーの仕組みに載せ替える
     g_console->SetWindow(console_window);
 
@@ -8,6 +8,7 @@
 
 #include "graphics.hpp"
 #include "message.hpp"
+#include "slab.hpp"
 #include "window.hpp"
 
 /// 1つの描画層
@@ -17,6 +18,9 @@ class Layer {
 public:
     /// 指定IDを持つレイヤーを生成
     Layer(unsigned int id = 0);
+    /// Layerは専用のスラブキャッシュから確保
+    static void* operator new(size_t size);
+    static void operator delete(void* p);
     unsigned int ID() const;
 
     /// 既存のウィンドウはこのレイヤーから外れる
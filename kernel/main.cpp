@@ -8,10 +8,12 @@
 #include <vector>
 
 #include "acpi.hpp"
+#include "app_cache.hpp"
 #include "asmfunc.h"
 #include "console.hpp"
 #include "fat.hpp"
 #include "font.hpp"
+#include "fpu.hpp"
 #include "frame_buffer_config.hpp"
 #include "graphics.hpp"
 #include "interrupt.hpp"
@@ -22,9 +24,11 @@
 #include "memory_map.hpp"
 #include "message.hpp"
 #include "mouse.hpp"
+#include "page_cache.hpp"
 #include "paging.hpp"
 #include "pci.hpp"
 #include "segment.hpp"
+#include "smp.hpp"
 #include "syscall.hpp"
 #include "task.hpp"
 #include "terminal.hpp"
@@ -46,7 +50,7 @@ int printk(const char* format, ...) {
 std::shared_ptr<TopLevelWindow> g_main_window;
 unsigned int g_main_window_layer_id;
 void InitializeMainWindow() {
-    g_main_window = std::make_shared<TopLevelWindow>(160, 52, g_screen_config.pixel_format, "Hello Window");
+    g_main_window = MakeSlabShared<TopLevelWindow>(160, 52, g_screen_config.pixel_format, "Hello Window");
 
     g_main_window_layer_id = g_layer_manager->NewLayer()
                                  .SetWindow(g_main_window)
@@ -62,7 +66,7 @@ void InitializeTextWindow() {
     const int win_w = 160;
     const int win_h = 52;
 
-    g_text_window = std::make_shared<TopLevelWindow>(win_w, win_h, g_screen_config.pixel_format, "Text Box Test");
+    g_text_window = MakeSlabShared<TopLevelWindow>(win_w, win_h, g_screen_config.pixel_format, "Text Box Test");
     DrawTextbox(*g_text_window->InnerWriter(), {0, 0}, g_text_window->InnerSize());
 
     g_text_window_layer_id = g_layer_manager->NewLayer()
@@ -154,16 +158,23 @@ extern "C" void KernelMainNewStack(const FrameBufferConfig& frame_buffer_config,
     const int kTextboxCursorTimer = 1;
     const int kTimer05sec = static_cast<int>(kTimerFreq * 0.5);
     // 0,5secでタイムアウトするタイマ
-    g_timer_manager->AddTimer(Timer{kTimer05sec, kTextboxCursorTimer, kMainTaskID});
+    if (auto [id, err] = g_timer_manager->AddTimer(Timer{kTimer05sec, kTextboxCursorTimer, kMainTaskID}); err) {
+        Log(kError, "failed to add the cursor timer: %s\n", err.Name());
+    }
     bool textbox_cursor_visible = false;
 
     // システムコール
     InitializeSyscall();
 
+    // FPU/SSE/AVX（タスクごとの保存領域の大きさが決まる）
+    InitializeFPU();
+
     // マルチタスク
     InitializeTask();
     // このタスク（KernelMainStack()）
     Task& main_task = g_task_manager->CurrentTask();
+    // BSP以外のCPUコア
+    InitializeSMP();
 
     // USBデバイス
     // xHCIは初期化するとすぐに割り込みが発生するので、タスク機能を初期化してからにする
@@ -171,11 +182,14 @@ extern "C" void KernelMainNewStack(const FrameBufferConfig& frame_buffer_config,
     InitializeKeyboard();
     InitializeMouse();
 
-    // コピーオンライトの仕組みを初期化
-    g_app_loads = new std::map<fat::DirectoryEntry*, AppLoadInfo>;
+    // 起動したアプリのロード結果を保持し、次回の起動で使い回すキャッシュ
+    g_app_images = new AppImageCache;
+    // メモリマップドファイルのページキャッシュ
+    g_page_cache = new PageCache;
     // ターミナル
     g_task_manager->NewTask()
         .InitContext(TaskTerminal, 0)
+        .Detach()
         .Wakeup();
 
     char str[128];
@@ -189,7 +203,8 @@ extern "C" void KernelMainNewStack(const FrameBufferConfig& frame_buffer_config,
         __asm__("sti");
         // 割り込みが発生すると、この次の行から処理を再開
 
-        sprintf(str, "%010lu", tick);
+        // CurrentTick()はマイクロ秒単位なので、以前と同じ10msec単位で表示する
+        sprintf(str, "%010lu", tick / (kTimerFreq / 100));
         FillRectangle(*g_main_window->InnerWriter(), {20, 4}, {8 * 10, 16}, {0xc6, 0xc6, 0xc6});
         WriteString(*g_main_window->InnerWriter(), {20, 4}, str, {0, 0, 0});
         // カウンタの表示はメインウィンドウだけを再描画
@@ -213,8 +228,11 @@ extern "C" void KernelMainNewStack(const FrameBufferConfig& frame_buffer_config,
             // カーソル点滅タイマがタイムアウトした場合
             if (msg->arg.timer.value == kTextboxCursorTimer) {
                 __asm__("cli");
-                g_timer_manager->AddTimer(Timer{msg->arg.timer.timeout + kTimer05sec, kTextboxCursorTimer, kMainTaskID});
+                auto [id, err] = g_timer_manager->AddTimer(Timer{msg->arg.timer.timeout + kTimer05sec, kTextboxCursorTimer, kMainTaskID});
                 __asm__("sti");
+                if (err) {
+                    Log(kError, "failed to add the cursor timer: %s\n", err.Name());
+                }
                 textbox_cursor_visible = !textbox_cursor_visible;
                 DrawTextCursor(textbox_cursor_visible);
                 g_layer_manager->Draw(g_text_window_layer_id);
@@ -230,6 +248,7 @@ extern "C" void KernelMainNewStack(const FrameBufferConfig& frame_buffer_config,
                        msg->arg.keyboard.keycode == 59 /* F2 */) {
                 g_task_manager->NewTask()
                     .InitContext(TaskTerminal, 0)
+                    .Detach()
                     .Wakeup();
             } else {
                 // アクティブなレイヤIDからタスクを検索し、そのタスクにメッセージを通知
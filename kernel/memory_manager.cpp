@@ -1,132 +1,525 @@
 #include "memory_manager.hpp"
 
+#include <algorithm>
 #include <bitset>
+#include <cstring>
 
 #include "logger.hpp"
 
-BitmapMemoryManager::BitmapMemoryManager()
-    : alloc_map_{}, range_begin_{FrameID{0}}, range_end_{FrameID{kFrameCount}} {
+void SummaryBitmap::Init(LineType* buf, size_t num_bits) {
+    for (int l = 0; l < kLevels; l++) {
+        num_bits = (num_bits + kBitsPerLine - 1) / kBitsPerLine;
+        lines_[l] = buf;
+        num_lines_[l] = num_bits;
+        buf += num_bits;
+    }
+    Reset();
 }
 
-WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames) {
-    size_t start_frame_id = range_begin_.ID();
-    // 線形探索（ファーストフィット）
-    while (true) {
-        size_t i = 0;
-        for (; i < num_frames; i++) {
-            if (range_end_.ID() <= start_frame_id + i) {
-                return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
-            }
-            if (GetBit(FrameID(start_frame_id + i))) {
-                break;
+void SummaryBitmap::Reset() {
+    for (int l = 0; l < kLevels; l++) {
+        memset(lines_[l], 0, num_lines_[l] * sizeof(LineType));
+    }
+}
+
+bool SummaryBitmap::Get(size_t index) const {
+    return (lines_[0][index / kBitsPerLine] >> (index % kBitsPerLine)) & 1;
+}
+
+void SummaryBitmap::Set(size_t index) {
+    for (int l = 0; l < kLevels; l++) {
+        auto& line = lines_[l][index / kBitsPerLine];
+        const bool was_empty = line == 0;
+        line |= static_cast<LineType>(1) << (index % kBitsPerLine);
+        // 上位の段は「空でない」ことを表すので、空から変化したときだけ伝播させる
+        if (!was_empty) {
+            break;
+        }
+        index /= kBitsPerLine;
+    }
+}
+
+void SummaryBitmap::Clear(size_t index) {
+    for (int l = 0; l < kLevels; l++) {
+        auto& line = lines_[l][index / kBitsPerLine];
+        line &= ~(static_cast<LineType>(1) << (index % kBitsPerLine));
+        if (line != 0) {
+            break;
+        }
+        index /= kBitsPerLine;
+    }
+}
+
+size_t SummaryBitmap::FindFirst() const {
+    // 最上段だけは線形探索（要素数はごくわずか）
+    const int top = kLevels - 1;
+    size_t index = kNotFound;
+    for (size_t i = 0; i < num_lines_[top]; i++) {
+        if (lines_[top][i] != 0) {
+            index = i;
+            break;
+        }
+    }
+    if (index == kNotFound) {
+        return kNotFound;
+    }
+
+    // 立っている最下位ビットをたどって最下段まで降りる
+    for (int l = top; l >= 0; l--) {
+        index = index * kBitsPerLine + __builtin_ctzl(lines_[l][index]);
+    }
+    return index;
+}
+
+namespace {
+    using LineType = FrameBitmap::LineType;
+
+    /// 要素内の[lo, hi]ビットだけが1のマスク
+    LineType RangeMask(size_t lo, size_t hi) {
+        const LineType all = ~static_cast<LineType>(0);
+        return (all << lo) & (all >> (FrameBitmap::kBitsPerLine - 1 - hi));
+    }
+} // namespace
+
+void FrameBitmap::Init(LineType* buf, size_t num_bits) {
+    for (int l = 0; l < kLevels; l++) {
+        const size_t num_lines = (num_bits + kBitsPerLine - 1) / kBitsPerLine;
+        lines_[l] = buf;
+        num_bits_[l] = num_bits;
+        memset(buf, 0, num_lines * sizeof(LineType));
+        buf += num_lines;
+        num_bits = num_lines;
+    }
+}
+
+bool FrameBitmap::Get(size_t index) const {
+    return (lines_[0][index / kBitsPerLine] >> (index % kBitsPerLine)) & 1;
+}
+
+size_t FrameBitmap::SetRange(size_t begin, size_t end, bool value) {
+    end = std::min(end, Size());
+    if (begin >= end) {
+        return 0;
+    }
+    return SetRange(0, begin, end, value);
+}
+
+size_t FrameBitmap::SetRange(int level, size_t begin, size_t end, bool value) {
+    const size_t first = begin / kBitsPerLine;
+    const size_t last = (end - 1) / kBitsPerLine;
+    size_t changed = 0;
+    for (size_t i = first; i <= last; i++) {
+        const size_t lo = i == first ? begin % kBitsPerLine : 0;
+        const size_t hi = i == last ? (end - 1) % kBitsPerLine : kBitsPerLine - 1;
+        const LineType mask = RangeMask(lo, hi);
+        const LineType old = lines_[level][i];
+        lines_[level][i] = value ? (old | mask) : (old & ~mask);
+        changed += __builtin_popcountl(old ^ lines_[level][i]);
+    }
+
+    if (level + 1 == kLevels) {
+        return changed;
+    }
+
+    // 上位の段の満杯フラグを更新
+    // 範囲の中間にある要素はすべて満杯（またはすべて空き）になっているので、両端の要素だけを調べればよい
+    if (value) {
+        const LineType full = ~static_cast<LineType>(0);
+        const size_t summary_begin = lines_[level][first] == full ? first : first + 1;
+        const size_t summary_end = lines_[level][last] == full ? last + 1 : last;
+        if (summary_begin < summary_end) {
+            SetRange(level + 1, summary_begin, summary_end, true);
+        }
+    } else {
+        SetRange(level + 1, first, last + 1, false);
+    }
+    return changed;
+}
+
+size_t FrameBitmap::NextClear(size_t begin) const {
+    return std::min(NextClear(0, begin), Size());
+}
+
+size_t FrameBitmap::NextClear(int level, size_t begin) const {
+    const size_t num_lines = (num_bits_[level] + kBitsPerLine - 1) / kBitsPerLine;
+    size_t i = begin / kBitsPerLine;
+    if (i >= num_lines) {
+        return num_bits_[level];
+    }
+
+    const LineType bits = ~lines_[level][i] & (~static_cast<LineType>(0) << (begin % kBitsPerLine));
+    if (bits != 0) {
+        return i * kBitsPerLine + __builtin_ctzl(bits);
+    }
+
+    // 後続の満杯でない要素を探す
+    if (level + 1 == kLevels) {
+        for (i++; i < num_lines; i++) {
+            if (~lines_[level][i] != 0) {
+                return i * kBitsPerLine + __builtin_ctzl(~lines_[level][i]);
             }
         }
+        return num_bits_[level];
+    }
 
-        if (i == num_frames) { // num_frames分の空き領域を発見
-            MarkAllocated(FrameID{start_frame_id}, num_frames);
-            return {FrameID{start_frame_id}, MAKE_ERROR(Error::kSuccess)};
+    i = NextClear(level + 1, i + 1);
+    if (i >= num_lines) {
+        return num_bits_[level];
+    }
+    return i * kBitsPerLine + __builtin_ctzl(~lines_[level][i]);
+}
+
+size_t FrameBitmap::NextSet(size_t begin) const {
+    const size_t num_lines = (Size() + kBitsPerLine - 1) / kBitsPerLine;
+    size_t i = begin / kBitsPerLine;
+    if (i >= num_lines) {
+        return Size();
+    }
+
+    LineType bits = lines_[0][i] & (~static_cast<LineType>(0) << (begin % kBitsPerLine));
+    while (bits == 0) {
+        if (++i >= num_lines) {
+            return Size();
         }
+        bits = lines_[0][i];
+    }
+    return std::min(i * kBitsPerLine + __builtin_ctzl(bits), Size());
+}
 
-        // 次のフレームから再探索
-        start_frame_id += i + 1;
+size_t FrameBitmap::Count(size_t begin, size_t end) const {
+    end = std::min(end, Size());
+    if (begin >= end) {
+        return 0;
     }
+
+    const size_t first = begin / kBitsPerLine;
+    const size_t last = (end - 1) / kBitsPerLine;
+    size_t sum = 0;
+    for (size_t i = first; i <= last; i++) {
+        const size_t lo = i == first ? begin % kBitsPerLine : 0;
+        const size_t hi = i == last ? (end - 1) % kBitsPerLine : kBitsPerLine - 1;
+        sum += __builtin_popcountl(lines_[0][i] & RangeMask(lo, hi));
+    }
+    return sum;
+}
+
+size_t BitmapMemoryManager::MapLinesFor(size_t frame_count) {
+    // バディの計算が最大ブロック単位で閉じるように切り上げる
+    const size_t max_block = static_cast<size_t>(1) << kMaxOrder;
+    frame_count = (frame_count + max_block - 1) / max_block * max_block;
+
+    size_t sum = FrameBitmap::LinesFor(frame_count);
+    for (int order = 0; order <= kMaxOrder; order++) {
+        sum += SummaryBitmap::LinesFor(frame_count >> order);
+    }
+    return sum;
+}
+
+BitmapMemoryManager::BitmapMemoryManager(size_t frame_count, MapLineType* map_buf)
+    : frame_count_{frame_count},
+      range_begin_{FrameID{0}}, range_end_{FrameID{frame_count}}, allocated_frames_{0} {
+    const size_t max_block = static_cast<size_t>(1) << kMaxOrder;
+    const size_t rounded_count = (frame_count + max_block - 1) / max_block * max_block;
+
+    alloc_map_.Init(map_buf, frame_count);
+    map_buf += FrameBitmap::LinesFor(rounded_count);
+    for (int order = 0; order <= kMaxOrder; order++) {
+        const size_t num_blocks = rounded_count >> order;
+        free_maps_[order].Init(map_buf, num_blocks);
+        map_buf += SummaryBitmap::LinesFor(num_blocks);
+    }
+    InsertFreeRange(range_begin_.ID(), range_end_.ID());
+}
+
+WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames) {
+    const int order = OrderOf(num_frames);
+    if (order > kMaxOrder) {
+        return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+
+    // 要求を満たす最小のオーダーの空きブロックを探す
+    int block_order = order;
+    size_t block_index = SummaryBitmap::kNotFound;
+    for (; block_order <= kMaxOrder; block_order++) {
+        block_index = free_maps_[block_order].FindFirst();
+        if (block_index != SummaryBitmap::kNotFound) {
+            break;
+        }
+    }
+    if (block_index == SummaryBitmap::kNotFound) {
+        return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+    free_maps_[block_order].Clear(block_index);
+
+    // 大きすぎるブロックは半分に分割し、後半（バディ）を空きブロックとして戻す
+    while (block_order > order) {
+        block_order--;
+        block_index *= 2;
+        free_maps_[block_order].Set(block_index + 1);
+    }
+
+    const size_t start_frame_id = block_index << order;
+    SetBits(FrameID{start_frame_id}, num_frames, true);
+    // 2のべき乗に切り上げた分の余りはすぐに返却する
+    const size_t block_end = start_frame_id + (static_cast<size_t>(1) << order);
+    InsertFreeRange(start_frame_id + num_frames, block_end);
+    return {FrameID{start_frame_id}, MAKE_ERROR(Error::kSuccess)};
 }
 
 Error BitmapMemoryManager::Free(FrameID start_frame, size_t num_frames) {
-    for (size_t i = 0; i < num_frames; i++) {
-        SetBit(FrameID{start_frame.ID() + i}, false);
+    SetBits(start_frame, num_frames, false);
+
+    // 管理範囲外のフレームは空きブロックにしない
+    const size_t begin = std::max(start_frame.ID(), range_begin_.ID());
+    const size_t end = std::min(start_frame.ID() + num_frames, range_end_.ID());
+    if (begin < end) {
+        InsertFreeRange(begin, end);
     }
     return MAKE_ERROR(Error::kSuccess);
 }
 
 void BitmapMemoryManager::MarkAllocated(FrameID start_frame, size_t num_frames) {
-    for (size_t i = 0; i < num_frames; i++) {
-        SetBit(FrameID{start_frame.ID() + i}, true);
+    // 指定範囲と重なる空きブロックを取り除き、範囲からはみ出た部分だけを空きブロックとして戻す
+    const size_t begin = start_frame.ID();
+    const size_t end = std::min(begin + num_frames, frame_count_);
+    // 使用中のフレームはどの空きブロックにも含まれないので読み飛ばす
+    size_t frame = alloc_map_.NextClear(begin);
+    while (frame < end) {
+        const int order = FindFreeBlock(frame);
+        if (order < 0) { // 管理範囲外
+            frame = alloc_map_.NextClear(frame + 1);
+            continue;
+        }
+
+        const size_t block_index = frame >> order;
+        const size_t block_begin = block_index << order;
+        const size_t block_end = block_begin + (static_cast<size_t>(1) << order);
+        free_maps_[order].Clear(block_index);
+        if (block_begin < begin) {
+            InsertFreeRange(block_begin, begin);
+        }
+        if (end < block_end) {
+            InsertFreeRange(end, block_end);
+        }
+        frame = alloc_map_.NextClear(block_end);
     }
+
+    SetBits(start_frame, num_frames, true);
 }
 
 void BitmapMemoryManager::SetMemoryRange(FrameID range_begin, FrameID range_end) {
     range_begin_ = range_begin;
-    range_end_ = range_end;
+    range_end_ = FrameID{std::min(range_end.ID(), frame_count_)};
+    allocated_frames_ = alloc_map_.Count(range_begin_.ID(), range_end_.ID());
+
+    // 空きブロック集合を新しい範囲で作り直す
+    for (auto& free_map : free_maps_) {
+        free_map.Reset();
+    }
+
+    // 空きフレームの連続領域を、使用中の領域を読み飛ばしながら順に登録
+    size_t run_begin = alloc_map_.NextClear(range_begin_.ID());
+    while (run_begin < range_end_.ID()) {
+        const size_t run_end = std::min(alloc_map_.NextSet(run_begin), range_end_.ID());
+        InsertFreeRange(run_begin, run_end);
+        run_begin = alloc_map_.NextClear(run_end);
+    }
 }
 
 MemoryStat BitmapMemoryManager::Stat() const {
-    size_t sum = 0;
-    for (int i = range_begin_.ID() / kBitsPerMapLine; i < range_end_.ID() / kBitsPerMapLine; i++) {
-        sum += std::bitset<kBitsPerMapLine>(alloc_map_[i]).count();
-    }
-    return {sum, range_end_.ID() - range_begin_.ID()};
+    return {allocated_frames_, range_end_.ID() - range_begin_.ID()};
 }
 
 bool BitmapMemoryManager::GetBit(FrameID frame) const {
-    auto line_index = frame.ID() / kBitsPerMapLine;
-    auto bit_index = frame.ID() % kBitsPerMapLine;
-
-    return (alloc_map_[line_index] & (static_cast<MapLineType>(1) << bit_index)) != 0;
+    return alloc_map_.Get(frame.ID());
 }
 
-void BitmapMemoryManager::SetBit(FrameID frame, bool allocated) {
-    auto line_index = frame.ID() / kBitsPerMapLine;
-    auto bit_index = frame.ID() % kBitsPerMapLine;
+void BitmapMemoryManager::SetBits(FrameID start_frame, size_t num_frames, bool allocated) {
+    const size_t begin = start_frame.ID();
+    const size_t end = begin + num_frames;
+    const size_t range_begin = std::clamp(range_begin_.ID(), begin, end);
+    const size_t range_end = std::clamp(range_end_.ID(), range_begin, end);
 
+    // 使用中フレーム数はメモリ範囲内の分だけ数える
+    alloc_map_.SetRange(begin, range_begin, allocated);
+    const size_t changed = alloc_map_.SetRange(range_begin, range_end, allocated);
+    alloc_map_.SetRange(range_end, end, allocated);
     if (allocated) {
-        alloc_map_[line_index] |= (static_cast<MapLineType>(1) << bit_index);
+        allocated_frames_ += changed;
     } else {
-        alloc_map_[line_index] &= ~(static_cast<MapLineType>(1) << bit_index);
+        allocated_frames_ -= changed;
     }
 }
 
-extern "C" caddr_t g_program_break, g_program_break_end;
+int BitmapMemoryManager::OrderOf(size_t num_frames) {
+    if (num_frames <= 1) {
+        return 0;
+    }
+    // ceil(log2(num_frames))
+    return 8 * sizeof(unsigned long) - __builtin_clzl(num_frames - 1);
+}
 
-namespace {
-    char g_memory_manager_buf[sizeof(BitmapMemoryManager)];
+void BitmapMemoryManager::InsertFreeBlock(size_t block_index, int order) {
+    // バディも空きブロックなら結合して1つ上のオーダーのブロックにする
+    // 空きブロックは常に管理範囲内にあるので、結合後のブロックも管理範囲に収まる
+    while (order < kMaxOrder) {
+        const size_t buddy_index = block_index ^ 1;
+        if (!free_maps_[order].Get(buddy_index)) {
+            break;
+        }
+        free_maps_[order].Clear(buddy_index);
+        block_index /= 2;
+        order++;
+    }
+    free_maps_[order].Set(block_index);
+}
+
+void BitmapMemoryManager::InsertFreeRange(size_t begin, size_t end) {
+    while (begin < end) {
+        // beginを先頭とする、アライメントが揃っていて範囲に収まる最大のブロック
+        int order = 0;
+        while (order < kMaxOrder &&
+               begin % (static_cast<size_t>(1) << (order + 1)) == 0 &&
+               begin + (static_cast<size_t>(1) << (order + 1)) <= end) {
+            order++;
+        }
+        InsertFreeBlock(begin >> order, order);
+        begin += static_cast<size_t>(1) << order;
+    }
+}
 
-    Error InitializeHeap(BitmapMemoryManager& memory_manager) {
-        // 128MiB
-        const int kHeapFrames = 64 * 512;
-        const auto heap_start = memory_manager.Allocate(kHeapFrames);
-        if (heap_start.error) {
-            return heap_start.error;
+int BitmapMemoryManager::FindFreeBlock(size_t frame) const {
+    for (int order = 0; order <= kMaxOrder; order++) {
+        if (free_maps_[order].Get(frame >> order)) {
+            return order;
         }
+    }
+    return -1;
+}
+
+FrameRefCounts::FrameRefCounts(size_t frame_count, CountType* buf)
+    : frame_count_{frame_count}, counts_{buf} {
+    memset(counts_, 0, frame_count_ * sizeof(CountType));
+}
+
+FrameRefCounts::CountType FrameRefCounts::Get(FrameID frame) const {
+    return frame.ID() < frame_count_ ? counts_[frame.ID()] : 0;
+}
+
+void FrameRefCounts::Set(FrameID frame, CountType count) {
+    if (frame.ID() < frame_count_) {
+        counts_[frame.ID()] = count;
+    }
+}
+
+FrameRefCounts::CountType FrameRefCounts::Increment(FrameID frame) {
+    if (frame.ID() >= frame_count_) {
+        return 0;
+    }
+    auto& count = counts_[frame.ID()];
+    if (count != kStickyCount) {
+        ++count;
+    }
+    return count;
+}
 
-        g_program_break = reinterpret_cast<caddr_t>(heap_start.value.ID() * kBytesPerFrame);
-        g_program_break_end = g_program_break + kHeapFrames * kBytesPerFrame;
-        return MAKE_ERROR(Error::kSuccess);
+FrameRefCounts::CountType FrameRefCounts::Decrement(FrameID frame) {
+    if (frame.ID() >= frame_count_ || counts_[frame.ID()] == 0) {
+        return 0;
     }
+    auto& count = counts_[frame.ID()];
+    if (count != kStickyCount) {
+        --count;
+    }
+    return count;
+}
+
+namespace {
+    char g_memory_manager_buf[sizeof(BitmapMemoryManager)];
+    char g_frame_refs_buf[sizeof(FrameRefCounts)];
 } // namespace
 
 BitmapMemoryManager* g_memory_manager;
+FrameRefCounts* g_frame_refs;
+uintptr_t g_low_frame_addr = 0;
 
 void InitializeMemoryManager(const MemoryMap& memory_map) {
-    ::g_memory_manager = new (g_memory_manager_buf) BitmapMemoryManager;
-
-    // メモリマネージャーにUEFIのメモリマップを伝える
     const auto memory_map_base = reinterpret_cast<uintptr_t>(memory_map.buffer);
+    auto for_each_desc = [&](auto f) {
+        for (uintptr_t iter = memory_map_base;
+             iter < memory_map_base + memory_map.map_size;
+             iter += memory_map.descriptor_size) {
+            f(*reinterpret_cast<MemoryDescriptor*>(iter));
+        }
+    };
+
+    // 利用可能な物理メモリの末尾から、管理するフレーム数を決める
     uintptr_t available_end = 0;
-    for (uintptr_t iter = memory_map_base;
-         iter < memory_map_base + memory_map.map_size;
-         iter += memory_map.descriptor_size) {
-        auto desc = reinterpret_cast<MemoryDescriptor*>(iter);
-        if (available_end < desc->physical_start) {
+    for_each_desc([&](const MemoryDescriptor& desc) {
+        if (IsAvailable(static_cast<MemoryType>(desc.type))) {
+            available_end = std::max(available_end, desc.physical_start + desc.number_of_pages * kUEFIPageSize);
+        }
+    });
+    const size_t frame_count = std::min(static_cast<size_t>(available_end / kBytesPerFrame),
+                                       static_cast<size_t>(BitmapMemoryManager::kMaxFrameCount));
+
+    // 管理領域（ビットマップ群と参照カウント）を置く空き領域を探す
+    // フレーム0はメモリ範囲外なので使わない
+    const size_t bitmap_bytes = BitmapMemoryManager::MapLinesFor(frame_count) * sizeof(BitmapMemoryManager::MapLineType);
+    const size_t map_bytes = bitmap_bytes + frame_count * sizeof(FrameRefCounts::CountType);
+    const size_t map_frames = (map_bytes + kBytesPerFrame - 1) / kBytesPerFrame;
+    // メモリマップ自体もBootServicesData（利用可能と見做す領域）にあり、この後も読むので、重ならない位置に置く
+    const uintptr_t memory_map_end = memory_map_base + memory_map.map_size;
+    uintptr_t map_addr = 0;
+    for_each_desc([&](const MemoryDescriptor& desc) {
+        auto start = std::max<uintptr_t>(desc.physical_start, kLowMemoryEnd);
+        const auto end = desc.physical_start + desc.number_of_pages * kUEFIPageSize;
+        if (start < memory_map_end && memory_map_base < start + map_frames * kBytesPerFrame) {
+            start = (memory_map_end + kBytesPerFrame - 1) / kBytesPerFrame * kBytesPerFrame;
+        }
+        if (map_addr == 0 && IsAvailable(static_cast<MemoryType>(desc.type)) &&
+            start + map_frames * kBytesPerFrame <= end) {
+            map_addr = start;
+        }
+    });
+    if (map_addr == 0) {
+        Log(kError, "no room for the memory manager map (%lu bytes)\n", map_bytes);
+        exit(1);
+    }
+
+    ::g_memory_manager = new (g_memory_manager_buf) BitmapMemoryManager(
+        frame_count, reinterpret_cast<BitmapMemoryManager::MapLineType*>(map_addr));
+    ::g_frame_refs = new (g_frame_refs_buf) FrameRefCounts(
+        frame_count, reinterpret_cast<FrameRefCounts::CountType*>(map_addr + bitmap_bytes));
+
+    // メモリマネージャーにUEFIのメモリマップを伝える
+    available_end = 0;
+    for_each_desc([&](const MemoryDescriptor& desc) {
+        if (available_end < desc.physical_start) {
             g_memory_manager->MarkAllocated(
                 FrameID(available_end / kBytesPerFrame),
-                (desc->physical_start - available_end) / kBytesPerFrame);
+                (desc.physical_start - available_end) / kBytesPerFrame);
         }
 
-        const auto physical_end = desc->physical_start + desc->number_of_pages * kUEFIPageSize;
-        if (IsAvailable(static_cast<MemoryType>(desc->type))) {
+        const auto physical_end = desc.physical_start + desc.number_of_pages * kUEFIPageSize;
+        if (IsAvailable(static_cast<MemoryType>(desc.type))) {
             available_end = physical_end;
         } else {
             g_memory_manager->MarkAllocated(
-                FrameID{desc->physical_start / kBytesPerFrame},
-                desc->number_of_pages * kUEFIPageSize / kBytesPerFrame);
+                FrameID{desc.physical_start / kBytesPerFrame},
+                desc.number_of_pages * kUEFIPageSize / kBytesPerFrame);
         }
-    }
-    g_memory_manager->SetMemoryRange(FrameID{1}, FrameID{available_end / kBytesPerFrame});
+    });
+    g_memory_manager->MarkAllocated(FrameID{map_addr / kBytesPerFrame}, map_frames);
+    g_memory_manager->SetMemoryRange(FrameID{kLowMemoryEnd / kBytesPerFrame}, FrameID{frame_count});
 
-    if (auto err = InitializeHeap(*g_memory_manager)) {
-        Log(kError, "failed to allocate pages: %s at %s:%d",
-            err.Name(), err.File(), err.Line());
-        exit(1);
-    }
-}
\ No newline at end of file
+    // 1MiB未満の利用可能なフレームを1つ覚えておく（フレーム0は使わない）
+    for_each_desc([&](const MemoryDescriptor& desc) {
+        const auto start = std::max<uintptr_t>(desc.physical_start, kBytesPerFrame);
+        if (g_low_frame_addr == 0 && IsAvailable(static_cast<MemoryType>(desc.type)) &&
+            start + kBytesPerFrame <= std::min<uintptr_t>(desc.physical_start + desc.number_of_pages * kUEFIPageSize, kLowMemoryEnd)) {
+            g_low_frame_addr = start;
+        }
+    });
+    // カーネルヒープ（heap.cpp）は最初のmalloc時にここからフレームを取得する
+}
@@ -3,6 +3,7 @@
 #pragma once
 
 #include <array>
+#include <cstdint>
 #include <limits>
 
 #include "error.hpp"
@@ -47,24 +48,119 @@ struct MemoryStat {
     size_t total_frames;
 };
 
-/// ビットマップ配列を用いてページフレーム単位でメモリ管理するクラス
-/// 配列alloc_map_の各ビットがページフレームに対応し、0なら空き、1なら使用中
-/// alloc_map_[n]のmビット目が対応する物理アドレスは次の式で求まる
-///     kFrameBytes * (n * kBitsPerMapLine + m)
+/// 1要素を1ビットで表し、64ビットごとの要約ビットを上位の段に重ねたビットマップ
+/// lines_[l + 1]のiビット目は lines_[l][i] != 0 を表すので、立っているビットを上位の段からたどって O(log n) で探せる
+/// 記憶領域は持たず、呼び出し側が用意したバッファを使う
+class SummaryBitmap {
+public:
+    using LineType = unsigned long;
+    static const auto kBitsPerLine{8 * sizeof(LineType)};
+    /// 要約の段数（最下段を含む）
+    static const int kLevels = 4;
+    /// FindFirst()でビットが見つからなかったことを表す
+    static const size_t kNotFound = std::numeric_limits<size_t>::max();
+
+    /// num_bitsビットを扱うのに必要なバッファの要素数
+    static constexpr size_t LinesFor(size_t num_bits) {
+        size_t sum = 0;
+        for (int l = 0; l < kLevels; l++) {
+            num_bits = (num_bits + kBitsPerLine - 1) / kBitsPerLine;
+            sum += num_bits;
+        }
+        return sum;
+    }
+
+    /// buf : LinesFor(num_bits)個の要素をもつバッファ（0クリアされる）
+    void Init(LineType* buf, size_t num_bits);
+    /// すべてのビットを0にする
+    void Reset();
+    bool Get(size_t index) const;
+    void Set(size_t index);
+    void Clear(size_t index);
+    /// 立っているビットのうち最小の添字を返す
+    size_t FindFirst() const;
+
+private:
+    std::array<LineType*, kLevels> lines_;
+    std::array<size_t, kLevels> num_lines_;
+};
+
+/// ページフレームの使用状況を1ビットで表すビットマップ（0なら空き、1なら使用中）
+/// lines_[l + 1]のiビット目は lines_[l][i] のすべてのビットが1（満杯）であることを表す
+/// 1段目は64フレーム、2段目は4096フレームごとの満杯フラグとなり、空きを探すときは満杯の領域を丸ごと読み飛ばせる
+/// 範囲の設定はマスクを用いて要素（64ビット）単位で行う
+/// 記憶領域は持たず、呼び出し側が用意したバッファを使う
+class FrameBitmap {
+public:
+    using LineType = SummaryBitmap::LineType;
+    static const auto kBitsPerLine{SummaryBitmap::kBitsPerLine};
+    /// 要約の段数（最下段を含む）
+    static const int kLevels = 3;
+
+    /// num_bitsビットを扱うのに必要なバッファの要素数
+    static constexpr size_t LinesFor(size_t num_bits) {
+        size_t sum = 0;
+        for (int l = 0; l < kLevels; l++) {
+            num_bits = (num_bits + kBitsPerLine - 1) / kBitsPerLine;
+            sum += num_bits;
+        }
+        return sum;
+    }
+
+    /// buf : LinesFor(num_bits)個の要素をもつバッファ（0クリアされる）
+    void Init(LineType* buf, size_t num_bits);
+    size_t Size() const { return num_bits_[0]; }
+    bool Get(size_t index) const;
+    /// [begin, end)のビットをまとめて設定
+    /// return : 値が変化したビット数
+    size_t SetRange(size_t begin, size_t end, bool value);
+    /// begin以降で最初の0のビットの添字。なければSize()
+    size_t NextClear(size_t begin) const;
+    /// begin以降で最初の1のビットの添字。なければSize()
+    size_t NextSet(size_t begin) const;
+    /// [begin, end)の1のビットの数
+    size_t Count(size_t begin, size_t end) const;
+
+private:
+    std::array<LineType*, kLevels> lines_;
+    std::array<size_t, kLevels> num_bits_;
+
+    size_t SetRange(int level, size_t begin, size_t end, bool value);
+    size_t NextClear(int level, size_t begin) const;
+};
+
+/// バディシステムでページフレーム単位のメモリ管理を行うクラス
+/// 2^order個の連続したフレームを1ブロックとし、オーダー毎の空きブロック集合（フリーリスト）を持つ
+/// 確保時は要求を満たす最小のオーダーの空きブロックを分割し、解放時は隣接するバディと結合する
+/// オーダー毎の空きブロック集合はSummaryBitmapで表すので、確保・解放ともに O(log n)
+/// alloc_map_は各フレームの使用状況を表すFrameBitmapで、0なら空き、1なら使用中
+/// alloc_map_のnビット目が対応する物理アドレスは kBytesPerFrame * n
+/// 管理領域（ビットマップ群）は物理メモリ量に合わせて呼び出し側が用意する
 class BitmapMemoryManager {
 public:
     /// このメモリ管理クラスで扱える最大の物理メモリ量（byte）
     static const auto kMaxPhysicalMemoryBytes{128_GiB};
     /// kMaxPhysicalMemoryBytesまでの物理メモリを扱うために必要なページフレーム数
-    static const auto kFrameCount{kMaxPhysicalMemoryBytes / kBytesPerFrame};
+    static const auto kMaxFrameCount{kMaxPhysicalMemoryBytes / kBytesPerFrame};
 
     /// ビットマップ配列の要素型
-    using MapLineType = unsigned long;
+    using MapLineType = SummaryBitmap::LineType;
     static const auto kBitsPerMapLine{8 * sizeof(MapLineType)};
 
-    BitmapMemoryManager();
+    /// 最大のブロックのオーダー
+    /// 2^15フレーム = 128MiB
+    static const int kMaxOrder = 15;
+    static_assert(kMaxFrameCount % (1ul << kMaxOrder) == 0);
+
+    /// frame_countフレームを管理するのに必要な管理領域の要素数
+    static size_t MapLinesFor(size_t frame_count);
+
+    /// frame_count : 管理するフレーム数（フレーム番号[0, frame_count)を扱う）
+    /// map_buf : MapLinesFor(frame_count)個の要素をもつ管理領域
+    BitmapMemoryManager(size_t frame_count, MapLineType* map_buf);
 
     /// 要求されたフレーム数の領域を確保して先頭のフレームIDを返す
+    /// 2^kMaxOrderフレームを超える要求には応えられない
     WithError<FrameID> Allocate(size_t num_frames);
     Error Free(FrameID start_frame, size_t num_frames);
     // 使用中領域を設定（使用しているのがUEFIなのかこのメモリマネージャーなのかは問わない）
@@ -77,17 +173,65 @@ public:
     /// 現在のメモリ状態
     MemoryStat Stat() const;
 
+    /// 要求フレーム数を収める最小のオーダー
+    static int OrderOf(size_t num_frames);
+
 private:
+    /// 管理できるフレーム数
+    size_t frame_count_;
     /// 1ページフレームを1ビットで表したビットマップ
-    std::array<MapLineType, kFrameCount / kBitsPerMapLine> alloc_map_;
+    FrameBitmap alloc_map_;
+    /// free_maps_[k]のiビット目が1 : フレーム[i * 2^k, (i + 1) * 2^k)がオーダーkの空きブロック
+    std::array<SummaryBitmap, kMaxOrder + 1> free_maps_;
 
     /// このメモリマネージャーで扱うメモリ範囲 : [range_start_, range_end_)
     FrameID range_begin_;
     FrameID range_end_;
+    /// メモリ範囲内の使用中フレーム数
+    size_t allocated_frames_;
 
     bool GetBit(FrameID framne) const;
-    void SetBit(FrameID frame, bool allocated);
+    /// 連続したフレームの使用状況をまとめて設定
+    void SetBits(FrameID start_frame, size_t num_frames, bool allocated);
+
+    /// 空きブロックを登録し、可能な限りバディと結合する
+    void InsertFreeBlock(size_t block_index, int order);
+    /// フレーム範囲[begin, end)をアライメントの揃ったブロックに分解して空きブロックとして登録
+    void InsertFreeRange(size_t begin, size_t end);
+    /// 指定フレームを含む空きブロックを探す
+    /// return : 見つかったブロックのオーダー。なければ -1
+    int FindFreeBlock(size_t frame) const;
 };
 
+/// 物理フレームごとの参照カウント
+/// コピーオンライトで複数の階層ページング構造から共有されるフレームについて、
+/// 最後の参照が外れたときに解放し、参照が1つだけなら複製せずに書き込み可にするために使う
+class FrameRefCounts {
+public:
+    using CountType = uint16_t;
+    /// この値に達したら以後は増減させず、解放もしない（ゼロページのように大量に共有されるフレーム向け）
+    static const CountType kStickyCount = std::numeric_limits<CountType>::max();
+
+    /// frame_count個の要素をもつbufを使う。全フレームの参照カウントを0にする
+    FrameRefCounts(size_t frame_count, CountType* buf);
+
+    CountType Get(FrameID frame) const;
+    void Set(FrameID frame, CountType count);
+    /// return : 変更後の参照カウント
+    CountType Increment(FrameID frame);
+    CountType Decrement(FrameID frame);
+
+private:
+    size_t frame_count_;
+    CountType* counts_;
+};
+
+/// 1MiB未満の物理メモリはメモリマネージャーで割り当てない
+/// リアルモードで動き出すAPの起動コードなど、1MiB未満に置く必要があるものに残しておく
+static const auto kLowMemoryEnd{1_MiB};
+
 extern BitmapMemoryManager* g_memory_manager;
+extern FrameRefCounts* g_frame_refs;
+/// 1MiB未満で利用可能な4KiBフレームの物理アドレス（見つからなければ0）
+extern uintptr_t g_low_frame_addr;
 void InitializeMemoryManager(const MemoryMap& memory_map);
\ No newline at end of file
@@ -178,7 +178,7 @@ void Mouse::SetPosition(Vector2D<int> pos) {
 }
 
 void InitializeMouse() {
-    auto mouse_window = std::make_shared<Window>(kMouseCursorWidth, kMouseCursorHeight, g_screen_config.pixel_format);
+    auto mouse_window = MakeSlabShared<Window>(kMouseCursorWidth, kMouseCursorHeight, g_screen_config.pixel_format);
     mouse_window->SetTransparentColor(kMouseTransparentColor);
     DrawMouseCursor(mouse_window->Writer(), {0, 0});
 
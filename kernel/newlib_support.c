@@ -1,4 +1,8 @@
 #include <errno.h>
+#include <malloc.h>
+#include <reent.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -6,21 +10,77 @@ void _exit(void) {
     while (1) __asm__("hlt");
 }
 
-/// program breakとその上限
-caddr_t g_program_break, g_program_break_end;
+/// カーネルヒープ（heap.cpp）
+void* KernelHeapAllocate(size_t bytes, size_t align);
+void KernelHeapFree(void* p);
+void* KernelHeapReallocate(void* p, size_t bytes);
 
-/// program break を増減
-/// program break : 各プロセスが使えるメモリ領域の末尾アドレス
-/// これを後ろにずらすことで新たなメモリ領域を確保できる
-caddr_t sbrk(int incr) {
-    if (g_program_break == 0 || g_program_break_end <= g_program_break + incr) {
-        errno = ENOMEM;
-        return (caddr_t)-1;
+/// newlibのmallocの代わりにカーネルヒープを使う
+/// newlib内部から呼ばれる再入可能版（_r）も置き換え、newlibのmallocがリンクされないようにする
+void* _malloc_r(struct _reent* r, size_t size) {
+    void* p = KernelHeapAllocate(size, 16);
+    if (p == 0) {
+        r->_errno = ENOMEM;
     }
+    return p;
+}
+
+void _free_r(struct _reent* r, void* p) {
+    KernelHeapFree(p);
+}
 
-    caddr_t prev_break = g_program_break;
-    g_program_break += incr;
-    return prev_break;
+void* _calloc_r(struct _reent* r, size_t n, size_t size) {
+    if (size != 0 && n > (size_t)-1 / size) {
+        r->_errno = ENOMEM;
+        return 0;
+    }
+    void* p = _malloc_r(r, n * size);
+    if (p) {
+        memset(p, 0, n * size);
+    }
+    return p;
+}
+
+void* _realloc_r(struct _reent* r, void* p, size_t size) {
+    void* new_p = KernelHeapReallocate(p, size);
+    if (new_p == 0) {
+        r->_errno = ENOMEM;
+    }
+    return new_p;
+}
+
+void* _memalign_r(struct _reent* r, size_t align, size_t size) {
+    void* p = KernelHeapAllocate(size, align);
+    if (p == 0) {
+        r->_errno = ENOMEM;
+    }
+    return p;
+}
+
+void* malloc(size_t size) {
+    return _malloc_r(_REENT, size);
+}
+
+void free(void* p) {
+    _free_r(_REENT, p);
+}
+
+void* calloc(size_t n, size_t size) {
+    return _calloc_r(_REENT, n, size);
+}
+
+void* realloc(void* p, size_t size) {
+    return _realloc_r(_REENT, p, size);
+}
+
+void* memalign(size_t align, size_t size) {
+    return _memalign_r(_REENT, align, size);
+}
+
+/// ヒープはheap.cppで管理するので、program breakは動かさない
+caddr_t sbrk(int incr) {
+    errno = ENOMEM;
+    return (caddr_t)-1;
 }
 
 int getpid(void) {
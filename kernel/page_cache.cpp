@@ -0,0 +1,132 @@
+#include "page_cache.hpp"
+
+#include <algorithm>
+#include <vector>
+
+#include "interrupt.hpp"
+#include "memory_manager.hpp"
+
+namespace {
+    /// どのタスクにもマップされていない（参照がキャッシュの分だけ）
+    bool Unmapped(PageMapEntry* frame) {
+        return g_frame_refs->Get(FrameID{reinterpret_cast<uintptr_t>(frame) / kBytesPerFrame}) <= 1;
+    }
+} // namespace
+
+WithError<PageMapEntry*> PageCache::Get(const std::shared_ptr<IFileDescriptor>& fd, uint64_t page_index) {
+    InterruptGuard guard;
+    const auto key = std::make_pair(fd->FileID(), page_index);
+    if (auto it = pages_.find(key); it != pages_.end()) {
+        ++hits_;
+        it->second.last_use = ++use_clock_;
+        return {it->second.frame, MAKE_ERROR(Error::kSuccess)};
+    }
+
+    ++misses_;
+    if (auto frame = reinterpret_cast<PageMapEntry*>(fd->PageFrame(page_index * kBytesPerFrame))) {
+        // 解放されず、常に共有中として扱われる（書き込むとコピーオンライトでコピーされる）
+        // 参照カウントの管理範囲外のフレームであれば使わない
+        const FrameID frame_id{reinterpret_cast<uintptr_t>(frame) / kBytesPerFrame};
+        g_frame_refs->Set(frame_id, FrameRefCounts::kStickyCount);
+        if (g_frame_refs->Get(frame_id) == FrameRefCounts::kStickyCount) {
+            pages_[key] = Page{frame, fd, ++use_clock_, false, true};
+            return {frame, MAKE_ERROR(Error::kSuccess)};
+        }
+    }
+
+    auto [frame, err] = NewPageMap();
+    if (err) {
+        return {nullptr, err};
+    }
+    // ファイル末尾を含むページの残りは0のまま
+    fd->Load(frame, kBytesPerFrame, page_index * kBytesPerFrame);
+    pages_[key] = Page{frame, fd, ++use_clock_, false, false};
+    return {frame, MAKE_ERROR(Error::kSuccess)};
+}
+
+void PageCache::MarkDirty(uint64_t file_id, uint64_t page_index) {
+    InterruptGuard guard;
+    if (auto it = pages_.find(std::make_pair(file_id, page_index)); it != pages_.end()) {
+        it->second.dirty = true;
+    }
+}
+
+size_t PageCache::Reclaim(size_t num_pages) {
+    InterruptGuard guard;
+    using Iterator = decltype(pages_)::iterator;
+    std::vector<Iterator> victims;
+    for (auto it = pages_.begin(); it != pages_.end(); ++it) {
+        // ボリュームイメージのページは回収してもフレームは空かない
+        if (!it->second.direct && Unmapped(it->second.frame)) {
+            victims.push_back(it);
+        }
+    }
+    num_pages = std::min(num_pages, victims.size());
+    std::partial_sort(victims.begin(), victims.begin() + num_pages, victims.end(),
+                      [](Iterator a, Iterator b) { return a->second.last_use < b->second.last_use; });
+
+    for (size_t i = 0; i < num_pages; i++) {
+        auto it = victims[i];
+        if (it->second.dirty) {
+            WriteBack(it->first.second, it->second);
+        }
+        FreePageMap(it->second.frame);
+        pages_.erase(it);
+    }
+    evictions_ += num_pages;
+    return num_pages;
+}
+
+void PageCache::Sync() {
+    InterruptGuard guard;
+    for (auto& [key, page] : pages_) {
+        if (page.dirty) {
+            WriteBack(key.second, page);
+        }
+    }
+}
+
+void PageCache::Invalidate(uint64_t file_id) {
+    InterruptGuard guard;
+    auto it = pages_.lower_bound(std::make_pair(file_id, uint64_t{0}));
+    while (it != pages_.end() && it->first.first == file_id) {
+        FreePageMap(it->second.frame);
+        it = pages_.erase(it);
+    }
+}
+
+PageCacheStat PageCache::Stat() const {
+    InterruptGuard guard;
+    size_t dirty = 0, direct = 0;
+    for (const auto& [key, page] : pages_) {
+        dirty += page.dirty;
+        direct += page.direct;
+    }
+    return {hits_, misses_, pages_.size(), dirty, direct, evictions_};
+}
+
+size_t PageCache::FilePages(uint64_t file_id) const {
+    InterruptGuard guard;
+    size_t pages = 0;
+    for (auto it = pages_.lower_bound(std::make_pair(file_id, uint64_t{0}));
+         it != pages_.end() && it->first.first == file_id; ++it) {
+        pages += !it->second.direct;
+    }
+    return pages;
+}
+
+void PageCache::WriteBack(uint64_t page_index, Page& page) {
+    // ファイルそのものに書き込まれている
+    if (page.direct) {
+        page.dirty = false;
+        return;
+    }
+    const uint64_t offset = page_index * kBytesPerFrame;
+    page.fd->Store(page.frame, kBytesPerFrame, offset);
+    // マップしているタスクが残っていれば、フォルトせずに書き込める状態のままなので印を残す
+    if (Unmapped(page.frame)) {
+        page.dirty = false;
+    }
+}
+
+PageCache* g_page_cache;
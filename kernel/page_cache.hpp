@@ -0,0 +1,65 @@
+/// ページキャッシュ : メモリマップドファイルの内容を（ファイル、ページ）単位でフレームに保持し、タスク間で共有する
+/// 同じファイルを複数のタスクがマップしても、あるいはアプリを再実行しても、ファイルの読み込みとフレームは1回分で済む
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <utility>
+
+#include "error.hpp"
+#include "file.hpp"
+#include "paging.hpp"
+
+/// ページキャッシュの統計情報
+struct PageCacheStat {
+    uint64_t hits, misses;
+    /// 保持しているページ、うち書き戻しの必要なページ、
+    /// うちボリュームイメージをそのままマップしている（フレームを消費しない）ページ
+    size_t resident_pages, dirty_pages, direct_pages;
+    /// 回収したページ
+    uint64_t evictions;
+};
+
+class PageCache {
+public:
+    /// 指定ファイルのpage_index番目のページを保持するフレーム（参照カウントはキャッシュの分の1を含む）
+    /// キャッシュに無ければ、ファイルのデータがメモリ上で4KiB境界に揃っていればそのフレームを使い（ゼロコピー）、
+    /// そうでなければフレームを確保してファイルから読み込む
+    /// fdはFileID()が0でないこと
+    WithError<PageMapEntry*> Get(const std::shared_ptr<IFileDescriptor>& fd, uint64_t page_index);
+    /// 共有マッピングで書き込まれたページに印を付け、回収時に書き戻す
+    void MarkDirty(uint64_t file_id, uint64_t page_index);
+    /// どのタスクもマップしていないページのうち、最近使われていないものから最大num_pagesページ回収する
+    /// return : 回収したページ数
+    size_t Reclaim(size_t num_pages);
+    /// 書き込まれたページをファイルに書き戻す
+    void Sync();
+    /// ファイルが書き換えられたので、そのファイルのページを全て捨てる（マップ中のフレームはタスク側に残る）
+    void Invalidate(uint64_t file_id);
+    PageCacheStat Stat() const;
+    /// 指定ファイルについて保持しているページのうち、フレームを消費しているもの
+    size_t FilePages(uint64_t file_id) const;
+
+private:
+    struct Page {
+        PageMapEntry* frame;
+        std::shared_ptr<IFileDescriptor> fd;
+        /// 最後に使われた時点（use_clock_の値）
+        uint64_t last_use;
+        bool dirty;
+        /// frameはボリュームイメージの一部（参照カウントは固定で、書き込みはそのままファイルに反映される）
+        bool direct;
+    };
+
+    /// key : (FileID(), ページ番号)
+    std::map<std::pair<uint64_t, uint64_t>, Page> pages_{};
+    uint64_t use_clock_{0};
+    uint64_t hits_{0}, misses_{0}, evictions_{0};
+
+    void WriteBack(uint64_t page_index, Page& page);
+};
+
+extern PageCache* g_page_cache;
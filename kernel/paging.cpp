@@ -1,16 +1,22 @@
 #include "paging.hpp"
 
+#include <algorithm>
 #include <array>
+#include <cpuid.h>
 
 #include "asmfunc.h"
+#include "interrupt.hpp"
 #include "logger.hpp"
 #include "memory_manager.hpp"
+#include "page_cache.hpp"
 #include "task.hpp"
 
 namespace {
     const uint64_t kPageSize4K = 4096;
     const uint64_t kPageSize2M = 512 * kPageSize4K;
     const uint64_t kPageSize1G = 512 * kPageSize2M;
+    /// アプリ用の仮想アドレス空間の先頭（カノニカルアドレスの後半）
+    const uint64_t kAppSpaceBegin = 0xffff800000000000;
 
     /// 以下の4階層が階層ページング構造を成す
     /// ページマップレベル4テーブル
@@ -21,6 +27,27 @@ namespace {
     alignas(kPageSize4K)
         std::array<std::array<uint64_t, 512>, kPageDirectoryCount> g_page_directory;
 
+    /// PCIDの割り当て状況（1なら使用中）
+    std::array<uint64_t, (kMaxPCID + 1) / 64> g_pcid_map{};
+    /// 次に割り当てを試すPCID（使い終わったPCIDをすぐには再利用しない）
+    uint64_t g_next_pcid = kKernelPCID + 1;
+    /// OSカーネル用のPML4のPCID。PCIDを使わないならkNoPCID
+    uint64_t g_kernel_pcid = kNoPCID;
+    bool g_invpcid_supported = false;
+    size_t g_pcids_in_use = 0;
+
+    bool PCIDUsed(uint64_t pcid) {
+        return (g_pcid_map[pcid / 64] >> (pcid % 64)) & 1;
+    }
+
+    void SetPCIDUsed(uint64_t pcid, bool used) {
+        if (used) {
+            g_pcid_map[pcid / 64] |= 1ul << (pcid % 64);
+        } else {
+            g_pcid_map[pcid / 64] &= ~(1ul << (pcid % 64));
+        }
+    }
+
     /**
      4階層ページングにおける、仮想アドレスの分割
      63:48 : 全部1 or 全部0
@@ -45,25 +72,216 @@ void SetupIdentityPageTable() {
         }
     }
 
-    // スーパーバイザーによる読み込み専用ページへの書き込みを許可する
+    // スーパーバイザーによる読み込み専用ページへの書き込みも禁止する
     // スーパーバイザーモード : CPL < 3 のタスク
+    // システムコールがアプリのバッファに書き込む場合も、共有中のフレーム（ゼロページなど）を書き換えずにコピーオンライトを経由させるため
     ResetCR3();
-    SetCR0(GetCR0() & 0xfffeffff); // CR0のWPビットを0クリア
+    SetCR0(GetCR0() | 0x00010000); // CR0のWPビットを1に設定
 }
 
 void InitializePaging() {
     SetupIdentityPageTable();
+    InitializePCID();
 }
 
 void ResetCR3() {
-    SetCR3(reinterpret_cast<uint64_t>(&g_pml4_table[0]));
+    SetCR3(KernelCR3());
+}
+
+uint64_t KernelCR3() {
+    return reinterpret_cast<uint64_t>(&g_pml4_table[0]) | g_kernel_pcid;
+}
+
+void InitializeAPPaging() {
+    // 起動コードはPCIDなしでOSカーネル用のPML4を読み込んでいるので、BSPと同じくPCIDを有効にしてから読み直す
+    if (g_kernel_pcid != kNoPCID) {
+        SetCR4(GetCR4() | (1ul << 17));
+    }
+    ResetCR3();
+}
+
+uint64_t g_cr3_noflush = 0;
+
+void InitializePCID() {
+    unsigned int eax, ebx, ecx, edx;
+    // CPUID.01H:ECX[17] = PCID
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || ((ecx >> 17) & 1) == 0) {
+        Log(kWarn, "PCID is not supported\n");
+        return;
+    }
+    // CPUID.(EAX=07H, ECX=0):EBX[10] = INVPCID
+    if (__get_cpuid_max(0, nullptr) >= 7) {
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        g_invpcid_supported = (ebx >> 10) & 1;
+    }
+
+    // CR4.PCIDEを1にできるのは、CR3[11:0] = 0 のときだけ
+    SetCR4(GetCR4() | (1ul << 17));
+    SetPCIDUsed(kNoPCID, true);
+    SetPCIDUsed(kKernelPCID, true);
+    g_pcids_in_use = 1;
+    g_kernel_pcid = kKernelPCID;
+    g_cr3_noflush = 1ul << 63;
+    ResetCR3();
+    Log(kInfo, "PCID enabled (INVPCID %s)\n", g_invpcid_supported ? "supported" : "not supported");
+}
+
+uint64_t AllocatePCID() {
+    InterruptGuard guard;
+    if (g_kernel_pcid == kNoPCID) {
+        return kNoPCID;
+    }
+    for (uint64_t i = 0; i < kMaxPCID + 1; i++) {
+        const auto pcid = g_next_pcid;
+        g_next_pcid = pcid == kMaxPCID ? kKernelPCID + 1 : pcid + 1;
+        if (!PCIDUsed(pcid)) {
+            SetPCIDUsed(pcid, true);
+            ++g_pcids_in_use;
+            return pcid;
+        }
+    }
+    return kNoPCID;
+}
+
+void FreePCID(uint64_t cr3) {
+    const auto pcid = cr3 & kMaxPCID;
+    if (pcid == kNoPCID || pcid == kKernelPCID) {
+        return;
+    }
+    InterruptGuard guard;
+    if (PCIDUsed(pcid)) {
+        SetPCIDUsed(pcid, false);
+        --g_pcids_in_use;
+    }
+}
+
+void SetPCIDNoFlush(bool noflush) {
+    if (g_kernel_pcid != kNoPCID) {
+        g_cr3_noflush = noflush ? 1ul << 63 : 0;
+    }
+}
+
+PCIDStat GetPCIDStat() {
+    InterruptGuard guard;
+    return {g_kernel_pcid != kNoPCID, g_invpcid_supported, g_cr3_noflush != 0, g_pcids_in_use};
+}
+
+PageMapEntry* CurrentPML4() {
+    return reinterpret_cast<PageMapEntry*>(GetCR3() & kCR3AddrMask);
+}
+
+void FlushTLB() {
+    const auto cr3 = GetCR3();
+    const auto pcid = cr3 & kMaxPCID;
+    if (g_invpcid_supported && pcid != kNoPCID) {
+        InvalidatePCID(1, pcid); // 指定PCIDのすべて
+    } else {
+        // bit 63が0のCR3の書き込みは、そのPCIDのTLBを無効化する
+        SetCR3(cr3);
+    }
+}
+
+TLBFlushBatch::TLBFlushBatch(PageMapEntry* pml4_table) : active_{pml4_table == CurrentPML4()} {}
+
+void TLBFlushBatch::Add(uint64_t addr) {
+    if (!active_ || full_) {
+        return;
+    }
+    addr &= ~(kPageSize4K - 1);
+    // 同じページを続けて加えることが多い（2MiBページの分割とコピーなど）
+    if (count_ > 0 && addrs_[count_ - 1] == addr) {
+        return;
+    }
+    if (count_ == kMaxPages) {
+        full_ = true;
+        return;
+    }
+    addrs_[count_++] = addr;
+}
+
+void TLBFlushBatch::AddRange(uint64_t begin, uint64_t end) {
+    if (!active_) {
+        return;
+    }
+    if ((end - begin) / kPageSize4K > kMaxPages) {
+        full_ = true;
+        return;
+    }
+    for (uint64_t addr = begin; addr < end && !full_; addr += kPageSize4K) {
+        Add(addr);
+    }
+}
+
+void TLBFlushBatch::Flush() {
+    if (full_) {
+        FlushTLB();
+    } else {
+        for (size_t i = 0; i < count_; i++) {
+            InvalidateTLB(addrs_[i]);
+        }
+    }
+    full_ = false;
+    count_ = 0;
 }
 
 namespace {
+    /// 2MiBページ（連続した512フレーム）の各フレームに対応する4KiBフレーム番号
+    FrameID HugeSubFrame(const PageMapEntry& entry, int i) {
+        return FrameID{reinterpret_cast<uintptr_t>(entry.Pointer()) / kBytesPerFrame + i};
+    }
+
+    /// 指定階層のエントリが指す先（下位のページング構造か物理フレーム）の参照カウントを増やす
+    void IncrementPageMapRefs(const PageMapEntry& entry, int page_map_level) {
+        if (page_map_level == 2 && entry.bits.huge_page) {
+            for (int i = 0; i < 512; i++) {
+                g_frame_refs->Increment(HugeSubFrame(entry, i));
+            }
+            return;
+        }
+        g_frame_refs->Increment(FrameID{reinterpret_cast<uintptr_t>(entry.Pointer()) / kBytesPerFrame});
+    }
+
+    /// entryが指す下位のページング構造を他の階層ページング構造と共有していれば、コピーして自分専用にする
+    /// コピー元とコピー先のエントリはどちらも書き込み禁止にし、指す先の参照カウントを増やす
+    /// （共有されているものを指すエントリは必ず書き込み禁止、という状態を保つので、共有しているどのアドレス空間からの書き込みもページフォルトになる）
+    /// child_level : entryが指すページング構造の階層（2以上ならその下もページング構造）
+    /// addr : entryが表す範囲内の仮想アドレス。INVLPGは現在のPCIDのページング構造キャッシュをすべて無効化するので、1つで足りる
+    Error UnsharePageMap(PageMapEntry& entry, int child_level, LinearAddress4Level addr, TLBFlushBatch& tlb) {
+        const auto table = entry.Pointer();
+        if (g_frame_refs->Get(FrameID{reinterpret_cast<uintptr_t>(table) / kBytesPerFrame}) <= 1) {
+            return MAKE_ERROR(Error::kSuccess);
+        }
+
+        auto [copy, err] = NewPageMap();
+        if (err) {
+            return err;
+        }
+        for (int i = 0; i < 512; i++) {
+            if (!table[i].bits.present) {
+                continue;
+            }
+            IncrementPageMapRefs(table[i], child_level);
+            table[i].bits.writable = 0;
+            copy[i] = table[i];
+        }
+        entry.SetPointer(copy);
+        tlb.Add(addr.value);
+        // 共有していたので、参照カウントが0になることはない
+        return FreePageMap(table);
+    }
+
     /// 必要に応じて新たなページング構造を生成してエントリに設定
-    WithError<PageMapEntry*> SetNewPageMapIfNotPresent(PageMapEntry& entry) {
+    /// 設定済みのページング構造が共有されていればコピーする（呼び出し側はそのページング構造を書き換えてよい）
+    /// page_map_level : entryの階層（1なら物理フレームを割り当てる）
+    WithError<PageMapEntry*> SetNewPageMapIfNotPresent(PageMapEntry& entry, int page_map_level,
+                                                       LinearAddress4Level addr, TLBFlushBatch& tlb) {
         // 有効な値が設定済み
         if (entry.bits.present) {
+            if (page_map_level > 1) {
+                if (auto err = UnsharePageMap(entry, page_map_level - 1, addr, tlb)) {
+                    return {nullptr, err};
+                }
+            }
             return {entry.Pointer(), MAKE_ERROR(Error::kSuccess)};
         }
 
@@ -78,39 +296,87 @@ namespace {
         return {child_map, MAKE_ERROR(Error::kSuccess)};
     }
 
+    /// 2MiBページを確保し、PDのエントリに設定する
+    /// 参照カウントは4KiBフレーム毎に持つ（コピーオンライト時に4KiBページへ分割できるように）
+    Error SetHugePage(PageMapEntry& entry, bool writable) {
+        auto [frame, err] = g_memory_manager->Allocate(kPageSize2M / kBytesPerFrame);
+        if (err) {
+            return err;
+        }
+        memset(frame.Frame(), 0, kPageSize2M);
+
+        entry.data = 0;
+        entry.SetPointer(reinterpret_cast<PageMapEntry*>(frame.Frame()));
+        entry.bits.present = 1;
+        entry.bits.writable = writable;
+        entry.bits.user = 1;
+        entry.bits.huge_page = 1;
+        for (int i = 0; i < 512; i++) {
+            g_frame_refs->Set(HugeSubFrame(entry, i), 1);
+        }
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    /// 2MiBページの参照を外し、参照カウントが0になったフレームを解放
+    Error ReleaseHugePage(const PageMapEntry& entry) {
+        for (int i = 0; i < 512; i++) {
+            const auto frame = HugeSubFrame(entry, i);
+            if (g_frame_refs->Decrement(frame) == 0) {
+                if (auto err = g_memory_manager->Free(frame, 1)) {
+                    return err;
+                }
+            }
+        }
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
     /// 指定階層を設定
     /// page_map : 階層ページング構造の物理アドレス
     /// page_map_level : 設定対象のページング階層
     /// addr : LOADセグメントを配置する先頭アドレス
     /// num_4kPages : 4KiBページ単位のセグメントの大きさ
     /// writable : ページへの書き込み権限
+    /// huge : 2MiB境界から512ページ以上続く部分を2MiBページでマップする
     /// ret : 未処理のページ数
-    WithError<size_t> SetupPageMap(PageMapEntry* page_map, int page_map_level, LinearAddress4Level addr, size_t num_4kPages, bool writable) {
+    WithError<size_t> SetupPageMap(PageMapEntry* page_map, int page_map_level, LinearAddress4Level addr, size_t num_4kPages, bool writable, bool huge,
+                                   TLBFlushBatch& tlb) {
         while (num_4kPages > 0) {
             // 仮想アドレスの指定した階層の値
             const auto entry_index = addr.Part(page_map_level);
-
-            auto [child_map, err] = SetNewPageMapIfNotPresent(page_map[entry_index]);
-            if (err) {
-                return {num_4kPages, err};
-            }
-            page_map[entry_index].bits.writable = 1;
-            // 権限レベルが最低でも命令フェッチを許可する
-            // この関数はアプリ用の階層ページング構造を設定するものなので、OS領域のuserビットは0のまま変更していない
-            // -> OSのメモリ空間は保護される
-            page_map[entry_index].bits.user = 1;
-
-            // いずれかの階層で writable=0 なら読み込み専用になるので、処理を単純化するため最下層のみ writable を設定
-            if (page_map_level == 1) {
-                page_map[entry_index].bits.writable = writable;
-                num_4kPages--;
+            auto& entry = page_map[entry_index];
+
+            if (page_map_level == 2 && entry.bits.present && entry.bits.huge_page) {
+                // 2MiBページでマップ済み
+                num_4kPages -= std::min<size_t>(num_4kPages, 512 - addr.Part(1));
+            } else if (page_map_level == 2 && huge && !entry.bits.present &&
+                       addr.Part(1) == 0 && num_4kPages >= 512) {
+                if (auto err = SetHugePage(entry, writable)) {
+                    return {num_4kPages, err};
+                }
+                num_4kPages -= 512;
             } else {
-                page_map[entry_index].bits.writable = true;
-                auto [num_remain_pages, err] = SetupPageMap(child_map, page_map_level - 1, addr, num_4kPages, writable);
+                auto [child_map, err] = SetNewPageMapIfNotPresent(entry, page_map_level, addr, tlb);
                 if (err) {
                     return {num_4kPages, err};
                 }
-                num_4kPages = num_remain_pages;
+                entry.bits.writable = 1;
+                // 権限レベルが最低でも命令フェッチを許可する
+                // この関数はアプリ用の階層ページング構造を設定するものなので、OS領域のuserビットは0のまま変更していない
+                // -> OSのメモリ空間は保護される
+                entry.bits.user = 1;
+
+                // いずれかの階層で writable=0 なら読み込み専用になるので、処理を単純化するため最下層のみ writable を設定
+                if (page_map_level == 1) {
+                    entry.bits.writable = writable;
+                    num_4kPages--;
+                } else {
+                    entry.bits.writable = true;
+                    auto [num_remain_pages, err] = SetupPageMap(child_map, page_map_level - 1, addr, num_4kPages, writable, huge, tlb);
+                    if (err) {
+                        return {num_4kPages, err};
+                    }
+                    num_4kPages = num_remain_pages;
+                }
             }
 
             if (entry_index == 511) {
@@ -127,28 +393,50 @@ namespace {
     }
 
     /// 指定階層のページング構造内のエントリをすべて破棄
-    Error CleanPageMap(PageMapEntry* page_map, int page_map_level, LinearAddress4Level addr) {
+    /// base : page_mapの先頭のエントリが表す仮想アドレス
+    Error CleanPageMap(PageMapEntry* page_map, int page_map_level, LinearAddress4Level addr,
+                       LinearAddress4Level base, TLBFlushBatch& tlb) {
         for (int i = addr.Part(page_map_level); i < 512; i++) {
             auto entry = page_map[i];
             if (!entry.bits.present) {
                 continue;
             }
+            auto entry_addr = base;
+            entry_addr.SetPart(page_map_level, i);
 
-            // 深さ優先探索
-            if (page_map_level > 1) {
-                if (auto err = CleanPageMap(entry.Pointer(), page_map_level - 1, addr)) {
+            if (page_map_level == 2 && entry.bits.huge_page) {
+                if (auto err = ReleaseHugePage(entry)) {
                     return err;
                 }
+                page_map[i].data = 0;
+                tlb.Add(entry_addr.value);
+                continue;
             }
 
-            // コピーオンライトでコピーされたページは必ず writable=1 になっている
-            // -> アプリの機械語（.text）や読み込み専用データ（.rodata）が含まれるLOADセグメントが読み込まれたページの物理フレームは解放しない
-            if (entry.bits.writable) {
-                const auto entry_addr = reinterpret_cast<uintptr_t>(entry.Pointer());
-                const FrameID map_frame{entry_addr / kBytesPerFrame};
-                if (auto err = g_memory_manager->Free(map_frame, 1)) {
+            // 他の階層ページング構造と共有しているページング構造は、参照を外すだけで中身は残す
+            if (page_map_level > 1 &&
+                g_frame_refs->Get(FrameID{reinterpret_cast<uintptr_t>(entry.Pointer()) / kBytesPerFrame}) > 1) {
+                if (auto err = FreePageMap(entry.Pointer())) {
                     return err;
                 }
+                page_map[i].data = 0;
+                const uint64_t entry_bytes = kPageSize4K << (9 * (page_map_level - 1));
+                tlb.AddRange(entry_addr.value, entry_addr.value + entry_bytes);
+                continue;
+            }
+
+            // 深さ優先探索
+            if (page_map_level > 1) {
+                if (auto err = CleanPageMap(entry.Pointer(), page_map_level - 1, addr, entry_addr, tlb)) {
+                    return err;
+                }
+            } else {
+                tlb.Add(entry_addr.value);
+            }
+
+            // アプリイメージキャッシュ（g_app_images）と共有しているフレームは参照カウントが残るので解放されない
+            if (auto err = FreePageMap(entry.Pointer())) {
+                return err;
             }
             page_map[i].data = 0;
         }
@@ -156,147 +444,558 @@ namespace {
         return MAKE_ERROR(Error::kSuccess);
     }
 
-    /// 指定アドレスを含むファイルマッピングを探す
-    const FileMapping* FindFileMapping(const std::vector<FileMapping>& fmaps, uint64_t causal_addr) {
-        for (const FileMapping& m : fmaps) {
-            if (m.vaddr_begin <= causal_addr && causal_addr < m.vaddr_end) {
-                return &m;
+    /// 指定アドレスを表す、指定階層のエントリ
+    /// 途中の階層が存在しないか、途中で2MiBページに行き当たればnullptr
+    PageMapEntry* FindPageMapEntry(PageMapEntry* pml4_table, LinearAddress4Level addr, int page_map_level) {
+        PageMapEntry* table = pml4_table;
+        for (int part = 4; part > page_map_level; part--) {
+            const auto& entry = table[addr.Part(part)];
+            if (!entry.bits.present || entry.bits.huge_page) {
+                return nullptr;
             }
+            table = entry.Pointer();
         }
-        return nullptr;
+        return &table[addr.Part(page_map_level)];
+    }
+
+    /// FindPageMapEntry()と同様だが、途中の階層のページング構造が共有されていればコピーし、書き込み可にする
+    /// 返したエントリ（を含むページング構造）は書き換えてよい
+    WithError<PageMapEntry*> FindPrivatePageMapEntry(PageMapEntry* pml4_table, LinearAddress4Level addr,
+                                                     int page_map_level, TLBFlushBatch& tlb) {
+        PageMapEntry* table = pml4_table;
+        for (int part = 4; part > page_map_level; part--) {
+            auto& entry = table[addr.Part(part)];
+            if (!entry.bits.present || entry.bits.huge_page) {
+                return {nullptr, MAKE_ERROR(Error::kSuccess)};
+            }
+            if (auto err = UnsharePageMap(entry, part - 1, addr, tlb)) {
+                return {nullptr, err};
+            }
+            entry.bits.writable = 1;
+            table = entry.Pointer();
+        }
+        return {&table[addr.Part(page_map_level)], MAKE_ERROR(Error::kSuccess)};
+    }
+
+    /// 指定アドレスの4KiBページがマップ済みか
+    bool IsPagePresent(PageMapEntry* pml4_table, LinearAddress4Level addr) {
+        auto entry = FindPageMapEntry(pml4_table, addr, 1);
+        return entry && entry->bits.present;
     }
 
-    /// 指定ページを作成しファイルをコピーする
-    Error PreparePageCache(IFileDescriptor& fd, const FileMapping& m, uint64_t causal_vaddr) {
-        LinearAddress4Level page_vaddr{causal_vaddr};
-        page_vaddr.parts.offset = 0;
-        // 4KiBページ作成
-        if (auto err = SetupPageMaps(page_vaddr, 1)) {
+    /// 2MiBページを、同じフレームを指す512個の4KiBページに分割する
+    /// 各フレームの参照カウントは2MiBページの分がそのまま4KiBページの分になる
+    Error SplitHugePage(PageMapEntry& entry, LinearAddress4Level addr, TLBFlushBatch& tlb) {
+        auto [table, err] = NewPageMap();
+        if (err) {
             return err;
         }
+        for (int i = 0; i < 512; i++) {
+            table[i].SetPointer(reinterpret_cast<PageMapEntry*>(HugeSubFrame(entry, i).Frame()));
+            table[i].bits.present = 1;
+            table[i].bits.writable = entry.bits.writable;
+            table[i].bits.user = 1;
+        }
+        entry.bits.huge_page = 0;
+        entry.bits.writable = 1;
+        entry.SetPointer(table);
+        tlb.Add(addr.value);
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    /// 全ビット0のフレーム。デマンドページングで読み込まれただけのページに共有でマップする
+    /// 自身の参照を1つ持ち続けるので解放されることはない
+    PageMapEntry* g_zero_page = nullptr;
+
+    /// 指定の物理フレームを4KiBページとしてマップし、参照カウントを増やす（途中の階層は必要に応じて生成）
+    Error MapPage(PageMapEntry* pml4_table, LinearAddress4Level addr, PageMapEntry* frame, bool writable) {
+        TLBFlushBatch tlb{pml4_table};
+        PageMapEntry* table = pml4_table;
+        for (int part = 4; part > 1; part--) {
+            auto& entry = table[addr.Part(part)];
+            auto [child_map, err] = SetNewPageMapIfNotPresent(entry, part, addr, tlb);
+            if (err) {
+                return err;
+            }
+            entry.bits.writable = 1;
+            entry.bits.user = 1;
+            table = child_map;
+        }
 
-        const long file_offset = page_vaddr.value - m.vaddr_begin;
-        void* page_cache = reinterpret_cast<void*>(page_vaddr.value);
-        // ページ（が指すフレーム）にファイルデータをコピー
-        fd.Load(page_cache, 4096, file_offset);
+        auto& entry = table[addr.Part(1)];
+        entry.data = 0;
+        entry.SetPointer(frame);
+        entry.bits.present = 1;
+        entry.bits.writable = writable;
+        entry.bits.user = 1;
+        g_frame_refs->Increment(FrameID{reinterpret_cast<uintptr_t>(frame) / kBytesPerFrame});
         return MAKE_ERROR(Error::kSuccess);
     }
 
-    /// 物理フレームを書き込み可でマップする
-    /// content : 物理フレームを指している
-    Error SetPageContent(PageMapEntry* table, int part, LinearAddress4Level addr, PageMapEntry* content) {
-        if (part == 1) {
-            const auto i = addr.Part(part);
-            table[i].SetPointer(content);
-            table[i].bits.writable = 1;
-            // 階層ページング構造の一部を書き換えた場合（コピーオンライト）は古い履歴を参照し続けてしまうので、無効化する
-            InvalidateTLB(addr.value);
-            return MAKE_ERROR(Error::kSuccess);
+    /// ゼロページを読み込み専用でマップする
+    Error MapZeroPage(LinearAddress4Level addr) {
+        if (g_zero_page == nullptr) {
+            auto [p, err] = NewPageMap();
+            if (err) {
+                return err;
+            }
+            g_zero_page = p;
+        }
+        return MapPage(CurrentPML4(), addr, g_zero_page, false);
+    }
+
+    /// ファイルマッピングの[begin, end)のうち未割り当てのページを用意する
+    /// キャッシュできるファイルはページキャッシュのフレームを読み込み専用でマップする（書き込みはコピーオンライト）
+    /// キャッシュできないファイルは、連続した未割り当てのページをまとめて作成し、ファイルの読み込みも1回で済ませる
+    /// ret : 用意したページ数
+    WithError<size_t> PrepareFilePages(const std::shared_ptr<IFileDescriptor>& fd, const VirtualMemoryArea& m,
+                                       uint64_t begin, uint64_t end) {
+        const auto pml4_table = CurrentPML4();
+        const bool cacheable = fd->FileID() != 0 && g_page_cache != nullptr;
+        size_t num_prepared = 0;
+        uint64_t page = begin & ~(kPageSize4K - 1);
+        while (page < end) {
+            if (IsPagePresent(pml4_table, LinearAddress4Level{page})) {
+                page += kPageSize4K;
+                continue;
+            }
+
+            if (cacheable) {
+                auto [frame, err] = g_page_cache->Get(fd, (m.file_offset + (page - m.begin)) / kPageSize4K);
+                if (err) {
+                    return {num_prepared, err};
+                }
+                if (auto err = MapPage(pml4_table, LinearAddress4Level{page}, frame, false)) {
+                    return {num_prepared, err};
+                }
+                ++num_prepared;
+                page += kPageSize4K;
+                continue;
+            }
+
+            uint64_t run_end = page + kPageSize4K;
+            while (run_end < end && !IsPagePresent(pml4_table, LinearAddress4Level{run_end})) {
+                run_end += kPageSize4K;
+            }
+
+            const size_t num_pages = (run_end - page) / kPageSize4K;
+            if (auto err = SetupPageMaps(LinearAddress4Level{page}, num_pages)) {
+                return {num_prepared, err};
+            }
+            // ページ（が指すフレーム）にファイルデータをコピー
+            fd->Load(reinterpret_cast<void*>(page), run_end - page, m.file_offset + (page - m.begin));
+            num_prepared += num_pages;
+            page = run_end;
         }
+        return {num_prepared, MAKE_ERROR(Error::kSuccess)};
+    }
 
-        const auto i = addr.Part(part);
-        return SetPageContent(table[i].Pointer(), part - 1, addr, content);
+    /// フォルトしたページを含むg_fault_around_pagesページ分（マッピング先頭からの位置で揃える）をまとめて用意する
+    /// 順番に読み進めるアプリでは、ページフォルトの回数がおよそ1/g_fault_around_pagesになる
+    WithError<size_t> PrepareFileFault(const std::shared_ptr<IFileDescriptor>& fd, const VirtualMemoryArea& m,
+                                       uint64_t causal_vaddr) {
+        const size_t window = std::max<size_t>(g_fault_around_pages, 1);
+        const uint64_t index = (causal_vaddr - m.begin) / kPageSize4K;
+        const uint64_t begin = m.begin + (index - index % window) * kPageSize4K;
+        const uint64_t end = std::min(begin + window * kPageSize4K, m.end);
+        return PrepareFilePages(fd, m, begin, end);
     }
 
-    /// 4KiBページをコピーして書き込み可でマップする
-    Error CopyOnePage(uint64_t causal_addr) {
-        auto [p, err] = NewPageMap();
+    /// 共有マッピングのページへの書き込み : コピーせずにページキャッシュのフレームへ書き込ませ、
+    /// 書き戻しが必要な印を付ける
+    Error MakeSharedFilePageWritable(IFileDescriptor& fd, const VirtualMemoryArea& m, uint64_t causal_vaddr) {
+        const LinearAddress4Level addr{causal_vaddr};
+        const auto pml4_table = CurrentPML4();
+        TLBFlushBatch tlb{pml4_table};
+        auto [entry, err] = FindPrivatePageMapEntry(pml4_table, addr, 1, tlb);
         if (err) {
             return err;
         }
+        if (entry == nullptr || !entry->bits.present) {
+            return MAKE_ERROR(Error::kIndexOutOfRange);
+        }
+        const uint64_t page = causal_vaddr & ~(kPageSize4K - 1);
+        g_page_cache->MarkDirty(fd.FileID(), (m.file_offset + (page - m.begin)) / kPageSize4K);
+        entry->bits.writable = 1;
+        tlb.Add(causal_vaddr);
+        return MAKE_ERROR(Error::kSuccess);
+    }
 
-        const auto aligned_addr = causal_addr & 0xfffffffffffff000;
-        memcpy(p, reinterpret_cast<const void*>(aligned_addr), 4096);
-        return SetPageContent(reinterpret_cast<PageMapEntry*>(GetCR3()), 4, LinearAddress4Level{causal_addr}, p);
+    /// アプリのLOADセグメントのページを用意する
+    /// ファイルのデータで埋まるページはファイルマッピングと同様にページキャッシュからマップし、
+    /// .bssだけのページはデマンドページングと同様に扱い、両方を含むページはコピーして残りを0で埋める
+    /// ret : 用意したページ数
+    WithError<size_t> PrepareElfFault(const std::shared_ptr<IFileDescriptor>& fd, const VirtualMemoryArea& vma,
+                                      uint64_t causal_vaddr, bool write) {
+        const LinearAddress4Level page{causal_vaddr & ~(kPageSize4K - 1)};
+        const uint64_t full_end = vma.file_end & ~(kPageSize4K - 1);
+        if (page.value < full_end) {
+            VirtualMemoryArea file_part = vma;
+            file_part.end = full_end;
+            return PrepareFileFault(fd, file_part, causal_vaddr);
+        }
+
+        if (page.value >= vma.file_end) {
+            auto err = write ? SetupPageMaps(page, 1) : MapZeroPage(page);
+            return {err ? 0u : 1u, err};
+        }
+
+        if (auto err = SetupPageMaps(page, 1)) {
+            return {0, err};
+        }
+        fd->Load(reinterpret_cast<void*>(page.value), vma.file_end - page.value,
+                 vma.file_offset + (page.value - vma.begin));
+        return {1, MAKE_ERROR(Error::kSuccess)};
     }
+
+    /// 読み込み専用でマップされた4KiBページを書き込み可にする
+    /// フレームを他に共有している階層ページング構造があればコピーしてから書き込み可でマップし、
+    /// 参照しているのが自分だけならコピーせずにそのまま書き込み可にする
+    Error CopyOnePage(uint64_t causal_addr) {
+        const LinearAddress4Level addr{causal_addr};
+        const auto pml4_table = CurrentPML4();
+        TLBFlushBatch tlb{pml4_table};
+
+        // 2MiBページ : 共有していなければそのまま書き込み可にし、
+        // 共有していれば4KiBページに分割して書き込まれたページだけをコピーする
+        // 途中の階層のページング構造を共有していれば、ここでコピーされる
+        auto [pd_entry, err_pd] = FindPrivatePageMapEntry(pml4_table, addr, 2, tlb);
+        if (err_pd) {
+            return err_pd;
+        }
+        if (pd_entry && pd_entry->bits.present && pd_entry->bits.huge_page) {
+            bool shared = false;
+            for (int i = 0; i < 512 && !shared; i++) {
+                shared = g_frame_refs->Get(HugeSubFrame(*pd_entry, i)) > 1;
+            }
+            if (!shared) {
+                pd_entry->bits.writable = 1;
+                tlb.Add(addr.value);
+                return MAKE_ERROR(Error::kSuccess);
+            }
+            if (auto err = SplitHugePage(*pd_entry, addr, tlb)) {
+                return err;
+            }
+        }
+
+        auto [entry, err_pt] = FindPrivatePageMapEntry(pml4_table, addr, 1, tlb);
+        if (err_pt) {
+            return err_pt;
+        }
+        if (entry == nullptr || !entry->bits.present) {
+            return MAKE_ERROR(Error::kIndexOutOfRange);
+        }
+
+        const auto old_page = entry->Pointer();
+        const FrameID old_frame{reinterpret_cast<uintptr_t>(old_page) / kBytesPerFrame};
+        if (g_frame_refs->Get(old_frame) > 1) {
+            auto [p, err] = NewPageMap();
+            if (err) {
+                return err;
+            }
+            // NewPageMap()のフレームは0クリア済みなので、ゼロページはコピー不要
+            if (old_page != g_zero_page) {
+                memcpy(p, old_page, 4096);
+            }
+            entry->SetPointer(p);
+            g_frame_refs->Decrement(old_frame);
+        }
+        entry->bits.writable = 1;
+        // 階層ページング構造の一部を書き換えた場合（コピーオンライト）は古い履歴を参照し続けてしまうので、無効化する
+        tlb.Add(addr.value);
+        return MAKE_ERROR(Error::kSuccess);
+    }
+} // namespace
+
+void* ZeroedFramePool::Take() {
+    InterruptGuard guard;
+    if (count_ == 0) {
+        ++misses_;
+        return nullptr;
+    }
+    ++hits_;
+    return frames_[--count_];
+}
+
+bool ZeroedFramePool::Refill() {
+    void* frame;
+    {
+        InterruptGuard guard;
+        if (count_ >= watermark_) {
+            return false;
+        }
+        auto [id, err] = g_memory_manager->Allocate(1);
+        if (err) {
+            return false;
+        }
+        frame = id.Frame();
+    }
+
+    // 0クリアは時間がかかるので割り込みを許可したまま行う（このフレームはまだ誰からも見えない）
+    memset(frame, 0, kBytesPerFrame);
+
+    InterruptGuard guard;
+    if (count_ < watermark_) {
+        frames_[count_++] = frame;
+    } else {
+        g_memory_manager->Free(FrameID{reinterpret_cast<uintptr_t>(frame) / kBytesPerFrame}, 1);
+    }
+    return true;
+}
+
+void ZeroedFramePool::SetWatermark(size_t watermark) {
+    InterruptGuard guard;
+    watermark_ = std::min(watermark, static_cast<size_t>(kCapacity));
+    // 目標値を下げた場合は余分なフレームを返却
+    while (count_ > watermark_) {
+        g_memory_manager->Free(FrameID{reinterpret_cast<uintptr_t>(frames_[--count_]) / kBytesPerFrame}, 1);
+    }
+}
+
+ZeroedFramePool g_zeroed_frames;
+
+size_t g_fault_around_pages = kDefaultFaultAroundPages;
+
+namespace {
+    /// フレームが足りないときに一度に回収するページキャッシュのページ数
+    const size_t kReclaimPages = 64;
 } // namespace
 
 /// 新たなページング構造を生成
+/// アプリに割り当てるデータ用のフレームもこれで確保する（参照カウントは1）
+/// 0クリア済みフレームのプールにあればそれを使う
 WithError<PageMapEntry*> NewPageMap() {
-    auto frame = g_memory_manager->Allocate(1);
-    if (frame.error) {
-        return {nullptr, frame.error};
+    auto e = reinterpret_cast<PageMapEntry*>(g_zeroed_frames.Take());
+    if (e == nullptr) {
+        auto frame = g_memory_manager->Allocate(1);
+        // 空きフレームが無ければ、どのタスクもマップしていないページキャッシュを回収して再試行
+        if (frame.error && g_page_cache && g_page_cache->Reclaim(kReclaimPages) > 0) {
+            frame = g_memory_manager->Allocate(1);
+        }
+        if (frame.error) {
+            return {nullptr, frame.error};
+        }
+        e = reinterpret_cast<PageMapEntry*>(frame.value.Frame());
+        memset(e, 0, sizeof(uint64_t) * 512);
     }
-
-    auto e = reinterpret_cast<PageMapEntry*>(frame.value.Frame());
-    memset(e, 0, sizeof(uint64_t) * 512);
+    g_frame_refs->Set(FrameID{reinterpret_cast<uintptr_t>(e) / kBytesPerFrame}, 1);
     return {e, MAKE_ERROR(Error::kSuccess)};
 }
 
+/// 参照カウントを1減らし、0になったらフレームを解放
 Error FreePageMap(PageMapEntry* table) {
     const FrameID frame{reinterpret_cast<uintptr_t>(table) / kBytesPerFrame};
+    if (g_frame_refs->Decrement(frame) > 0) {
+        return MAKE_ERROR(Error::kSuccess);
+    }
     return g_memory_manager->Free(frame, 1);
 }
 
 /// 階層ページング構造の設定。仮想アドレス（ページ）を物理アドレス（フレーム）に割り当てる。
 /// addr : データを配置する先頭アドレス
 /// num_4kPages : 4KiBページ単位のセグメントの大きさ
-Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages, bool writable) {
-    auto pml4_table = reinterpret_cast<PageMapEntry*>(GetCR3());
-    return SetupPageMap(pml4_table, 4, addr, num_4kpages, writable).error;
+Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages, bool writable, bool huge) {
+    auto pml4_table = CurrentPML4();
+    TLBFlushBatch tlb{pml4_table};
+    return SetupPageMap(pml4_table, 4, addr, num_4kpages, writable, huge, tlb).error;
 }
 
 /// アプリ用のページング構造を破棄（PML4より下層のページング構造を削除）
 Error CleanPageMaps(LinearAddress4Level addr) {
-    auto pml4_table = reinterpret_cast<PageMapEntry*>(GetCR3());
-    return CleanPageMap(pml4_table, 4, addr);
+    return CleanPageMaps(CurrentPML4(), addr);
 }
 
-/// 階層ページング構造の浅いコピーを行う
-/// PML4, PDP, PD, PTについては新規のテーブルを作成して値をコピーするが、PTが指す物理フレームのコピーは行わない
-Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start) {
-    if (part == 1) {
-        for (int i = start; i < 512; i++) {
-            if (!src[i].bits.present) {
+Error CleanPageMaps(PageMapEntry* pml4_table, LinearAddress4Level addr) {
+    // 破棄したページのTLBが残っていると、解放したフレームを読み書きできてしまう
+    TLBFlushBatch tlb{pml4_table};
+    return CleanPageMaps(pml4_table, addr, tlb);
+}
+
+Error CleanPageMaps(PageMapEntry* pml4_table, LinearAddress4Level addr, TLBFlushBatch& tlb) {
+    LinearAddress4Level base{0};
+    // 後半（カノニカルアドレスの上位側）はbit 63:48が1
+    if (addr.parts.pml4 >= 256) {
+        base.value = 0xffff000000000000;
+    }
+    return CleanPageMap(pml4_table, 4, addr, base, tlb);
+}
+
+Error UnmapPages(uint64_t begin, uint64_t end) {
+    const auto pml4_table = CurrentPML4();
+    TLBFlushBatch tlb{pml4_table};
+    uint64_t addr = begin & ~(kPageSize4K - 1);
+    while (addr < end) {
+        const LinearAddress4Level la{addr};
+        // 2MiB単位で処理する（アドレス空間の末尾では0に戻る）
+        const uint64_t next_2m = (addr & ~(kPageSize2M - 1)) + kPageSize2M;
+        const uint64_t stop = next_2m == 0 ? end : std::min(next_2m, end);
+
+        auto [pd_entry, err] = FindPrivatePageMapEntry(pml4_table, la, 2, tlb);
+        if (err) {
+            return err;
+        }
+        if (pd_entry == nullptr || !pd_entry->bits.present) {
+            addr = stop;
+            continue;
+        }
+        if (pd_entry->bits.huge_page) {
+            // 2MiBページ全体を外すならそのまま解放し、一部なら4KiBページに分割してから外す
+            if ((addr & (kPageSize2M - 1)) == 0 && stop == next_2m) {
+                if (auto err = ReleaseHugePage(*pd_entry)) {
+                    return err;
+                }
+                pd_entry->data = 0;
+                tlb.Add(addr);
+                addr = stop;
                 continue;
             }
-            dest[i] = src[i];
-            dest[i].bits.writable = 0;
+            if (auto err = SplitHugePage(*pd_entry, la, tlb)) {
+                return err;
+            }
+        }
+
+        auto [pt_entry, err_pt] = FindPrivatePageMapEntry(pml4_table, la, 1, tlb);
+        if (err_pt) {
+            return err_pt;
+        }
+        PageMapEntry* page_table = pt_entry - la.Part(1);
+        for (; addr < stop; addr += kPageSize4K) {
+            auto& entry = page_table[LinearAddress4Level{addr}.Part(1)];
+            if (!entry.bits.present) {
+                continue;
+            }
+            // 共有中のフレーム（コピーオンライト、ページキャッシュ、ゼロページ）は参照カウントが残るので解放されない
+            if (auto err = FreePageMap(entry.Pointer())) {
+                return err;
+            }
+            entry.data = 0;
+            tlb.Add(addr);
         }
-        return MAKE_ERROR(Error::kSuccess);
     }
+    return MAKE_ERROR(Error::kSuccess);
+}
 
+namespace {
+    size_t CountPageMapFrames(PageMapEntry* page_map, int page_map_level, LinearAddress4Level addr) {
+        size_t frames = 0;
+        for (int i = addr.Part(page_map_level); i < 512; i++) {
+            const auto entry = page_map[i];
+            if (!entry.bits.present) {
+                continue;
+            }
+            if (page_map_level == 2 && entry.bits.huge_page) {
+                frames += 512;
+            } else if (page_map_level > 1) {
+                frames += 1 + CountPageMapFrames(entry.Pointer(), page_map_level - 1, addr);
+            } else {
+                frames += 1;
+            }
+        }
+        return frames;
+    }
+} // namespace
+
+size_t CountPageMapFrames(PageMapEntry* pml4_table, LinearAddress4Level addr) {
+    return CountPageMapFrames(pml4_table, 4, addr);
+}
+
+/// 階層ページング構造の浅いコピーを行う
+/// srcのstart以降のエントリが指す下位のページング構造（2MiBページ、物理フレーム）をdestと共有し、参照カウントを増やす
+/// 共有したものはsrcとdestの両方で書き込み禁止にしておき、書き込まれたときに書き込まれた経路のページング構造と
+/// ページだけをコピーする（UnsharePageMap()、CopyOnePage()）ので、コピーにかかる時間は下位のページング構造の量によらない
+Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start) {
+    TLBFlushBatch tlb{src};
     for (int i = start; i < 512; i++) {
         if (!src[i].bits.present) {
             continue;
         }
-        auto [table, err] = NewPageMap();
-        if (err) {
-            return err;
-        }
+        IncrementPageMapRefs(src[i], part);
+        src[i].bits.writable = 0;
         dest[i] = src[i];
-        dest[i].SetPointer(table);
-        if (auto err = CopyPageMaps(table, src[i].Pointer(), part - 1, 0)) {
-            return err;
-        }
     }
-
+    // srcが有効なら、書き込み可のTLBを残さない
+    tlb.AddAll();
     return MAKE_ERROR(Error::kSuccess);
 }
 
+Error PopulateFileMapping(const std::shared_ptr<IFileDescriptor>& fd, const VirtualMemoryArea& m) {
+    return PrepareFilePages(fd, m, m.begin, m.end).error;
+}
+
 Error HandlePageFault(uint64_t error_code, uint64_t causal_addr) {
     auto& task = g_task_manager->CurrentTask();
+    auto& stat = task.FaultStat();
+    ++stat.faults;
     const bool present = (error_code >> 0) & 1;
     const bool rw = (error_code >> 1) & 1;
     const bool user = (error_code >> 2) & 1;
-    if (present && rw && user) { // ページは存在するが読み込み専用なのでユーザーモードの書き込みが失敗
+    const auto vma = task.Vmas().Find(causal_addr);
+    // ページは存在するが読み込み専用なので書き込みが失敗
+    // アプリ用の領域であれば、システムコール内でのカーネルによる書き込みも同様に扱う
+    if (present && rw && (user || causal_addr >= kAppSpaceBegin)) {
+        // 共有マッピングのファイルはページキャッシュに直接書き込む
+        if (vma && vma->type == VmaType::kFile && (vma->flags & kVmaShared) &&
+            task.Files()[vma->fd]->FileID() != 0 && g_page_cache) {
+            return MakeSharedFilePageWritable(*task.Files()[vma->fd], *vma, causal_addr);
+        }
         // コピーオンライト
+        ++stat.cow_faults;
         return CopyOnePage(causal_addr);
     } else if (present) { // ページは存在するがページレベルの権限違反により例外発生
         return MAKE_ERROR(Error::kAlreadyAllocated);
     }
 
+    // アプリは事前にアドレス範囲を申告しておくことで、バグによるメモリ枯渇を防ぐ
+    if (vma == nullptr) {
+        return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+
     // デマンドページングの処理
-    if (task.DPagingBegin() <= causal_addr && causal_addr < task.DPagingEnd()) {
+    if (vma->type == VmaType::kAnonymous) {
+        ++stat.anonymous_faults;
+        // 2MiBページを使う範囲なら、フォルトしたアドレスを含む2MiBをまとめて割り当てる
+        // 連続した512フレームを確保できないか、2MiBが領域からはみ出すなら4KiBページで割り当てる
+        if (vma->CoversHugePage(causal_addr)) {
+            const LinearAddress4Level huge_addr{causal_addr & ~(kPageSize2M - 1)};
+            auto pd_entry = FindPageMapEntry(CurrentPML4(), huge_addr, 2);
+            if (pd_entry == nullptr || !pd_entry->bits.present) {
+                if (auto err = SetupPageMaps(huge_addr, 512, true, true); !err) {
+                    return err;
+                }
+            }
+        }
+
+        // 読み込みであればゼロページを共有し、書き込まれたときにコピーオンライトで物理フレームを割り当てる
+        if (!rw) {
+            return MapZeroPage(LinearAddress4Level{causal_addr});
+        }
         // ページフォルトの原因となったページに物理フレームを割り当てる
         return SetupPageMaps(LinearAddress4Level{causal_addr}, 1);
     }
 
     // メモリマップドファイルの処理
-    if (auto m = FindFileMapping(task.FileMaps(), causal_addr)) {
-        return PreparePageCache(*task.Files()[m->fd], *m, causal_addr);
+    if (vma->type == VmaType::kFile) {
+        ++stat.file_faults;
+        auto [num_prepared, err] = PrepareFileFault(task.Files()[vma->fd], *vma, causal_addr);
+        // フォルトしたページ以外に作成できたページ
+        stat.prefaulted_pages += num_prepared > 0 ? num_prepared - 1 : 0;
+        return err;
     }
 
-    // アプリは事前にアドレス範囲を申告しておくことで、バグによるメモリ枯渇を防ぐ
+    if (vma->type == VmaType::kElf && task.ExecFile()) {
+        ++stat.file_faults;
+        auto [num_prepared, err] = PrepareElfFault(task.ExecFile(), *vma, causal_addr, rw);
+        stat.prefaulted_pages += num_prepared > 0 ? num_prepared - 1 : 0;
+        return err;
+    }
+
+    // スタックは予約した範囲のうち、アクセスされたページに割り当てる
+    // 範囲の下はガードページ（どの領域にも含まれない）なので、溢れたアクセスはここに来ない
+    if (vma->type == VmaType::kStack) {
+        ++stat.anonymous_faults;
+        return SetupPageMaps(LinearAddress4Level{causal_addr}, 1);
+    }
+
+    // 遅延ロードしないELFはアプリの起動時に全ページを割り当て済み
     return MAKE_ERROR(Error::kIndexOutOfRange);
 }
@@ -5,11 +5,16 @@
 
 #pragma once
 
+#include <array>
 #include <cstddef>
 #include <cstdint>
+#include <memory>
 
 #include "error.hpp"
 
+class IFileDescriptor;
+struct VirtualMemoryArea;
+
 /// 静的に確保するページディレクトリの個数
 /// SetupIdentityPageMap()で使用される
 /// 1つのページディレクトリには512個の2MiBページを設定できるので、
@@ -24,6 +29,43 @@ void InitializePaging();
 
 /// CR3がOSカーネル用のPML4を指すように設定
 void ResetCR3();
+/// OSカーネル用のPML4を指すCR3の値（PCIDを含む）
+uint64_t KernelCR3();
+/// BSPと同じページングの設定（PCID、OSカーネル用のPML4）をAPに適用する（AP自身が呼ぶ）
+void InitializeAPPaging();
+
+/// PCID（Process-Context Identifier）: TLBのエントリにアドレス空間の番号を付け、CR3を切り替えてもTLBを消さずに済ませる
+/// CR3[11:0]にPCIDを置き、CR3のbit 63を1にして書き込むとそのPCIDのTLBを残したまま切り替わる
+/// 0はPCIDを使わない（切り替えのたびにTLBを消す）ことを表し、1はOSカーネル用のPML4が使う
+const uint64_t kNoPCID = 0;
+const uint64_t kKernelPCID = 1;
+const uint64_t kMaxPCID = 4095;
+/// CR3のうちPML4の物理アドレスを表す部分
+const uint64_t kCR3AddrMask = 0x000ffffffffff000;
+
+/// CR3への書き込み時にTLBを消さないためのビット（PCIDを使わないときは0）
+/// RestoreContext()が、PCIDを持つCR3を復帰するときに論理和をとる
+extern "C" uint64_t g_cr3_noflush;
+
+/// PCIDの使用状況
+struct PCIDStat {
+    /// CPUがPCID、INVPCID命令をサポートしている
+    bool supported, invpcid;
+    /// コンテキストスイッチでTLBを残している（g_cr3_noflush != 0）
+    bool noflush;
+    /// 割り当て中のPCIDの数（OSカーネル用を含む）
+    size_t in_use;
+};
+
+/// CPUがサポートしていればCR4.PCIDEを1にして、OSカーネル用のPML4にkKernelPCIDを割り当てる
+void InitializePCID();
+/// 新しいアドレス空間用のPCIDを割り当てる。PCIDが使えないか使い切っていればkNoPCID
+uint64_t AllocatePCID();
+/// cr3[11:0]のPCIDを解放する（kNoPCID、kKernelPCIDなら何もしない）
+void FreePCID(uint64_t cr3);
+/// PCIDを割り当てたままでも、コンテキストスイッチのたびにTLBを消すかどうか（性能比較用）
+void SetPCIDNoFlush(bool noflush);
+PCIDStat GetPCIDStat();
 
 /// 階層ページング構造における仮想アドレス
 union LinearAddress4Level {
@@ -114,10 +156,99 @@ union PageMapEntry {
     }
 };
 
+/// 0クリア済みの物理フレームのプール
+/// ページフォルト処理中にフレームを0クリアする時間を省くため、アイドルタスクが事前に補充しておく
+class ZeroedFramePool {
+public:
+    /// プールに置けるフレーム数の上限（4MiB）
+    static const size_t kCapacity = 1024;
+    /// 補充の目標値の初期値（256KiB）
+    static const size_t kDefaultWatermark = 64;
+
+    /// 0クリア済みのフレームを1つ取り出す。空ならnullptr
+    void* Take();
+    /// 目標値に満たなければフレームを1つ0クリアして補充する
+    /// return : 補充した -> true、目標値に達しているかフレームを確保できない -> false
+    bool Refill();
+    void SetWatermark(size_t watermark);
+
+    size_t Frames() const { return count_; }
+    size_t Watermark() const { return watermark_; }
+    size_t Hits() const { return hits_; }
+    size_t Misses() const { return misses_; }
+
+private:
+    std::array<void*, kCapacity> frames_{};
+    size_t count_{0};
+    size_t watermark_{kDefaultWatermark};
+    /// Take()で取り出せた回数、空だった回数
+    size_t hits_{0}, misses_{0};
+};
+
+extern ZeroedFramePool g_zeroed_frames;
+
+/// ファイルマッピングのページフォルト時に、まとめて作成するページ数の初期値（64KiB）
+const size_t kDefaultFaultAroundPages = 16;
+/// まとめて作成するページ数の上限（2MiB）
+const size_t kMaxFaultAroundPages = 512;
+/// ファイルマッピングのページフォルト時に、まとめて作成するページ数（1ならフォルトしたページのみ）
+extern size_t g_fault_around_pages;
+
+/// 現在のCR3が指すPML4（PCIDのビットを除く）
+PageMapEntry* CurrentPML4();
+/// 現在のアドレス空間のTLBを（グローバルページを除いて）すべて無効化する
+/// INVPCIDが使えればそのPCIDだけ、使えなければCR3の再設定で無効化する
+void FlushTLB();
+
+/// ページング構造の書き換えに伴うTLBの無効化をまとめて行う
+/// 書き換えたページのアドレスを集めておき、Flush()（またはデストラクタ）で
+/// kMaxPages個以下ならページ毎にINVLPG、超えていればFlushTLB()でアドレス空間全体を無効化する
+/// INVLPGは現在のPCIDのページング構造キャッシュもすべて無効化するので、途中の階層を解放した場合もページ毎の無効化で足りる
+class TLBFlushBatch {
+public:
+    /// これを超えたらページ毎の無効化をやめる
+    static const size_t kMaxPages = 32;
+
+    /// pml4_table : 書き換える階層ページング構造
+    /// 現在のCR3が指すもの以外はTLBに載っていないので何もしない
+    /// （他のPCIDに残っているTLBは、そのPCIDを再び割り当てるときに無効化される）
+    explicit TLBFlushBatch(PageMapEntry* pml4_table);
+    ~TLBFlushBatch() { Flush(); }
+    TLBFlushBatch(const TLBFlushBatch&) = delete;
+    TLBFlushBatch& operator=(const TLBFlushBatch&) = delete;
+
+    /// addrを含むページ（2MiBページも可）を無効化の対象に加える
+    void Add(uint64_t addr);
+    /// [begin, end)の4KiBページを無効化の対象に加える
+    void AddRange(uint64_t begin, uint64_t end);
+    /// アドレス空間全体を無効化の対象にする
+    void AddAll() { full_ = active_; }
+    /// 集めたページのTLBを無効化する
+    void Flush();
+
+private:
+    bool active_;
+    /// kMaxPagesを超えて加えられた
+    bool full_{false};
+    size_t count_{0};
+    std::array<uint64_t, kMaxPages> addrs_;
+};
+
 WithError<PageMapEntry*> NewPageMap();
+/// 参照カウントが0になったときだけ実際に解放する
 Error FreePageMap(PageMapEntry* table);
-Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages, bool writable = true);
+/// huge : 2MiB境界から512ページ以上続く部分は2MiBページ（PDのエントリでhuge_page=1）でマップする
+Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages, bool writable = true, bool huge = false);
 Error CleanPageMaps(LinearAddress4Level addr);
+/// 指定の階層ページング構造（有効になっていなくてよい）のうち、addr以降を破棄
+Error CleanPageMaps(PageMapEntry* pml4_table, LinearAddress4Level addr);
+/// 破棄したページをtlbに加える。無効化は呼び出し側がtlbで行う
+Error CleanPageMaps(PageMapEntry* pml4_table, LinearAddress4Level addr, TLBFlushBatch& tlb);
+/// 現在の階層ページング構造から[begin, end)のページを外し、参照が無くなったフレームを解放する
+/// 下位のページング構造は残す。一部だけを外す2MiBページは4KiBページに分割する
+Error UnmapPages(uint64_t begin, uint64_t end);
+/// 指定の階層ページング構造のうち、addr以降が使っているフレーム数（下位のページング構造自体を含む）
+size_t CountPageMapFrames(PageMapEntry* pml4_table, LinearAddress4Level addr);
 Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start);
 /// デマンドページング : 初めはどのページに対してもフレームを割り当てないでおき、
 /// ページに初めてアクセスされたときにそのページだけフレームを割り当てる
@@ -128,3 +259,5 @@ Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start);
 /// 2       | U/S   | 0 = スーパーバイザーモードのアクセス、1 = ユーザーモードのアクセス
 /// 3       | RSVD  | 0 = 予約ビットの違反が例外の原因ではない、1 = 予約ビットが1になっている
 Error HandlePageFault(uint64_t error_code, uint64_t causal_addr);
+/// ファイルマッピング全体のページを作成し、ファイルをコピーする（ページフォルトを待たない）
+Error PopulateFileMapping(const std::shared_ptr<IFileDescriptor>& fd, const VirtualMemoryArea& m);
@@ -4,21 +4,29 @@
 #include "interrupt.hpp"
 #include "logger.hpp"
 #include "memory_manager.hpp"
+#include "smp.hpp"
 
 namespace {
+    using GDT = std::array<SegmentDescriptor, 7>;
+    using TSS = std::array<uint32_t, 26>;
+
     /// GDT : Global Discriptor Table
-    std::array<SegmentDescriptor, 7> g_gdt;
+    GDT g_gdt;
     /// TSS : task-state segment
     /// タスク情報を保存するための構造体
     /// TSS用のセグメントはGDTの2要素分を消費する
-    std::array<uint32_t, 26> g_tss;
+    TSS g_tss;
+    /// AP用のGDTとTSS（添字はCPU番号。0番はBSPなので使わない）
+    /// TSSは割り込み時のスタックを指すのでCPUコアごとに必要になり、TSSを指すGDTもCPUコアごとに持つ
+    std::array<GDT, kMaxCPUs> g_ap_gdt;
+    std::array<TSS, kMaxCPUs> g_ap_tss;
 
     static_assert((kTSS >> 3) + 1 < g_gdt.size());
 
     /// TSSを設定
-    void SetTSS(int index, uint64_t value) {
-        g_tss[index] = value & 0xffffffff;
-        g_tss[index + 1] = value >> 32;
+    void SetTSS(TSS& tss, int index, uint64_t value) {
+        tss[index] = value & 0xffffffff;
+        tss[index + 1] = value >> 32;
     }
 
     uint64_t AllocateStackArea(int num_4kframes) {
@@ -79,17 +87,36 @@ void SetSystemSegment(SegmentDescriptor& desc,
     desc.bits.long_mode = 0;
 }
 
+namespace {
+    void SetupGDT(GDT& gdt) {
+        // null descriptor（GDTの0番目は使用されない）
+        gdt[0].data = 0;
+        // カーネル用のセグメントディスクリプタ
+        SetCodeSegment(gdt[1], DescriptorType::kExecuteRead, 0, 0, 0xfffff);
+        SetDataSegment(gdt[2], DescriptorType::kReadWrite, 0, 0, 0xfffff);
+        // アプリ用のセグメントディスクリプタ
+        // 権限レベルを最低にする
+        SetDataSegment(gdt[3], DescriptorType::kReadWrite, 3, 0, 0xfffff);
+        SetCodeSegment(gdt[4], DescriptorType::kExecuteRead, 3, 0, 0xfffff);
+    }
+
+    void SetupTSS(GDT& gdt, TSS& tss) {
+        // TSS.RSP0を設定
+        SetTSS(tss, 1, AllocateStackArea(8));
+        // TSS.IST1を設定
+        SetTSS(tss, 7 + 2 * kISTForTimer, AllocateStackArea(8));
+
+        uint64_t tss_addr = reinterpret_cast<uint64_t>(&tss[0]);
+        // GDT[5]にTSSの先頭アドレスを設定
+        SetSystemSegment(gdt[kTSS >> 3], DescriptorType::kTSSAvailable, 0, tss_addr & 0xffffffff, sizeof(tss) - 1);
+        // GDT[6]にTSSの先頭アドレスを設定
+        gdt[(kTSS >> 3) + 1].data = tss_addr >> 32;
+    }
+} // namespace
+
 /// セグメントの設定（GDTを再構築）
 void SetupSegments() {
-    // null descriptor（GDTの0番目は使用されない）
-    g_gdt[0].data = 0;
-    // カーネル用のセグメントディスクリプタ
-    SetCodeSegment(g_gdt[1], DescriptorType::kExecuteRead, 0, 0, 0xfffff);
-    SetDataSegment(g_gdt[2], DescriptorType::kReadWrite, 0, 0, 0xfffff);
-    // アプリ用のセグメントディスクリプタ
-    // 権限レベルを最低にする
-    SetDataSegment(g_gdt[3], DescriptorType::kReadWrite, 3, 0, 0xfffff);
-    SetCodeSegment(g_gdt[4], DescriptorType::kExecuteRead, 3, 0, 0xfffff);
+    SetupGDT(g_gdt);
     // g_gdtを正式なGDTとしてCPUに登録
     LoadGDT(sizeof(g_gdt) - 1, reinterpret_cast<uintptr_t>(&g_gdt[0]));
 }
@@ -103,18 +130,22 @@ void InitializeSegmentation() {
 }
 
 void InitializeTSS() {
-    // TSS.RSP0を設定
-    SetTSS(1, AllocateStackArea(8));
-    // TSS.IST1を設定
-    SetTSS(7 + 2 * kISTForTimer, AllocateStackArea(8));
-
-    uint64_t tss_addr = reinterpret_cast<uint64_t>(&g_tss[0]);
-    // GDT[5]にTSSの先頭アドレスを設定
-    SetSystemSegment(g_gdt[kTSS >> 3], DescriptorType::kTSSAvailable, 0, tss_addr & 0xffffffff, sizeof(g_tss) - 1);
-    // GDT[6]にTSSの先頭アドレスを設定
-    g_gdt[(kTSS >> 3) + 1].data = tss_addr >> 32;
+    SetupTSS(g_gdt, g_tss);
 
     // 割り込みが発生してCPL=3からCPL=0に切り替わる際（権限がアプリレベルからOSレベルに変化）TSSの値を読む必要が出ると、
     // CPUはTRレジスタが指すGDTエントリを参照してTSSを取得するので設定しておく
     LoadTR(kTSS);
+}
+
+void PrepareAPSegments(int cpu) {
+    SetupGDT(g_ap_gdt[cpu]);
+    SetupTSS(g_ap_gdt[cpu], g_ap_tss[cpu]);
+}
+
+void LoadAPSegments(int cpu) {
+    auto& gdt = g_ap_gdt[cpu];
+    LoadGDT(sizeof(gdt) - 1, reinterpret_cast<uintptr_t>(&gdt[0]));
+    SetDSAll(kKernelDS);
+    SetCSSS(kKernelCS, kKernelSS);
+    LoadTR(kTSS);
 }
\ No newline at end of file
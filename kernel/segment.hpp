@@ -67,4 +67,8 @@ const uint16_t kTSS = 5 << 3; // GDT[5] : TSS
 void SetupSegments();
 void InitializeSegmentation();
 /// TSSを初期化してGDTに設定する
-void InitializeTSS();
\ No newline at end of file
+void InitializeTSS();
+/// AP用のGDTとTSSを用意する（スタックを確保するので、BSPがAPの起動前に呼ぶ）
+void PrepareAPSegments(int cpu);
+/// PrepareAPSegments()で用意したGDTとTSSを、AP自身がCPUに登録する
+void LoadAPSegments(int cpu);
\ No newline at end of file
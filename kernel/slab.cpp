@@ -0,0 +1,213 @@
+#include "slab.hpp"
+
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+
+/// スラブの先頭に置かれる管理情報
+struct SlabCache::Slab {
+    Slab* prev;
+    Slab* next;
+    /// 空きオブジェクトの単方向リスト（オブジェクトの先頭8バイトに次の要素を格納）
+    void* free_list;
+    size_t in_use;
+};
+
+namespace {
+    /// 1スラブの最大の大きさ（2^4フレーム = 64KiB）
+    const int kMaxSlabOrder = 4;
+
+    /// 使用中のキャッシュ一覧の先頭
+    SlabCache* g_slab_caches = nullptr;
+
+    template <class Slab>
+    void PushSlab(Slab*& head, Slab* slab) {
+        slab->prev = nullptr;
+        slab->next = head;
+        if (head) {
+            head->prev = slab;
+        }
+        head = slab;
+    }
+
+    template <class Slab>
+    void UnlinkSlab(Slab*& head, Slab* slab) {
+        if (slab->prev) {
+            slab->prev->next = slab->next;
+        } else {
+            head = slab->next;
+        }
+        if (slab->next) {
+            slab->next->prev = slab->prev;
+        }
+    }
+
+    /// 汎用キャッシュ。32バイトからkSlabMaxObjectBytesまでの2のべき乗
+    SlabCache g_size_caches[] = {
+        {"slab-32", 32},
+        {"slab-64", 64},
+        {"slab-128", 128},
+        {"slab-256", 256},
+        {"slab-512", 512},
+        {"slab-1024", 1024},
+        {"slab-2048", 2048},
+        {"slab-4096", 4096},
+    };
+
+    SlabCache& SizeCache(size_t bytes) {
+        const int bits = bytes <= 32 ? 5 : 64 - __builtin_clzl(bytes - 1);
+        return g_size_caches[bits - 5];
+    }
+} // namespace
+
+void* SlabCache::Allocate() {
+    // 割り込みハンドラからも呼ばれる（メッセージキューの伸長など）
+    InterruptGuard guard;
+
+    if (!partial_) {
+        Slab* slab = empty_;
+        if (slab) {
+            empty_ = nullptr;
+        } else if ((slab = NewSlab()) == nullptr) {
+            return nullptr;
+        }
+        PushSlab(partial_, slab);
+    }
+
+    Slab* slab = partial_;
+    void* obj = slab->free_list;
+    slab->free_list = *reinterpret_cast<void**>(obj);
+    ++slab->in_use;
+    ++objects_in_use_;
+    if (slab->in_use == objects_per_slab_) {
+        UnlinkSlab(partial_, slab);
+        PushSlab(full_, slab);
+    }
+    return obj;
+}
+
+void SlabCache::Free(void* obj) {
+    if (obj == nullptr) {
+        return;
+    }
+    InterruptGuard guard;
+
+    // スラブは自身の大きさにアラインされている（バディアロケータの性質）
+    const uintptr_t slab_bytes = kBytesPerFrame << slab_order_;
+    auto slab = reinterpret_cast<Slab*>(reinterpret_cast<uintptr_t>(obj) & ~(slab_bytes - 1));
+
+    if (slab->in_use == objects_per_slab_) {
+        UnlinkSlab(full_, slab);
+        PushSlab(partial_, slab);
+    }
+    *reinterpret_cast<void**>(obj) = slab->free_list;
+    slab->free_list = obj;
+    --slab->in_use;
+    --objects_in_use_;
+
+    if (slab->in_use == 0) {
+        UnlinkSlab(partial_, slab);
+        // 確保と解放を繰り返す場合に備え、空のスラブを1つだけ手元に残す
+        if (empty_ == nullptr) {
+            empty_ = slab;
+        } else {
+            ReleaseSlab(slab);
+        }
+    }
+}
+
+SlabStat SlabCache::Stat() const {
+    const size_t frames_per_slab = slab_order_ < 0 ? 0 : size_t{1} << slab_order_;
+    const size_t total_bytes = slabs_ * frames_per_slab * kBytesPerFrame;
+    return {
+        name_,
+        object_size_,
+        objects_in_use_,
+        slabs_ * objects_per_slab_,
+        objects_per_slab_,
+        slabs_,
+        frames_per_slab,
+        total_bytes - objects_in_use_ * object_size_,
+    };
+}
+
+void SlabCache::Layout() {
+    header_bytes_ = (sizeof(Slab) + align_ - 1) / align_ * align_;
+    // ヘッダと端数による無駄がスラブの1/8以下になる最小の大きさを選ぶ
+    for (slab_order_ = 0; slab_order_ < kMaxSlabOrder; ++slab_order_) {
+        const size_t slab_bytes = kBytesPerFrame << slab_order_;
+        if (slab_bytes < header_bytes_ + object_size_) {
+            continue;
+        }
+        const size_t n = (slab_bytes - header_bytes_) / object_size_;
+        if ((slab_bytes - n * object_size_) * 8 <= slab_bytes) {
+            break;
+        }
+    }
+    objects_per_slab_ = ((kBytesPerFrame << slab_order_) - header_bytes_) / object_size_;
+}
+
+SlabCache::Slab* SlabCache::NewSlab() {
+    if (slab_order_ < 0) {
+        Layout();
+    }
+    if (objects_per_slab_ == 0) {
+        Log(kError, "slab %s: object too large (%lu bytes)\n", name_, object_size_);
+        return nullptr;
+    }
+
+    auto [frame, err] = g_memory_manager->Allocate(size_t{1} << slab_order_);
+    if (err) {
+        return nullptr;
+    }
+
+    auto slab = reinterpret_cast<Slab*>(frame.Frame());
+    slab->prev = slab->next = nullptr;
+    slab->in_use = 0;
+    slab->free_list = nullptr;
+    auto objs = reinterpret_cast<uint8_t*>(slab) + header_bytes_;
+    for (size_t i = objects_per_slab_; i > 0; --i) {
+        void* obj = objs + (i - 1) * object_size_;
+        *reinterpret_cast<void**>(obj) = slab->free_list;
+        slab->free_list = obj;
+    }
+
+    ++slabs_;
+    if (!registered_) {
+        registered_ = true;
+        next_cache_ = g_slab_caches;
+        g_slab_caches = this;
+    }
+    return slab;
+}
+
+void SlabCache::ReleaseSlab(Slab* slab) {
+    g_memory_manager->Free(FrameID{reinterpret_cast<uintptr_t>(slab) / kBytesPerFrame},
+                           size_t{1} << slab_order_);
+    --slabs_;
+}
+
+void ForEachSlabCache(void (*f)(const SlabCache&, void*), void* arg) {
+    for (SlabCache* cache = g_slab_caches; cache; cache = cache->next_cache_) {
+        f(*cache, arg);
+    }
+}
+
+void* SlabAllocate(size_t bytes) {
+    if (bytes > kSlabMaxObjectBytes) {
+        return ::operator new(bytes);
+    }
+    void* p = SizeCache(bytes).Allocate();
+    if (p == nullptr) {
+        std::get_new_handler()();
+    }
+    return p;
+}
+
+void SlabFree(void* p, size_t bytes) {
+    if (bytes > kSlabMaxObjectBytes) {
+        ::operator delete(p);
+        return;
+    }
+    SizeCache(bytes).Free(p);
+}
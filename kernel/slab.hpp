@@ -0,0 +1,114 @@
+/// スラブアロケータ : 同じ大きさのオブジェクトを物理フレーム単位でまとめて確保し、使い回す
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+
+/// スラブの統計情報
+struct SlabStat {
+    const char* name;
+    /// オブジェクト1つの大きさ（アラインメント調整後）
+    size_t object_size;
+    /// 使用中のオブジェクト数
+    size_t objects_in_use;
+    /// スラブ全体で確保可能なオブジェクト数
+    size_t objects_total;
+    /// 1スラブあたりのオブジェクト数
+    size_t objects_per_slab;
+    size_t slabs;
+    /// 1スラブあたりのフレーム数
+    size_t frames_per_slab;
+    /// 生きたオブジェクトに使われていないバイト数（ヘッダ、端数、空きオブジェクト）
+    size_t waste_bytes;
+};
+
+/// 1種類のオブジェクト専用のキャッシュ
+/// スラブ（2のべき乗個の連続フレーム）の先頭にヘッダを置き、残りをオブジェクトで埋める
+/// 確保・解放はともに定数時間
+class SlabCache {
+public:
+    /// constexprなので静的変数として定数初期化され、グローバルコンストラクタを必要としない
+    constexpr SlabCache(const char* name, size_t object_size, size_t align = 16)
+        : name_{name},
+          object_size_{(std::max(object_size, sizeof(void*)) + align - 1) / align * align},
+          align_{align} {}
+
+    SlabCache(const SlabCache&) = delete;
+    SlabCache& operator=(const SlabCache&) = delete;
+
+    /// 確保できなければnullptr
+    void* Allocate();
+    void Free(void* obj);
+    size_t ObjectSize() const { return object_size_; }
+    SlabStat Stat() const;
+
+private:
+    struct Slab;
+
+    const char* name_;
+    size_t object_size_;
+    size_t align_;
+    /// 以下、最初のスラブ生成時に決まる
+    int slab_order_{-1};
+    size_t header_bytes_{0};
+    size_t objects_per_slab_{0};
+    /// 空きオブジェクトを持つスラブのリスト
+    Slab* partial_{nullptr};
+    /// 空きオブジェクトを持たないスラブのリスト
+    Slab* full_{nullptr};
+    /// 次に備えて保持している空のスラブ（高々1つ）
+    Slab* empty_{nullptr};
+    size_t slabs_{0};
+    size_t objects_in_use_{0};
+    /// 統計表示用のキャッシュ一覧（最初のスラブ生成時に登録）
+    SlabCache* next_cache_{nullptr};
+    bool registered_{false};
+
+    void Layout();
+    Slab* NewSlab();
+    void ReleaseSlab(Slab* slab);
+
+    friend void ForEachSlabCache(void (*f)(const SlabCache&, void*), void* arg);
+};
+
+/// 使用中のすべてのキャッシュを列挙
+void ForEachSlabCache(void (*f)(const SlabCache&, void*), void* arg);
+
+/// 大きさ別の汎用キャッシュから確保する（kSlabMaxObjectBytesを超える場合はヒープから）
+void* SlabAllocate(size_t bytes);
+/// bytesは確保時と同じ値を渡す
+void SlabFree(void* p, size_t bytes);
+constexpr size_t kSlabMaxObjectBytes = 4096;
+
+/// 汎用キャッシュを使うアロケータ
+/// std::allocate_sharedの制御ブロックやstd::dequeのブロックなど、型ごとにoperator newを定義できないものに使う
+template <class T>
+struct SlabAllocator {
+    using value_type = T;
+
+    SlabAllocator() = default;
+    template <class U>
+    SlabAllocator(const SlabAllocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(SlabAllocate(n * sizeof(T)));
+    }
+    void deallocate(T* p, size_t n) noexcept {
+        SlabFree(p, n * sizeof(T));
+    }
+};
+
+template <class T, class U>
+bool operator==(const SlabAllocator<T>&, const SlabAllocator<U>&) { return true; }
+template <class T, class U>
+bool operator!=(const SlabAllocator<T>&, const SlabAllocator<U>&) { return false; }
+
+/// std::make_sharedの代わりに使う。オブジェクトと制御ブロックをまとめて汎用キャッシュから確保
+template <class T, class... Args>
+std::shared_ptr<T> MakeSlabShared(Args&&... args) {
+    return std::allocate_shared<T>(SlabAllocator<T>{}, std::forward<Args>(args)...);
+}
@@ -0,0 +1,212 @@
+#include "smp.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstring>
+
+#include "acpi.hpp"
+#include "asmfunc.h"
+#include "fpu.hpp"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "segment.hpp"
+#include "syscall.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+namespace {
+    /// 起動コードに渡すパラメータ（asmfunc.asmのAPBootParamsと同じ配置）
+    struct BootParams {
+        /// 一時的なGDT : null、64bitモード用のコードセグメント、データセグメント
+        uint64_t gdt[3];
+        /// LGDT命令のオペランド
+        uint16_t gdtr_limit;
+        uint32_t gdtr_base;
+        uint16_t reserved1;
+        /// ロングモードに入るfar jumpの飛び先
+        uint32_t jump_offset;
+        uint16_t jump_selector;
+        uint16_t reserved2;
+        uint32_t cr0, cr3, cr4;
+        uint32_t cpu;
+        uint64_t stack;
+        /// APMain()のアドレス
+        uint64_t entry;
+    } __attribute__((packed));
+    static_assert(offsetof(BootParams, gdtr_limit) == 0x18);
+    static_assert(offsetof(BootParams, jump_offset) == 0x20);
+    static_assert(offsetof(BootParams, cr0) == 0x28);
+    static_assert(offsetof(BootParams, stack) == 0x38);
+    static_assert(sizeof(BootParams) == 0x48);
+
+    /// Local APIC IDからCPU番号を引く表（BSPと登録していないIDは0）
+    std::array<uint8_t, 256> g_cpu_of_apic{};
+    /// CPU番号からLocal APIC IDを引く表
+    std::array<uint8_t, kMaxCPUs> g_apic_of_cpu{};
+    /// アイドル中のCPUコアは1（添字はCPU番号）
+    std::array<int, kMaxCPUs> g_cpu_idle{};
+    int g_num_cpus = 1;
+    /// 起動したAPがAPMain()の初期化を終えると1にする
+    int g_ap_ready = 0;
+    /// APの起動処理に使うスタック。そのままアイドルタスクのスタックになる
+    const size_t kAPStackFrames = 4;
+
+    volatile uint32_t& LAPICRegister(uint32_t offset) {
+        return *reinterpret_cast<volatile uint32_t*>(0xfee00000 + offset);
+    }
+
+    void WaitMicroseconds(unsigned long usec) {
+        const uint32_t start = acpi::PMTimerCount();
+        while (acpi::MicrosecondsSince(start) < usec) {
+            __asm__ volatile("pause");
+        }
+    }
+
+    /// Interrupt Command RegisterにIPIを書き込み、送信が終わるまで待つ
+    void SendIPI(uint8_t apic_id, uint32_t command) {
+        LAPICRegister(0x310) = static_cast<uint32_t>(apic_id) << 24;
+        LAPICRegister(0x300) = command;
+        // Delivery Status（bit 12）が0に戻れば送信済み
+        while (LAPICRegister(0x300) & (1u << 12)) {
+            __asm__ volatile("pause");
+        }
+    }
+
+    /// INIT IPIで初期化し、SIPIを2回送って起動アドレスから動かす
+    /// boot_addr : 1MiB未満の4KiB境界（SIPIにはページ番号を載せる）
+    void StartAP(uint8_t apic_id, uintptr_t boot_addr) {
+        SendIPI(apic_id, 0x00004500); // INIT, Level = Assert
+        acpi::WaitMillisecondes(10);
+        for (int i = 0; i < 2; i++) {
+            SendIPI(apic_id, 0x00004600 | (boot_addr >> 12)); // Start-up
+            WaitMicroseconds(200);
+        }
+    }
+} // namespace
+
+int CPUCount() {
+    return __atomic_load_n(&g_num_cpus, __ATOMIC_ACQUIRE);
+}
+
+uint8_t LocalAPICID() {
+    return LAPICRegister(0x20) >> 24;
+}
+
+int CurrentCPU() {
+    return g_cpu_of_apic[LocalAPICID()];
+}
+
+void SetCPUIdle(bool idle) {
+    // 書き込みの後の読み込みを前に出さない（xchgになる）ので、この後で待機列を確認すれば起こし損ねない
+    __atomic_store_n(&g_cpu_idle[CurrentCPU()], idle, __ATOMIC_SEQ_CST);
+}
+
+void WakeCPU(int cpu) {
+    // 待機列への書き込みの後でアイドル中かを読む。SetCPUIdle()と合わせて、どちらかが必ず相手に気づく
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&g_cpu_idle[cpu], __ATOMIC_RELAXED)) {
+        return;
+    }
+    InterruptGuard guard;
+    if (cpu == CurrentCPU()) {
+        return;
+    }
+    // Delivery Mode = Fixed, Level = Assert
+    SendIPI(g_apic_of_cpu[cpu], 0x00004000 | InterruptVector::kWakeup);
+}
+
+void WakeIdleCPUs() {
+    const int num_cpus = CPUCount();
+    for (int cpu = 0; cpu < num_cpus; cpu++) {
+        WakeCPU(cpu);
+    }
+}
+
+/// 起動コードがロングモードに入ってから呼ぶ
+extern "C" void APMain(int cpu) {
+    LoadAPSegments(cpu);
+    LoadIDT(sizeof(g_idt) - 1, reinterpret_cast<uintptr_t>(&g_idt[0]));
+    InitializeAPPaging();
+    InitializeAPFPU();
+    g_task_manager->TakeFPU();
+    InitializeSyscall();
+    InitializeAPLAPICTimer();
+    __atomic_store_n(&g_ap_ready, 1, __ATOMIC_RELEASE);
+
+    // 以降はAddCPU()で作ったアイドルタスクとして動く
+    __asm__("sti");
+    TaskIdle(g_task_manager->CurrentTask().ID(), 0);
+}
+
+void InitializeSMP() {
+    std::array<uint8_t, kMaxCPUs> apic_ids;
+    const size_t num_ids = std::min(acpi::ListLocalAPICIDs(apic_ids.data(), apic_ids.size()), apic_ids.size());
+    if (num_ids <= 1) {
+        Log(kInfo, "SMP: no application processor\n");
+        return;
+    }
+    const uint64_t kernel_pml4 = KernelCR3() & kCR3AddrMask;
+    if (g_low_frame_addr == 0 || kernel_pml4 >> 32) {
+        Log(kWarn, "SMP: cannot place the AP startup code\n");
+        return;
+    }
+
+    // 起動コードを1MiB未満のフレームにコピーして、コピー先のパラメータを埋める
+    auto boot_code = reinterpret_cast<uint8_t*>(g_low_frame_addr);
+    memcpy(boot_code, APTrampoline, APTrampolineEnd - APTrampoline);
+    auto& params = *reinterpret_cast<BootParams*>(boot_code + (APBootParams - APTrampoline));
+    params.gdt[0] = 0;
+    params.gdt[1] = 0x00af9a000000ffff;
+    params.gdt[2] = 0x00cf92000000ffff;
+    params.gdtr_limit = sizeof(params.gdt) - 1;
+    params.gdtr_base = reinterpret_cast<uintptr_t>(&params.gdt[0]);
+    params.jump_offset = g_low_frame_addr + (APTrampoline64 - APTrampoline);
+    params.jump_selector = 1 << 3;
+    // CR0.TSはタスクの切替えで立てるものなので、APには引き継がない
+    params.cr0 = GetCR0() & ~(1ul << 3);
+    params.cr3 = kernel_pml4;
+    // CR4.PCIDEはロングモードに入ってからでないと立てられないので、APMain()で立てる
+    params.cr4 = GetCR4() & ~(1ul << 17);
+    params.entry = reinterpret_cast<uint64_t>(APMain);
+
+    const uint8_t bsp_id = LocalAPICID();
+    g_apic_of_cpu[0] = bsp_id;
+    for (size_t i = 0; i < num_ids; i++) {
+        const uint8_t apic_id = apic_ids[i];
+        if (apic_id == bsp_id) {
+            continue;
+        }
+
+        // 起動コードとパラメータは1組しかないので、APは1つずつ起動する
+        const int cpu = g_num_cpus;
+        auto [stack, err] = g_memory_manager->Allocate(kAPStackFrames);
+        if (err) {
+            Log(kWarn, "SMP: failed to allocate an AP stack: %s\n", err.Name());
+            break;
+        }
+        PrepareAPSegments(cpu);
+        g_task_manager->AddCPU(cpu);
+        g_cpu_of_apic[apic_id] = cpu;
+        g_apic_of_cpu[cpu] = apic_id;
+        params.cpu = cpu;
+        params.stack = reinterpret_cast<uint64_t>(stack.Frame()) + kAPStackFrames * kBytesPerFrame;
+
+        __atomic_store_n(&g_ap_ready, 0, __ATOMIC_RELEASE);
+        StartAP(apic_id, g_low_frame_addr);
+        const uint32_t start = acpi::PMTimerCount();
+        while (!__atomic_load_n(&g_ap_ready, __ATOMIC_ACQUIRE) && acpi::MicrosecondsSince(start) < 100000) {
+            __asm__ volatile("pause");
+        }
+        if (!__atomic_load_n(&g_ap_ready, __ATOMIC_ACQUIRE)) {
+            // 遅れて動き出すかもしれないので、このCPU番号とパラメータはもう使わない
+            Log(kWarn, "SMP: AP (APIC ID %u) did not start\n", apic_id);
+            break;
+        }
+        __atomic_store_n(&g_num_cpus, cpu + 1, __ATOMIC_RELEASE);
+    }
+
+    Log(kInfo, "SMP: %d CPUs online\n", CPUCount());
+}
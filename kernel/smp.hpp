@@ -0,0 +1,31 @@
+/// マルチプロセッサ : BSP以外のCPUコア（AP）を起動し、CPUコアを番号で識別する
+/// BSP : Bootstrap Processor, 電源投入時に動き出すCPUコア。UEFIとOSの初期化はこれだけで行う
+/// AP : Application Processor, BSPがINIT IPIとSIPIを送るまで停止しているCPUコア
+/// IPI : Inter-Processor Interrupt, Local APIC同士で送るCPUコア間の割り込み
+
+#pragma once
+
+#include <cstdint>
+
+/// 扱うCPUコア数の上限
+const int kMaxCPUs = 16;
+
+/// 動作中のCPUコアの数（BSPを含む）
+int CPUCount();
+/// 現在のCPUコアの番号。BSPが0、APは起動した順に1から
+/// 割り込み禁止中か、CPU間を移動しないタスクから呼ぶこと（呼んだ直後に別のCPUコアへ移されるとずれる）
+int CurrentCPU();
+/// 現在のCPUコアのLocal APIC ID
+uint8_t LocalAPICID();
+
+/// 現在のCPUコアがアイドル中（hltで割り込みを待っている）かを設定する。割り込み禁止中に呼ぶ
+/// タイマ割り込みは必要なときしか来ないので、アイドル中のCPUコアは他のCPUコアがIPIで起こす
+void SetCPUIdle(bool idle);
+/// 指定のCPUコアがアイドル中ならIPIで起こす（待機列に入れたタスクを実行させる）
+void WakeCPU(int cpu);
+/// アイドル中の他のCPUコアをすべて起こす（CPU間を移れるタスクを引き受けさせる）
+void WakeIdleCPUs();
+
+/// MADTに記載されたAPをすべて起動する
+/// 各APはOSカーネル用のPML4で動き、自分の待機列のタスクを実行する
+void InitializeSMP();
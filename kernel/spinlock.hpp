@@ -0,0 +1,53 @@
+/// スピンロック : 複数のCPUコアから共有される構造体を保護する
+/// 割り込みの禁止（cli）は自分のCPUコアにしか効かないので、他のCPUコアとの排他にはこちらを使う
+
+#pragma once
+
+#include <cstdint>
+
+#include "interrupt.hpp"
+
+class SpinLock {
+public:
+    constexpr SpinLock() {}
+    SpinLock(const SpinLock&) = delete;
+    SpinLock& operator=(const SpinLock&) = delete;
+
+    void Lock() {
+        while (__atomic_exchange_n(&locked_, 1, __ATOMIC_ACQUIRE)) {
+            // 書き込みを繰り返してキャッシュラインを奪い合わないよう、空くまでは読むだけにする
+            while (__atomic_load_n(&locked_, __ATOMIC_RELAXED)) {
+                __asm__ volatile("pause");
+            }
+        }
+    }
+    /// 取得できなければ待たずにfalse
+    bool TryLock() {
+        return __atomic_exchange_n(&locked_, 1, __ATOMIC_ACQUIRE) == 0;
+    }
+    void Unlock() {
+        __atomic_store_n(&locked_, 0, __ATOMIC_RELEASE);
+    }
+
+private:
+    uint32_t locked_{0};
+};
+
+/// スコープの間、割り込みを禁止してスピンロックを保持する
+/// 割り込みを禁止しないと、ロック中に割り込んだハンドラが同じロックを取ろうとして自分のCPUコアでデッドロックする
+class SpinLockGuard {
+public:
+    explicit SpinLockGuard(SpinLock& lock) : lock_{lock} {
+        lock_.Lock();
+    }
+    ~SpinLockGuard() {
+        lock_.Unlock();
+    }
+    SpinLockGuard(const SpinLockGuard&) = delete;
+    SpinLockGuard& operator=(const SpinLockGuard&) = delete;
+
+private:
+    // lock_より先に構築され、後に破棄される
+    InterruptGuard interrupt_guard_;
+    SpinLock& lock_;
+};
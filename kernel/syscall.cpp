@@ -9,6 +9,7 @@
 #include "app_event.hpp"
 #include "asmfunc.h"
 #include "font.hpp"
+#include "fpu.hpp"
 #include "keyboard.hpp"
 #include "logger.hpp"
 #include "msr.hpp"
@@ -83,7 +84,7 @@ namespace syscall {
     SYSCALL(OpenWindow) {
         const int w = arg1, h = arg2, x = arg3, y = arg4;
         const auto title = reinterpret_cast<const char*>(arg5);
-        const auto win = std::make_shared<TopLevelWindow>(w, h, g_screen_config.pixel_format, title);
+        const auto win = MakeSlabShared<TopLevelWindow>(w, h, g_screen_config.pixel_format, title);
 
         __asm__("cli");
         const auto layer_id = g_layer_manager->NewLayer()
@@ -325,19 +326,49 @@ namespace syscall {
         const uint64_t task_id = g_task_manager->CurrentTask().ID();
         __asm__("sti");
 
-        unsigned long timeout = arg3 * kTimerFreq / 1000;
+        // 1秒あたりの単位数。mode & 2ならマイクロ秒、それ以外はミリ秒
+        const unsigned long unit = (mode & 2) ? 1000000 : 1000;
+        // 換算の途中で桁あふれしないよう、1年より先の時刻は受け付けない
+        const unsigned long kMaxTimeoutSec = 365ul * 24 * 60 * 60;
+        if (arg3 / unit > kMaxTimeoutSec) {
+            return {0, EINVAL};
+        }
+        unsigned long timeout = arg3 / unit * kTimerFreq + arg3 % unit * kTimerFreq / unit;
         if (mode & 1) { // relative
-                        // 現在時刻を基準としてarg3 msec後にタイムアウト
+                        // 現在時刻を基準としてarg3 (m|u)sec後にタイムアウト
             timeout += g_timer_manager->CurrentTick();
         }
 
         __asm__("cli");
         // 符号を反転しているのはOSとアプリのタイマを区別するため
         // ターミナルタスクにはカーソル点滅タイマの通知が常に送られてくるので、アプリのタイマ値とだぶっても大丈夫なようにしている
-        g_timer_manager->AddTimer(Timer{timeout, -timer_value, task_id});
+        auto [timer_id, err] = g_timer_manager->AddTimer(Timer{timeout, -timer_value, task_id});
         __asm__("sti");
+        if (err) {
+            return {0, ENOMEM};
+        }
+
+        if (mode & 4) { // CancelTimer()に渡すIDを返す
+            return {timer_id, 0};
+        }
+        return {timeout / kTimerFreq * unit + timeout % kTimerFreq * unit / kTimerFreq, 0};
+    }
 
-        return {timeout * 1000 / kTimerFreq, 0};
+    /// CreateTimerで作ったタイマを、タイムアウト前に取り消す
+    SYSCALL(CancelTimer) {
+        const uint64_t timer_id = arg1;
+
+        __asm__("cli");
+        const uint64_t task_id = g_task_manager->CurrentTask().ID();
+        const Timer* timer = g_timer_manager->FindTimer(timer_id);
+        // 自分が作ったアプリのタイマ（値が負）だけ。ターミナルのカーソル点滅タイマなどは取り消せない
+        if (timer == nullptr || timer->TaskID() != task_id || timer->Value() >= 0) {
+            __asm__("sti");
+            return {0, EINVAL};
+        }
+        g_timer_manager->CancelTimer(timer_id);
+        __asm__("sti");
+        return {0, 0};
     }
 
     namespace {
@@ -402,7 +433,7 @@ namespace syscall {
         }
 
         size_t fd = AllocateFD(task);
-        task.Files()[fd] = std::make_unique<fat::FileDescriptor>(*file);
+        task.Files()[fd] = MakeSlabShared<fat::FileDescriptor>(*file);
         return {fd, 0};
     }
 
@@ -426,15 +457,45 @@ namespace syscall {
     /// このシステムコールは、アプリ側にはメモリ確保と同義
     SYSCALL(DemandPages) {
         const size_t num_pages = arg1;
-        // const int flags = arg2;
+        const int flags = arg2;
         __asm__("cli");
         auto& task = g_task_manager->CurrentTask();
         __asm__("sti");
 
-        const uint64_t dp_end = task.DPagingEnd();
+        const bool huge = flags & 1;
+        const bool populate = flags & 2;
+        uint64_t begin = task.DPagingEnd();
+        uint64_t bytes = 4096 * num_pages;
+        // DEMAND_PAGES_HUGE : 2MiB境界に揃えた範囲を確保し、フォルト時に2MiBページで割り当てる
+        if (huge) {
+            const uint64_t kHugePageBytes = 512 * 4096;
+            begin = (begin + kHugePageBytes - 1) & ~(kHugePageBytes - 1);
+            bytes = (bytes + kHugePageBytes - 1) & ~(kHugePageBytes - 1);
+        }
+        if (bytes == 0) {
+            return {begin, 0};
+        }
+        // メモリマップドファイルの範囲の先頭まで。そこから上のスタックのガードページは、どの領域とも重ねない
+        // 4096 * num_pagesの桁あふれも、ページ数を先に比べて除く
+        const uint64_t limit = task.FileMapEnd();
+        if (begin > limit || num_pages > (limit - begin) / 4096 || bytes > limit - begin) {
+            return {0, ENOMEM};
+        }
+        const uint32_t vma_flags = kVmaWritable | (huge ? kVmaHuge : 0);
+        if (auto err = task.Vmas().Insert({begin, begin + bytes, VmaType::kAnonymous, vma_flags, -1, 0})) {
+            return {0, ENOMEM};
+        }
         // 指定ページ数の分だけ終端を後ろにずらす
-        task.SetDPagingEnd(dp_end + 4096 * num_pages);
-        return {dp_end, 0};
+        task.SetDPagingEnd(begin + bytes);
+
+        // DEMAND_PAGES_POPULATE : ページフォルトを待たずに全ページを割り当てる
+        if (populate) {
+            if (auto err = SetupPageMaps(LinearAddress4Level{begin}, bytes / 4096, true, huge)) {
+                return {0, ENOMEM};
+            }
+            task.FaultStat().prefaulted_pages += bytes / 4096;
+        }
+        return {begin, 0};
     }
 
     /// ファイルマッピングを登録
@@ -442,7 +503,7 @@ namespace syscall {
     SYSCALL(MapFile) {
         const int fd = arg1;
         size_t* file_size = reinterpret_cast<size_t*>(arg2);
-        // const int flags = arg3;
+        const int flags = arg3;
         __asm__("cli");
         auto& task = g_task_manager->CurrentTask();
         __asm__("sti");
@@ -454,11 +515,110 @@ namespace syscall {
 
         *file_size = task.Files()[fd]->Size();
         const uint64_t vaddr_end = task.FileMapEnd();
+        // デマンドページングの範囲と重ねない（その間が空いていれば、スタックのガードページを覆うこともない）
+        if (*file_size > vaddr_end - task.DPagingEnd()) {
+            return {0, ENOMEM};
+        }
         const uint64_t vaddr_begin = (vaddr_end - *file_size) & 0xfffffffffffff000;
+        if (vaddr_begin < task.DPagingEnd()) {
+            return {0, ENOMEM};
+        }
+        if (vaddr_begin == vaddr_end) {
+            return {vaddr_begin, 0};
+        }
+        // MAP_FILE_SHARED : 書き込みをページキャッシュ経由でファイルに反映する
+        const uint32_t vma_flags = kVmaWritable | (flags & 2 ? kVmaShared : 0);
+        const VirtualMemoryArea vma{vaddr_begin, vaddr_end, VmaType::kFile, vma_flags, fd, 0};
+        if (auto err = task.Vmas().Insert(vma)) {
+            return {0, ENOMEM};
+        }
         task.SetFileMapEnd(vaddr_begin);
-        task.FileMaps().push_back(FileMapping{fd, vaddr_begin, vaddr_end});
+
+        // MAP_FILE_POPULATE : ページフォルトを待たずにファイル全体を読み込む
+        if (flags & 1) {
+            if (auto err = PopulateFileMapping(task.Files()[fd], vma)) {
+                return {0, ENOMEM};
+            }
+            task.FaultStat().prefaulted_pages += (vaddr_end - vaddr_begin + 4095) / 4096;
+        }
         return {vaddr_begin, 0};
     }
+
+    namespace {
+        /// アプリが解放してよい範囲（デマンドページングとファイルマッピングの領域だけで覆われている）か
+        /// ELFとスタックはページフォルトで作り直せないことがあるので対象外
+        bool IsReleasableRange(const VmaList& vmas, uint64_t begin, uint64_t end) {
+            // 領域のない隙間（引数のページや、先に読み込んだELFなど）も対象外なので、隙間なく覆われていること
+            // 範囲がアドレス空間の末尾まで（end == 0）でも正しく扱えるよう、beginからの距離で比べる
+            const uint64_t length = end - begin;
+            for (uint64_t offset = 0; offset < length;) {
+                const auto vma = vmas.Find(begin + offset);
+                if (vma == nullptr || (vma->type != VmaType::kAnonymous && vma->type != VmaType::kFile)) {
+                    return false;
+                }
+                offset = vma->end - begin;
+            }
+            return true;
+        }
+
+        /// 引数のアドレスとページ数から、解放する範囲[begin, end)を求める
+        /// return : 範囲が不正ならbegin == end
+        std::pair<uint64_t, uint64_t> ReleaseRange(uint64_t addr, size_t num_pages) {
+            const uint64_t kAppSpaceBegin = 0xffff800000000000;
+            if (addr % 4096 != 0 || addr < kAppSpaceBegin || num_pages > (0 - addr) / 4096) {
+                return {0, 0};
+            }
+            return {addr, addr + 4096 * num_pages};
+        }
+    } // namespace
+
+    /// 指定範囲のページを解放し、領域の登録も取り消す（munmap相当）
+    /// 範囲がデマンドページング、ファイルマッピングの末端であれば、次の確保でその範囲を再利用する
+    SYSCALL(UnmapPages) {
+        const auto [begin, end] = ReleaseRange(arg1, arg2);
+        __asm__("cli");
+        auto& task = g_task_manager->CurrentTask();
+        __asm__("sti");
+
+        if (begin == end || !IsReleasableRange(task.Vmas(), begin, end)) {
+            return {0, EINVAL};
+        }
+        if (auto err = ::UnmapPages(begin, end)) {
+            return {0, ENOMEM};
+        }
+        task.Vmas().Remove(begin, end);
+        if (end == task.DPagingEnd()) {
+            task.SetDPagingEnd(begin);
+        }
+        if (begin == task.FileMapEnd()) {
+            task.SetFileMapEnd(end);
+        }
+        return {0, 0};
+    }
+
+    /// 指定範囲のページを解放するが、領域は残す（madvise(MADV_DONTNEED)相当）
+    /// 次にアクセスしたときにページフォルトで割り当て直される
+    /// 匿名メモリは0で埋まったページに、ファイルマッピングはファイル（共有マッピングなら書き込んだ内容）に戻る
+    SYSCALL(DiscardPages) {
+        const auto [begin, end] = ReleaseRange(arg1, arg2);
+        __asm__("cli");
+        auto& task = g_task_manager->CurrentTask();
+        __asm__("sti");
+
+        if (begin == end || !IsReleasableRange(task.Vmas(), begin, end)) {
+            return {0, EINVAL};
+        }
+        if (auto err = ::UnmapPages(begin, end)) {
+            return {0, ENOMEM};
+        }
+        return {0, 0};
+    }
+
+    /// OSがタスク切替えで保存・復帰する拡張状態（XCR0の値）
+    /// 命令セットの対応（AVX2など）はCPUIDで分かるが、使ってよいかはOSが状態を保存するかで決まる
+    SYSCALL(GetCPUFeatures) {
+        return {EnabledXFeatures(), 0};
+    }
 #undef SYSCALL
 
 } // namespace syscall
@@ -468,7 +628,7 @@ using SyscallFuncType = syscall::Result(uint64_t, uint64_t, uint64_t, uint64_t,
 
 /// システムコールの（関数ポインタ）テーブル
 /// この添字に0x80000000を足した値をシステムコール番号とする
-extern "C" std::array<SyscallFuncType*, 0x10> g_syscall_table{
+extern "C" std::array<SyscallFuncType*, 0x14> g_syscall_table{
     /* 0x00 */ syscall::LogString,
     /* 0x01 */ syscall::PutString,
     /* 0x02 */ syscall::Exit,
@@ -485,6 +645,10 @@ extern "C" std::array<SyscallFuncType*, 0x10> g_syscall_table{
     /* 0x0d */ syscall::ReadFile,
     /* 0x0e */ syscall::DemandPages,
     /* 0x0f */ syscall::MapFile,
+    /* 0x10 */ syscall::UnmapPages,
+    /* 0x11 */ syscall::DiscardPages,
+    /* 0x12 */ syscall::CancelTimer,
+    /* 0x13 */ syscall::GetCPUFeatures,
 };
 
 void InitializeSyscall() {
@@ -1,22 +1,67 @@
 #include "task.hpp"
 
 #include "asmfunc.h"
+#include "fpu.hpp"
+#include "paging.hpp"
 #include "segment.hpp"
 #include "timer.hpp"
 
 namespace {
-    template <class T, class U>
-    void Erase(T& c, const U& value) {
-        auto it = std::remove(c.begin(), c.end(), value);
-        c.erase(it, c.end());
+    SlabCache g_task_cache{"Task", sizeof(Task), alignof(Task)};
+    /// CR0.TS : Task Switched。立っているとFPU/SSE命令が#NMを起こす
+    const uint64_t kCR0TS = 1ul << 3;
+} // namespace
+
+void TaskIdle(uint64_t task_id, int64_t data) {
+    const bool bsp = CurrentCPU() == 0;
+    while (true) {
+        // アイドル中はタスク切替えのタイマ割り込みを止めているので、起きたタスクへは自分から切り替える
+        if (g_task_manager->HasRunnableTask() || g_task_manager->StealTask()) {
+            StartTaskTimer();
+            g_task_manager->Yield();
+            continue;
+        }
+        // 他に実行可能なタスクがない間に、終了したタスクを削除し、0クリア済みフレームを補充しておく
+        // どちらもヒープやメモリマネージャーを使うのでBSPでだけ行う
+        if (bsp && (g_task_manager->ReapFinishedTasks() || g_zeroed_frames.Refill())) {
+            continue;
+        }
+
+        // アイドル中と示してから確認し直すので、その間に他のCPUコアが入れたタスクはIPIで知らされる
+        __asm__("cli");
+        SetCPUIdle(true);
+        if (g_task_manager->HasRunnableTask() || g_task_manager->StealTask()) {
+            SetCPUIdle(false);
+            __asm__("sti");
+            continue;
+        }
+        // stiの次の命令までは割り込まれないので、確認の後に来た割り込みでもhltから起きる
+        __asm__("sti\n\thlt");
+        SetCPUIdle(false);
     }
+}
 
-    void TaskIdle(uint64_t task_id, int64_t data) {
-        while (true) __asm__("hlt");
+Task::Task(uint64_t id) : id_{id}, fpu_state_{AllocateFPUState()} {
+    if (fpu_state_ == nullptr) {
+        std::get_new_handler()();
     }
-} // namespace
+}
 
-Task::Task(uint64_t id) : id_{id} {}
+Task::~Task() {
+    FreeFPUState(fpu_state_);
+}
+
+void* Task::operator new(size_t size) {
+    void* p = g_task_cache.Allocate();
+    if (p == nullptr) {
+        std::get_new_handler()();
+    }
+    return p;
+}
+
+void Task::operator delete(void* p) {
+    g_task_cache.Free(p);
+}
 
 Task& Task::InitContext(TaskFunc* f, int64_t data) {
     const size_t stack_size = kDefaultStackBytes / sizeof(stack_[0]);
@@ -35,9 +80,14 @@ Task& Task::InitContext(TaskFunc* f, int64_t data) {
     context_.rdi = id_;
     context_.rsi = data;
 
-    // MXCSRのすべての例外をマスクする
-    *reinterpret_cast<uint32_t*>(&context_.fxsave_area[24]) = 0x1f80;
+    context_saved_ = true;
+
+    return *this;
+}
 
+Task& Task::AllowMigration() {
+    migratable_ = true;
+    context_.cr3 = KernelCR3();
     return *this;
 }
 
@@ -63,6 +113,11 @@ Task& Task::Wakeup() {
     return *this;
 }
 
+Task& Task::Detach() {
+    g_task_manager->Detach(id_);
+    return *this;
+}
+
 void Task::SendMessage(const Message& msg) {
     msgs_.push_back(msg);
     Wakeup();
@@ -82,14 +137,6 @@ std::vector<std::shared_ptr<IFileDescriptor>>& Task::Files() {
     return files_;
 }
 
-uint64_t Task::DPagingBegin() const {
-    return dpaging_begin_;
-}
-
-void Task::SetDPagingBegin(uint64_t v) {
-    dpaging_begin_ = v;
-}
-
 uint64_t Task::DPagingEnd() const {
     return dpaging_end_;
 }
@@ -106,17 +153,68 @@ void Task::SetFileMapEnd(uint64_t v) {
     file_map_end_ = v;
 }
 
-std::vector<FileMapping>& Task::FileMaps() {
-    return file_maps_;
+VmaList& Task::Vmas() {
+    return vmas_;
+}
+
+std::shared_ptr<IFileDescriptor>& Task::ExecFile() {
+    return exec_file_;
+}
+
+PageFaultStat& Task::FaultStat() {
+    return fault_stat_;
+}
+
+void TaskQueue::PushBack(Task* task) {
+    task->prev_ = tail_;
+    task->next_ = nullptr;
+    if (tail_) {
+        tail_->next_ = task;
+    } else {
+        head_ = task;
+    }
+    tail_ = task;
+}
+
+void TaskQueue::PushFront(Task* task) {
+    task->prev_ = nullptr;
+    task->next_ = head_;
+    if (head_) {
+        head_->prev_ = task;
+    } else {
+        tail_ = task;
+    }
+    head_ = task;
+}
+
+void TaskQueue::PopFront() {
+    Erase(head_);
+}
+
+void TaskQueue::Erase(Task* task) {
+    if (task->prev_) {
+        task->prev_->next_ = task->next_;
+    } else {
+        head_ = task->next_;
+    }
+    if (task->next_) {
+        task->next_->prev_ = task->prev_;
+    } else {
+        tail_ = task->prev_;
+    }
+    task->prev_ = task->next_ = nullptr;
 }
 
 TaskManager::TaskManager() {
+    auto& rq = run_queues_[0];
     // 最初に突っ込んでおくのは優先度最高のメインタスク
     // idは常に1
     Task& main_task = NewTask()
-                          .SetLevel(current_level_)
+                          .SetLevel(rq.current_level)
                           .SetRunning(true);
-    running_[current_level_].push_back(&main_task);
+    rq.levels[rq.current_level].PushBack(&main_task);
+    // 起動してからのFPUの状態はメインタスクのもの
+    SetFPUOwner(rq, &main_task);
 
     // アイドルタスク
     // すべてのタスクがスリープしてランキューが空になった場合の番兵となる
@@ -124,55 +222,190 @@ TaskManager::TaskManager() {
                      .InitContext(TaskIdle, 0)
                      .SetLevel(0) // 最低の優先度
                      .SetRunning(true);
-    running_[0].push_back(&idle);
+    rq.levels[0].PushBack(&idle);
 }
 
 Task& TaskManager::NewTask() {
-    latest_id_++;
-    return *tasks_.emplace_back(new Task(latest_id_));
+    SpinLockGuard lock{slots_lock_};
+    if (slots_.empty()) {
+        slots_.push_back({TaskSlot::kFree, 0, nullptr, 0, nullptr, false}); // 0番は使わない
+    }
+
+    uint32_t index;
+    if (free_slots_.empty()) {
+        index = slots_.size();
+        slots_.push_back({TaskSlot::kFree, 0, nullptr, 0, nullptr, false});
+    } else {
+        index = free_slots_.front();
+        free_slots_.pop_front();
+    }
+
+    auto& slot = slots_[index];
+    slot.state = TaskSlot::kRunning;
+    slot.task.reset(new Task(slot.generation << kSlotBits | index));
+    slot.task->cpu_ = CurrentCPU();
+    slot.waiter = nullptr;
+    slot.detached = false;
+    return *slot.task;
+}
+
+Task& TaskManager::AddCPU(int cpu) {
+    Task& idle = NewTask()
+                     .SetLevel(0)
+                     .SetRunning(true);
+    idle.cpu_ = cpu;
+
+    auto& rq = run_queues_[cpu];
+    SpinLockGuard lock{rq.lock};
+    rq.levels[0].PushBack(&idle);
+    rq.current_level = 0;
+    // FPUの所有者は、AP自身がTakeFPU()で設定する（SetFPUOwner()はそのCPUコアでしか呼べない）
+    return idle;
 }
 
-void TaskManager::SwitchTask(const TaskContext& current_ctx) {
-    TaskContext& task_ctx = g_task_manager->CurrentTask().Context();
-    memcpy(&task_ctx, &current_ctx, sizeof(TaskContext));
-    Task* current_task = RotateCurrentRunQueue(false);
-    if (&CurrentTask() != current_task) {
-        RestoreContext(&CurrentTask().Context());
+void TaskManager::TakeFPU() {
+    InterruptGuard guard;
+    auto& rq = run_queues_[CurrentCPU()];
+    SetFPUOwner(rq, rq.Current());
+}
+
+TaskManager::TaskSlot* TaskManager::FindSlot(uint64_t id) {
+    const auto index = id & kSlotMask;
+    if (index == 0 || index >= slots_.size()) {
+        return nullptr;
+    }
+    auto& slot = slots_[index];
+    if (slot.state == TaskSlot::kFree || slot.generation != id >> kSlotBits) {
+        return nullptr;
     }
+    return &slot;
 }
 
-void TaskManager::Sleep(Task* task) {
-    if (!task->Running()) {
-        return;
+Task* TaskManager::FindTask(uint64_t id) {
+    SpinLockGuard lock{slots_lock_};
+    auto slot = FindSlot(id);
+    return slot ? slot->task.get() : nullptr;
+}
+
+TaskManager::RunQueue& TaskManager::LockRunQueue(Task* task) {
+    while (true) {
+        const int cpu = __atomic_load_n(&task->cpu_, __ATOMIC_RELAXED);
+        auto& rq = run_queues_[cpu];
+        rq.lock.Lock();
+        // cpu_を書き換えるのは移動元と移動先の両方のロックを持つStealTask()だけ
+        if (task->cpu_ == cpu) {
+            return rq;
+        }
+        rq.lock.Unlock();
     }
+}
 
-    task->SetRunning(false);
+void TaskManager::SwitchTask(const InterruptContext& current_ctx) {
+    auto& rq = run_queues_[CurrentCPU()];
+    Task* next_task;
+    bool migratable;
+    {
+        SpinLockGuard lock{rq.lock};
+        Task* current_task = rq.Current();
+        memcpy(&current_task->Context(), &current_ctx.regs, sizeof(TaskContext));
+        RotateCurrentRunQueue(rq, false);
+        next_task = rq.Current();
+        if (next_task == current_task) {
+            return;
+        }
+        // 所有したまま他のCPUコアに移されると状態を取り出せないので、fpu_state_に保存して所有をやめる
+        // x87/SSEの部分は割り込みの入口で退避したスタック上のものが正しく、AVX以降の部分はレジスタに残っている
+        if (current_ctx.regs.fpu_saved) {
+            SaveFPUState(current_task->fpu_state_);
+            SetLegacyFPUState(current_task->fpu_state_, current_ctx.fxsave_area);
+        }
+        if (rq.fpu_owner == current_task) {
+            SetFPUOwner(rq, nullptr);
+        }
+        rq.switching = true;
+        // コンテキストは保存済みなので、ロックを外した後は他のCPUコアに移されてもよい
+        current_task->context_saved_ = true;
+        migratable = current_task->migratable_;
+    }
+    if (migratable) {
+        WakeIdleCPUs();
+    }
+    PrepareFPU(rq, next_task);
+    RestoreContext(&next_task->Context());
+}
 
+void TaskManager::Yield() {
+    InterruptGuard guard;
+    auto& rq = run_queues_[CurrentCPU()];
+    Task *current_task, *next_task;
+    {
+        SpinLockGuard lock{rq.lock};
+        current_task = RotateCurrentRunQueue(rq, false);
+        next_task = rq.Current();
+        rq.switching = next_task != current_task;
+    }
+    if (next_task != current_task) {
+        PrepareFPU(rq, next_task);
+        SwitchContext(&next_task->Context(), &current_task->Context());
+    }
+}
+
+void TaskManager::SleepCurrent(SpinLock* held) {
+    auto& rq = run_queues_[CurrentCPU()];
+    Task *current_task, *next_task;
+    {
+        SpinLockGuard lock{rq.lock};
+        current_task = rq.Current();
+        current_task->SetRunning(false);
+        RotateCurrentRunQueue(rq, true);
+        next_task = rq.Current();
+        rq.switching = true;
+    }
+    if (held) {
+        held->Unlock();
+    }
+    // 他のCPUコアがすぐにWakeup()しても、context_saved_がfalseなのでこのCPUコア以外では再開されない
+    PrepareFPU(rq, next_task);
+    SwitchContext(&next_task->Context(), &current_task->Context());
+}
+
+void TaskManager::Sleep(Task* task) {
+    InterruptGuard guard;
     // 指定のタスクが現在実行中の場合
-    if (task == running_[current_level_].front()) {
-        Task* current_task = RotateCurrentRunQueue(true);
-        SwitchContext(&CurrentTask().Context(), &current_task->Context());
+    if (task == &CurrentTask()) {
+        SleepCurrent(nullptr);
         return;
     }
 
-    Erase(running_[task->Level()], task);
+    auto& rq = LockRunQueue(task);
+    if (task->Running()) {
+        task->SetRunning(false);
+        // 他のCPUコアで実行中なら、そのCPUコアが次に切り替えるときに待機列から外れる
+        if (task != rq.Current()) {
+            rq.levels[task->Level()].Erase(task);
+        }
+    }
+    rq.lock.Unlock();
 }
 
 Error TaskManager::Sleep(uint64_t id) {
-    auto it = std::find_if(tasks_.begin(),
-                           tasks_.end(),
-                           [id](const auto& t) { return t->ID() == id; });
-    if (it == tasks_.end()) {
+    auto task = FindTask(id);
+    if (task == nullptr) {
         return MAKE_ERROR(Error::kNoSuchTask);
     }
 
-    Sleep(it->get());
+    Sleep(task);
     return MAKE_ERROR(Error::kSuccess);
 }
 
 void TaskManager::Wakeup(Task* task, int level) {
-    if (task->Running()) {
-        ChangeLevelRunning(task, level);
+    InterruptGuard guard;
+    auto& rq = LockRunQueue(task);
+    if (task->Running() || task == rq.Current()) {
+        // 実行中のままスリープを指示されたタスクは、まだ待機列から外れていない
+        task->SetRunning(true);
+        ChangeLevelRunning(rq, task, level);
+        rq.lock.Unlock();
         return;
     }
 
@@ -183,135 +416,322 @@ void TaskManager::Wakeup(Task* task, int level) {
     task->SetLevel(level);
     task->SetRunning(true);
 
-    running_[level].push_back(task);
-    if (level > current_level_) {
-        level_changed_ = true;
+    rq.levels[level].PushBack(task);
+    if (level > rq.current_level) {
+        rq.level_changed = true;
+    }
+    const int cpu = task->cpu_;
+    const bool migratable = task->migratable_;
+    rq.lock.Unlock();
+
+    // アイドル中のCPUコアはタイマ割り込みが来ないので、起こして待機列を確認させる
+    if (migratable) {
+        WakeIdleCPUs();
+    } else {
+        WakeCPU(cpu);
     }
-    return;
 }
 
 Error TaskManager::Wakeup(uint64_t id, int level) {
-    auto it = std::find_if(tasks_.begin(),
-                           tasks_.end(),
-                           [id](const auto& t) { return t->ID() == id; });
-    if (it == tasks_.end()) {
+    auto task = FindTask(id);
+    if (task == nullptr) {
         return MAKE_ERROR(Error::kNoSuchTask);
     }
 
-    Wakeup(it->get(), level);
+    Wakeup(task, level);
     return MAKE_ERROR(Error::kSuccess);
 }
 
 Error TaskManager::SendMessage(uint64_t id, const Message& msg) {
-    auto it = std::find_if(tasks_.begin(),
-                           tasks_.end(),
-                           [id](const auto& task) { return task->ID() == id; });
-
-    if (it == tasks_.end()) {
+    auto task = FindTask(id);
+    if (task == nullptr) {
         return MAKE_ERROR(Error::kNoSuchTask);
     }
 
-    (*it)->SendMessage(msg);
+    task->SendMessage(msg);
     return MAKE_ERROR(Error::kSuccess);
 }
 
 Task& TaskManager::CurrentTask() {
-    return *running_[current_level_].front();
+    InterruptGuard guard;
+    auto& rq = run_queues_[CurrentCPU()];
+    SpinLockGuard lock{rq.lock};
+    return *rq.Current();
 }
 
 void TaskManager::Finish(int exit_code) {
-    // Finish()をコールしたタスクは実行可能状態ではなくなる
-    Task* current_task = RotateCurrentRunQueue(true);
-
-    // 削除する前にidを保存
-    const auto task_id = current_task->ID();
-    auto it = std::find_if(
-        tasks_.begin(), tasks_.end(),
-        [current_task](const auto& t) {
-            return t.get() == current_task;
-        });
-    tasks_.erase(it);
-
-    finish_tasks_[task_id] = exit_code;
-    // 削除したタスクの終了を待機しているタスクを起こす
-    if (auto it = finish_waiter_.find(task_id); it != finish_waiter_.end()) {
-        auto waiter = it->second;
-        finish_waiter_.erase(it);
+    InterruptGuard guard;
+    auto& rq = run_queues_[CurrentCPU()];
+    Task *current_task, *next_task;
+    {
+        SpinLockGuard lock{rq.lock};
+        // Finish()をコールしたタスクは実行可能状態ではなくなる
+        current_task = rq.Current();
+        current_task->SetRunning(false);
+        RotateCurrentRunQueue(rq, true);
+        rq.finished = current_task;
+        next_task = rq.Current();
+        // 終了したタスクのFPUの状態はもう要らない
+        if (rq.fpu_owner == current_task) {
+            SetFPUOwner(rq, nullptr);
+        }
+        rq.switching = true;
+    }
+
+    // スロットには終了コードを残す（WaitFinish()で受け取るまで再利用しない。Detach()したタスクはReapFinishedTasks()で解放する）
+    Task* waiter;
+    {
+        SpinLockGuard lock{slots_lock_};
+        auto& slot = slots_[current_task->ID() & kSlotMask];
+        slot.task.release();
+        slot.state = TaskSlot::kFinished;
+        slot.exit_code = exit_code;
+        waiter = slot.waiter;
+        slot.waiter = nullptr;
+    }
+    // 終了したタスクの終了を待機しているタスクを起こす
+    if (waiter) {
         Wakeup(waiter);
     }
 
     // 次のタスクに実行を移す
-    RestoreContext(&CurrentTask().Context());
+    PrepareFPU(rq, next_task);
+    RestoreContext(&next_task->Context());
+}
+
+bool TaskManager::ReapFinishedTasks() {
+    Task* tasks;
+    {
+        SpinLockGuard lock{finished_lock_};
+        tasks = finished_;
+        finished_ = nullptr;
+    }
+    for (Task* task = tasks; task != nullptr;) {
+        Task* next = task->next_;
+        {
+            // 終了コードを誰も受け取らないスロットは、ここで空きに戻す（free_slots_はヒープを使う）
+            SpinLockGuard lock{slots_lock_};
+            auto slot = FindSlot(task->ID());
+            if (slot && slot->detached) {
+                FreeSlot(task->ID() & kSlotMask);
+            }
+        }
+        delete task;
+        task = next;
+    }
+    return tasks != nullptr;
 }
 
 WithError<int> TaskManager::WaitFinish(uint64_t task_id) {
-    int exit_code;
+    InterruptGuard guard;
     // WaitFinish()をコールしたタスク
     Task* current_task = &CurrentTask();
     while (true) { // 指定タスクの終了を待機
-        if (auto it = finish_tasks_.find(task_id); it != finish_tasks_.end()) {
-            exit_code = it->second;
-            finish_tasks_.erase(it);
-            break;
+        slots_lock_.Lock();
+        auto slot = FindSlot(task_id);
+        if (slot == nullptr) {
+            slots_lock_.Unlock();
+            return {0, MAKE_ERROR(Error::kNoSuchTask)};
+        }
+        if (slot->state == TaskSlot::kFinished) {
+            const int exit_code = slot->exit_code;
+            FreeSlot(task_id & kSlotMask);
+            slots_lock_.Unlock();
+            return {exit_code, MAKE_ERROR(Error::kSuccess)};
         }
-        finish_waiter_[task_id] = current_task;
-        Sleep(current_task);
+        slot->waiter = current_task;
+        // Finish()はslots_lock_を外してからwaiterを起こすので、スリープしてからロックを外せば起こし損ねない
+        SleepCurrent(&slots_lock_);
+    }
+}
+
+Error TaskManager::Detach(uint64_t task_id) {
+    SpinLockGuard lock{slots_lock_};
+    auto slot = FindSlot(task_id);
+    if (slot == nullptr) {
+        return MAKE_ERROR(Error::kNoSuchTask);
     }
-    return {exit_code, MAKE_ERROR(Error::kSuccess)};
+    if (slot->state == TaskSlot::kFinished) {
+        FreeSlot(task_id & kSlotMask);
+    } else {
+        slot->detached = true;
+    }
+    return MAKE_ERROR(Error::kSuccess);
 }
 
-void TaskManager::ChangeLevelRunning(Task* task, int level) {
+void TaskManager::FreeSlot(uint32_t index) {
+    auto& slot = slots_[index];
+    slot.state = TaskSlot::kFree;
+    ++slot.generation;
+    free_slots_.push_back(index);
+}
+
+bool TaskManager::StealTask() {
+    InterruptGuard guard;
+    const int cpu = CurrentCPU();
+    auto& rq = run_queues_[cpu];
+    SpinLockGuard lock{rq.lock};
+    if (HasRunnableTask(rq)) {
+        return false;
+    }
+
+    const int num_cpus = CPUCount();
+    for (int i = 1; i < num_cpus; i++) {
+        auto& victim = run_queues_[(cpu + i) % num_cpus];
+        // 相手も自分のロックを待っているかもしれないので、すぐに取れなければ諦める
+        if (!victim.lock.TryLock()) {
+            continue;
+        }
+
+        // 優先度の高い待機列から、実行中でない（context_saved_）移動可能なタスクを探す
+        Task* task = nullptr;
+        for (int lv = kMaxLevel; lv > 0 && task == nullptr; lv--) {
+            for (Task* t = victim.levels[lv].Front(); t != nullptr; t = t->next_) {
+                if (t->migratable_ && t->context_saved_ && t->Running()) {
+                    task = t;
+                    break;
+                }
+            }
+        }
+        if (task) {
+            victim.levels[task->Level()].Erase(task);
+            task->cpu_ = cpu;
+            rq.levels[task->Level()].PushBack(task);
+            rq.level_changed = true;
+        }
+        victim.lock.Unlock();
+
+        if (task) {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint8_t* TaskManager::SwitchFPUOwner() {
+    // 割り込みゲートなので割り込み禁止中。rq.lockを持っている間の#NMでもデッドロックしないよう、lockは取らない
+    // 実行中のタスク（待機列の先頭）を書き換えるのは自分のCPUコアだけ
+    auto& rq = run_queues_[CurrentCPU()];
+    rq.fpu_ts = false;
+    Task* current_task = rq.Current();
+    if (rq.switching) {
+        // 待機列の先頭はもう次のタスクだが、まだ切替え処理のコードが動いている。ここで書き換えるレジスタは誰のものでもない
+        // 前の所有者の状態は保存済みなので所有者なしとし、PrepareFPU()でCR0.TSを立て直す
+        SetFPUOwner(rq, nullptr);
+        return current_task->fpu_state_;
+    }
+    SetFPUOwner(rq, current_task);
+    return current_task->fpu_state_;
+}
+
+void TaskManager::AbandonFPU() {
+    InterruptGuard guard;
+    auto& rq = run_queues_[CurrentCPU()];
+    if (rq.fpu_owner != rq.Current()) {
+        return;
+    }
+    SetFPUOwner(rq, nullptr);
+    rq.fpu_ts = true;
+    SetCR0(GetCR0() | kCR0TS);
+}
+
+void TaskManager::SetFPUOwner(RunQueue& rq, Task* task) {
+    rq.fpu_owner = task;
+    g_fpu_owner_state[LocalAPICID()] = task ? task->fpu_state_ : nullptr;
+}
+
+void TaskManager::PrepareFPU(RunQueue& rq, Task* next) {
+    rq.switching = false;
+    const bool ts = rq.fpu_owner != next;
+    if (ts == rq.fpu_ts) {
+        return;
+    }
+    rq.fpu_ts = ts;
+    if (ts) {
+        SetCR0(GetCR0() | kCR0TS);
+    } else {
+        __asm__ volatile("clts");
+    }
+}
+
+bool TaskManager::HasRunnableTask() {
+    InterruptGuard guard;
+    auto& rq = run_queues_[CurrentCPU()];
+    SpinLockGuard lock{rq.lock};
+    return HasRunnableTask(rq);
+}
+
+bool TaskManager::HasRunnableTask(const RunQueue& rq) {
+    for (int lv = kMaxLevel; lv > 0; lv--) {
+        if (!rq.levels[lv].Empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void TaskManager::ChangeLevelRunning(RunQueue& rq, Task* task, int level) {
     // 実行レベル変更なし
     if (level < 0 || level == task->Level()) {
         return;
     }
 
     // change level of other task
-    if (task != running_[current_level_].front()) {
-        Erase(running_[task->Level()], task);
-        running_[level].push_back(task);
+    if (task != rq.Current()) {
+        rq.levels[task->Level()].Erase(task);
+        rq.levels[level].PushBack(task);
         task->SetLevel(level);
-        if (level > current_level_) {
-            level_changed_ = true;
+        if (level > rq.current_level) {
+            rq.level_changed = true;
         }
         return;
     }
 
     // change level myself
-    running_[current_level_].pop_front();
-    running_[level].push_front(task);
+    rq.levels[rq.current_level].PopFront();
+    rq.levels[level].PushFront(task);
     task->SetLevel(level);
-    if (level >= current_level_) {
-        current_level_ = level;
+    if (level >= rq.current_level) {
+        rq.current_level = level;
     } else {
-        current_level_ = level;
-        level_changed_ = true;
+        rq.current_level = level;
+        rq.level_changed = true;
     }
 }
 
-Task* TaskManager::RotateCurrentRunQueue(bool current_sleep) {
-    auto& level_queue = running_[current_level_];
-    Task* current_task = level_queue.front();
-    level_queue.pop_front();
-    if (!current_sleep) {
-        level_queue.push_back(current_task);
+Task* TaskManager::RotateCurrentRunQueue(RunQueue& rq, bool current_sleep) {
+    // 前回Finish()したタスクのスタックはもう使っていないので、削除してよい
+    if (rq.finished) {
+        SpinLockGuard lock{finished_lock_};
+        rq.finished->next_ = finished_;
+        finished_ = rq.finished;
+        rq.finished = nullptr;
     }
-    if (level_queue.empty()) {
-        level_changed_ = true;
+
+    auto& level_queue = rq.levels[rq.current_level];
+    Task* current_task = level_queue.Front();
+    level_queue.PopFront();
+    // 他のCPUコアからスリープを指示されたタスクもここで外す
+    if (!current_sleep && current_task->Running()) {
+        level_queue.PushBack(current_task);
+    }
+    if (level_queue.Empty()) {
+        rq.level_changed = true;
     }
 
     // 実行レベルの見直し
-    if (level_changed_) {
-        level_changed_ = false;
+    if (rq.level_changed) {
+        rq.level_changed = false;
         // レベルの高い順から走査し、最初の空でない待機列のレベルで抜ける
         for (int lv = kMaxLevel; lv >= 0; lv--) {
-            if (!running_[lv].empty()) {
-                current_level_ = lv;
+            if (!rq.levels[lv].Empty()) {
+                rq.current_level = lv;
                 break;
             }
         }
     }
 
+    rq.Current()->context_saved_ = false;
     return current_task;
 }
 
@@ -320,10 +740,13 @@ TaskManager* g_task_manager;
 void InitializeTask() {
     g_task_manager = new TaskManager;
 
-    // タスク切替え用のタイマ追加
-    __asm__("cli");
-    g_timer_manager->AddTimer(Timer{g_timer_manager->CurrentTick() + kTaskTimerPeriod, kTaskTimerValue, kMainTaskID});
-    __asm__("sti");
+    // メインタスクが動いているので、タスク切替えの時刻を設定する
+    StartTaskTimer();
+}
+
+/// #NM（asmfunc.asmのIntHandlerNM）から、前の所有者の状態を保存した後に呼ぶ
+extern "C" uint8_t* FPUOnDeviceNotAvailable() {
+    return g_task_manager->SwitchFPUOwner();
 }
 
 /// 現在実行中のタスクのOS用スタックポインタの値を取得
@@ -6,34 +6,48 @@
 #include <cstddef>
 #include <cstdint>
 #include <deque>
-#include <map>
 #include <optional>
 #include <vector>
 
 #include "error.hpp"
 #include "fat.hpp"
 #include "message.hpp"
+#include "slab.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
+#include "vma.hpp"
 
 /// コンテキスト : タスクの実行バイナリ、コマンドライン引数、環境変数、スタックメモリ、各レジスタの値など
 /// コンテキストの切替時に値の保存と復帰に必要なレジスタをすべて含む
 struct TaskContext {
-    uint64_t cr3, rip, rflags, reserved;             // offset 0x00
+    uint64_t cr3, rip, rflags, fpu_saved;            // offset 0x00
     uint64_t cs, ss, fs, gs;                         // offset 0x20
     uint64_t rax, rbx, rcx, rdx, rdi, rsi, rsp, rbp; // offset 0x40
     uint64_t r8, r9, r19, r11, r12, r13, r14, r15;   // offset 0x80
+} __attribute__((packed));
+
+/// IntHandlerLAPICTimerがスタック上に作るコンテキスト
+/// 割り込み処理のC++のコードもSSEレジスタを使うので、入口でx87/SSEの部分だけをFXSAVEで退避する
+/// （AVX以降の部分はレガシーSSE命令では書き換わらないので、レジスタに残っている）
+/// regs.fpu_saved : CR0.TSが立っておらず（割り込まれたタスクがFPUの所有者で）、fxsave_areaを埋めた : 1
+struct InterruptContext {
+    TaskContext regs;                                // offset 0x00
     std::array<uint8_t, 512> fxsave_area;            // offset 0xc0
 } __attribute__((packed));
 
 using TaskFunc = void(uint64_t, int64_t);
 
 class TaskManager;
+class TaskQueue;
 
-/// ファイルの内容を仮想アドレス空間の連続した領域にマッピング
-struct FileMapping {
-    /// ファイルディスクリプタ
-    int fd;
-    /// 仮想アドレス範囲
-    uint64_t vaddr_begin, vaddr_end;
+/// タスクのページフォルトの回数
+struct PageFaultStat {
+    /// 全ページフォルト
+    uint64_t faults;
+    /// 内訳 : コピーオンライト、デマンドページング、メモリマップドファイル
+    uint64_t cow_faults, anonymous_faults, file_faults;
+    /// フォルトせずに済むよう、フォルトしたページの周辺に作成したページ
+    uint64_t prefaulted_pages;
 };
 
 /// タスク : 動作中のプログラム。処理単位。
@@ -45,49 +59,76 @@ public:
     static const size_t kDefaultStackBytes = 8 * 4096;
 
     Task(uint64_t id);
+    ~Task();
+    /// Taskは専用のスラブキャッシュから確保
+    static void* operator new(size_t size);
+    static void operator delete(void* p);
     /// f : 実際に実行されるタスク（関数）
     Task& InitContext(TaskFunc* f, int64_t data);
+    /// 他のCPUコアの待機列へ移れるようにし、OSカーネル用のPML4で動かす（InitContext()の後に呼ぶ）
+    /// 他のCPUコアにはアプリのアドレス空間のTLB無効化を伝えないので、アプリを実行しないタスクに限る
+    Task& AllowMigration();
     TaskContext& Context();
     uint64_t& OSStackPointer();
     uint64_t ID() const;
     Task& Sleep();
     Task& Wakeup();
+    /// 終了コードを受け取らない（WaitFinish()しない）タスクにする。終了して削除されたらスロットを再利用する
+    Task& Detach();
     /// イベントメッセージが通知されたら起こす
     void SendMessage(const Message& msg);
     /// メッセージを取得
     std::optional<Message> ReceiveMessage();
     std::vector<std::shared_ptr<IFileDescriptor>>& Files();
-    uint64_t DPagingBegin() const;
-    void SetDPagingBegin(uint64_t v);
     uint64_t DPagingEnd() const;
     void SetDPagingEnd(uint64_t v);
     uint64_t FileMapEnd() const;
     void SetFileMapEnd(uint64_t v);
-    std::vector<FileMapping>& FileMaps();
+    /// アプリの仮想アドレス空間を構成する領域
+    VmaList& Vmas();
+    /// 実行中のアプリのELFファイル（LOADセグメントをページフォルト時に読み込む）
+    std::shared_ptr<IFileDescriptor>& ExecFile();
+    PageFaultStat& FaultStat();
 
     int Level() const { return level_; }
     bool Running() const { return running_; }
+    /// このタスクが並んでいる待機列のCPUコア
+    int CPU() const { return cpu_; }
 
 private:
     uint64_t id_;
     /// スタック領域
     std::vector<uint64_t> stack_;
     alignas(16) TaskContext context_;
+    /// FPU/SSE/AVXの状態（fpu.hppのAllocateFPUState()）。タスクがFPUの所有者でなくなるときに保存し、#NMで復帰する
+    /// 切替えのたびには保存しない
+    uint8_t* fpu_state_;
     /// OS用スタックポインタ（アプリ終了時からの復帰に必要）
     uint64_t os_stack_pointer_;
     /// 割り込みメッセージキュー
-    std::deque<Message> msgs_;
+    std::deque<Message, SlabAllocator<Message>> msgs_;
     unsigned int level_{kDefaultLevel};
     /// 実行可能状態（待機列に並んでいる） : true
     bool running_{false};
+    /// 待機列（TaskQueue）で前後に並ぶタスク
+    Task* prev_{nullptr};
+    Task* next_{nullptr};
+    int cpu_{0};
+    /// 他のCPUコアの待機列へ移れる : true
+    bool migratable_{false};
+    /// context_にレジスタの値を保存し終えていて、どのCPUコアが実行を再開してもよい : true
+    /// 実行を始めるとfalseになり、タイマ割り込みで切り替えられるとtrueに戻る
+    bool context_saved_{false};
     /// ファイルディスクリプタをタスク毎に持たせる
     /// -> 番号が他のタスクとだぶっても大丈夫
     std::vector<std::shared_ptr<IFileDescriptor>> files_{};
-    /// デマンドページングの仮想アドレス範囲
-    uint64_t dpaging_begin_{0}, dpaging_end_{0};
-    /// メモリマップドファイルに利用される仮想アドレス範囲
+    /// 次にデマンドページングの領域を置く先頭（後方に伸びる）
+    uint64_t dpaging_end_{0};
+    /// 次にメモリマップドファイルを置く終端（前方に伸びる）
     uint64_t file_map_end_{0};
-    std::vector<FileMapping> file_maps_{};
+    VmaList vmas_{};
+    std::shared_ptr<IFileDescriptor> exec_file_{};
+    PageFaultStat fault_stat_{};
 
     Task& SetLevel(int level) {
         level_ = level;
@@ -99,6 +140,24 @@ private:
     }
 
     friend TaskManager;
+    friend TaskQueue;
+};
+
+/// Task同士をつないだ待機列（侵入リスト）
+/// 追加・削除でメモリを確保しないので、ヒープを使えないAPからもスピンロックを取るだけで操作できる
+class TaskQueue {
+public:
+    bool Empty() const { return head_ == nullptr; }
+    Task* Front() const { return head_; }
+    void PushBack(Task* task);
+    void PushFront(Task* task);
+    void PopFront();
+    /// taskはこの待機列に並んでいること
+    void Erase(Task* task);
+
+private:
+    Task* head_{nullptr};
+    Task* tail_{nullptr};
 };
 
 /// 複数のタスクを管理
@@ -108,8 +167,24 @@ public:
     TaskManager();
     /// 待機列には追加しない
     Task& NewTask();
+    /// APの待機列を使えるようにし、そのAPのアイドルタスクを作る
+    /// APの起動処理の文脈がそのままアイドルタスクになる（メインタスクと同じくInitContext()しない）
+    Task& AddCPU(int cpu);
+    /// APMain()から呼ぶ。FPUレジスタの状態はAPの起動処理の文脈（アイドルタスク）のものとする
+    /// CR0.TSは外れているので、「CR0.TSが外れていれば現在のタスクが所有者」を保つ
+    void TakeFPU();
     /// タスク切替え
-    void SwitchTask(const TaskContext& current_ctx);
+    void SwitchTask(const InterruptContext& current_ctx);
+    /// 現在のタスクを同じ優先度の待機列の末尾に回し、次のタスクに切り替える
+    void Yield();
+    /// 現在のCPUコアにアイドルタスクしか実行可能なものがなければ、他のCPUコアの待機列からCPU間を移れるタスクを1つ移す
+    /// return : 移した : true（Yield()で実行を始める）
+    bool StealTask();
+    /// 現在のCPUコアの待機列に、アイドルタスク以外の実行可能なタスクがある : true
+    bool HasRunnableTask();
+    /// 終了したタスクを削除する。ヒープを使うので、BSPのタスクから呼ぶ
+    /// return : 1つ以上削除した : true
+    bool ReapFinishedTasks();
     /// タスクをスリープ状態にする（待機列から除外）
     void Sleep(Task* task);
     Error Sleep(uint64_t id);
@@ -120,40 +195,108 @@ public:
     Error SendMessage(uint64_t id, const Message& msg);
     /// 現在実行中のタスク
     Task& CurrentTask();
-    /// 現在実行中のタスクを終了し、finish_tasks_に終了コードを登録
+    /// 現在実行中のタスクを終了し、スロットに終了コードを残す
+    /// タスク自体はスタックを使い終えた後、ReapFinishedTasks()で削除する
     void Finish(int exit_code);
-    /// 指定タスクの終了コードを得る
+    /// 指定タスクの終了コードを得る（終了していなければ終了まで待つ）
+    /// 終了コードを受け取るとスロットは再利用される。存在しないタスクならkNoSuchTask
     WithError<int> WaitFinish(uint64_t task_id);
+    /// 指定タスクの終了コードを受け取らないことにする。終了済みならすぐにスロットを解放する
+    /// ヒープを使うので、BSPのタスクから呼ぶ
+    Error Detach(uint64_t task_id);
+    /// 指定IDのタスク。存在しない（終了した）ならnullptr
+    Task* FindTask(uint64_t id);
+    /// #NMで呼ぶ。FPUの所有者を現在のタスクに替える（前の所有者の状態はIntHandlerNMが保存済み）
+    /// return : 復帰する状態（現在のタスクのfpu_state_）
+    uint8_t* SwitchFPUOwner();
+    /// 現在のタスクがFPUの所有者なら、FPUレジスタの内容を捨てて所有をやめる
+    /// 割り込み処理がSSEレジスタを書き換えたが、タスクの状態がfpu_state_に残っているときに呼ぶ
+    void AbandonFPU();
+
+    /// タスクIDの下位kSlotBitsビットはスロットの添字、上位は世代番号
+    /// スロットを再利用するたびに世代番号を進めるので、終了したタスクの古いIDが別のタスクを指すことはない
+    static const int kSlotBits = 20;
+    static const uint64_t kSlotMask = (1ul << kSlotBits) - 1;
 
 private:
-    /// タスク一覧
-    std::vector<std::unique_ptr<Task>> tasks_{};
-    /// 最後に生成されたタスクのID
-    /// 1 : メインタスク（KernelMainStack()）
-    uint64_t latest_id_{0};
-    /// 優先度別のタスクの待機列（ランキュー）
-    /// 先頭を現在実行中のタスクとする
-    /// あるタスクより優先度の低いタスクは、そのタスクがスリープするか同じ優先度まで下がらない限り実行されない
-    std::array<std::deque<Task*>, kMaxLevel + 1> running_{};
-    /// 現在実行中のタスクが属する優先度
-    int current_level_{kMaxLevel};
-    /// 次回のタスク切替え時に現在の実行レベルを変更 : true
-    bool level_changed_{false};
-    /// 終了されたタスク一覧
-    /// key: ID of a finished task
-    /// value: exit code
-    std::map<uint64_t, int> finish_tasks_{};
-    /// あるタスクの終了を待機しているタスク一覧
-    /// key: ID of a finished task
-    /// value: a waiter task
-    std::map<uint64_t, Task*> finish_waiter_{};
-
-    void ChangeLevelRunning(Task* task, int level);
-    /// ランキューの先頭要素を末尾に移動
-    Task* RotateCurrentRunQueue(bool current_sleep);
+    /// タスク表の1要素
+    struct TaskSlot {
+        enum State { kFree, kRunning, kFinished };
+        State state;
+        /// このスロットを使っているタスクのIDの上位ビット
+        uint64_t generation;
+        std::unique_ptr<Task> task;
+        /// kFinishedのみ有効 : 終了コード
+        int exit_code;
+        /// このタスクの終了を待機しているタスク
+        Task* waiter;
+        /// 終了コードを誰も受け取らない : true（終了時にスロットを解放する）
+        bool detached;
+    };
+
+    /// CPUコアごとの待機列
+    struct RunQueue {
+        SpinLock lock;
+        /// 優先度別のタスクの待機列（ランキュー）
+        /// 先頭を現在実行中のタスクとする
+        /// あるタスクより優先度の低いタスクは、そのタスクがスリープするか同じ優先度まで下がらない限り実行されない
+        std::array<TaskQueue, kMaxLevel + 1> levels{};
+        /// 現在実行中のタスクが属する優先度
+        int current_level{kMaxLevel};
+        /// 次回のタスク切替え時に現在の実行レベルを変更 : true
+        bool level_changed{false};
+        /// 直前にFinish()したタスク。まだそのスタックで動いている間は削除できないので、次の切替え時にfinished_へ移す
+        Task* finished{nullptr};
+        /// FPUレジスタに状態が載っているタスク。自分のCPUコアからしか触らないので、lockではなく割り込み禁止で保護する
+        /// （#NMはlockを持っている間にも起こりうる）。SetFPUOwner()で書き換える
+        Task* fpu_owner{nullptr};
+        /// CR0.TSを立てている : true（書き込みは遅いので、変わるときだけ書く）
+        bool fpu_ts{false};
+        /// 待機列の先頭を次のタスクに替えてから、PrepareFPU()で切り替えるまでの間 : true
+        /// この間の#NMでは、次のタスクをFPUの所有者にしない
+        bool switching{false};
+
+        Task* Current() const { return levels[current_level].Front(); }
+    };
+
+    /// タスク表。IDの下位ビットを添字として O(1) で引ける
+    /// 0番はIDの0（無効値）に当たるので使わない。1番はメインタスク（KernelMainStack()）
+    std::vector<TaskSlot> slots_{};
+    /// 空いているスロットの添字（古く空いたものから再利用する）
+    std::deque<uint32_t> free_slots_{};
+    /// slots_とfree_slots_を保護する。RunQueue::lockと両方取るときはこちらを先に取る
+    SpinLock slots_lock_;
+    /// 添字はCPU番号
+    std::array<RunQueue, kMaxCPUs> run_queues_{};
+    /// 削除を待つ終了済みタスク（Task::next_でつなぐ）
+    Task* finished_{nullptr};
+    SpinLock finished_lock_;
+
+    /// slots_lock_を取ってから呼ぶ
+    TaskSlot* FindSlot(uint64_t id);
+    /// slots_lock_を取ってから呼ぶ。スロットを空きに戻す（世代番号を進めるので古いIDは無効になる）
+    void FreeSlot(uint32_t index);
+    /// rq.lockを取ってから呼ぶ。アイドルタスク（優先度0）より上の待機列が空でない : true
+    static bool HasRunnableTask(const RunQueue& rq);
+    /// taskが並ぶ待機列をロックして返す（ロック待ちの間に他のCPUコアへ移されても正しい待機列を返す）
+    RunQueue& LockRunQueue(Task* task);
+    /// rq.lockを取ってから呼ぶ
+    void ChangeLevelRunning(RunQueue& rq, Task* task, int level);
+    /// ランキューの先頭要素を末尾に移動（rq.lockを取ってから呼ぶ）
+    Task* RotateCurrentRunQueue(RunQueue& rq, bool current_sleep);
+    /// 現在のCPUコアのFPUの所有者を替え、IntHandlerNMが保存先に使うg_fpu_owner_stateも合わせる
+    static void SetFPUOwner(RunQueue& rq, Task* task);
+    /// RestoreContext()、SwitchContext()でnextに切り替える直前に、割り込み禁止中に呼ぶ（この後でFPU/SSE命令を使うC++のコードを動かさない）
+    /// nextがFPUの所有者でなければCR0.TSを立て、最初のFPU/SSE命令で#NMを起こす
+    void PrepareFPU(RunQueue& rq, Task* next);
+    /// 割り込み禁止中に、現在のタスクをスリープさせて次のタスクに切り替える
+    /// held : 待機列から外した後、切り替える前に解放するロック（なければnullptr）
+    void SleepCurrent(SpinLock* held);
 };
 
 extern TaskManager* g_task_manager;
 constexpr uint64_t kMainTaskID = 1;
 
 void InitializeTask();
+/// アイドルタスク。他に実行可能なタスクがないときに動き、他のCPUコアからタスクを引き受ける
+void TaskIdle(uint64_t task_id, int64_t data);
@@ -1,19 +1,29 @@
 #include "terminal.hpp"
 
+#include <algorithm>
 #include <cstring>
+#include <limits>
 
 #include "../MikanLoaderPkg/elf.h"
+#include "acpi.hpp"
 #include "asmfunc.h"
 #include "font.hpp"
+#include "fpu.hpp"
+#include "heap.hpp"
 #include "keyboard.hpp"
 #include "layer.hpp"
 #include "memory_manager.hpp"
+#include "page_cache.hpp"
 #include "paging.hpp"
 #include "pci.hpp"
+#include "slab.hpp"
+#include "smp.hpp"
 #include "timer.hpp"
 
 #include "logger.hpp"
 
+size_t g_app_stack_pages = kDefaultAppStackPages;
+
 namespace {
     /// 空白区切りのコマンドライン引数を配列（argbuf）に詰める
     WithError<int> MakeArgVector(char* command, char* first_arg, char** argv, int argv_len, char* argbuf, int argbuf_len) {
@@ -101,16 +111,16 @@ namespace {
             last_addr = std::max(last_addr, phdr[i].p_paddr + phdr[i].p_memsz);
             const auto num_4kpages = (phdr[i].p_memsz + 4095) / 4096;
 
-            // setup pagemaps as readonly (writable = false)
-            // -> for copy on write
-            if (auto err = SetupPageMaps(dest_addr, num_4kpages, false)) {
+            // ここで書き込み可としても、アプリ実行時にはCopyPageMaps()が読み込み専用でマップするのでコピーオンライトになる
+            // （CR0.WP=1なので、読み込み専用にするとカーネル自身のコピーでもページフォルトが起きる）
+            if (auto err = SetupPageMaps(dest_addr, num_4kpages)) {
                 return {last_addr, err};
             }
 
             const auto src = reinterpret_cast<uint8_t*>(ehdr) + phdr[i].p_offset;
             const auto dst = reinterpret_cast<uint8_t*>(phdr[i].p_vaddr);
             memcpy(dst, src, phdr[i].p_filesz);
-            memcpy(dst + phdr[i].p_filesz, 0, phdr[i].p_memsz - phdr[i].p_filesz);
+            memset(dst + phdr[i].p_filesz, 0, phdr[i].p_memsz - phdr[i].p_filesz);
         }
         return {last_addr, MAKE_ERROR(Error::kSuccess)};
     }
@@ -132,6 +142,60 @@ namespace {
         return CopyLoadSegments(ehdr);
     }
 
+    /// ELFヘッダとプログラムヘッダだけを読み、LOADセグメントを遅延ロードする領域として返す
+    /// ファイル内のオフセットと仮想アドレスがページ内で揃っていないか、複数のセグメントが同じページに載っていれば
+    /// 遅延ロードできないのでkNotImplemented
+    WithError<AppLoadInfo> ReadLoadSegments(fat::DirectoryEntry& file_entry) {
+        fat::FileDescriptor fd{file_entry};
+        Elf64_Ehdr ehdr;
+        if (fd.Load(&ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+            memcmp(ehdr.e_ident, "\x7f"
+                                 "ELF",
+                   4) != 0) {
+            return {{}, MAKE_ERROR(Error::kInvalidFile)};
+        }
+        if (ehdr.e_type != ET_EXEC || ehdr.e_phentsize != sizeof(Elf64_Phdr)) {
+            return {{}, MAKE_ERROR(Error::kInvalidFormat)};
+        }
+
+        std::vector<Elf64_Phdr> phdrs(ehdr.e_phnum);
+        const size_t phdrs_bytes = sizeof(Elf64_Phdr) * phdrs.size();
+        if (fd.Load(phdrs.data(), phdrs_bytes, ehdr.e_phoff) != phdrs_bytes) {
+            return {{}, MAKE_ERROR(Error::kInvalidFile)};
+        }
+
+        AppLoadInfo app_load{0, ehdr.e_entry, nullptr, {}};
+        for (const auto& phdr : phdrs) {
+            if (phdr.p_type != PT_LOAD) {
+                continue;
+            }
+            // 1つ目のLOADセグメントの仮想アドレスがカノニカルアドレスの後半領域か？
+            if (app_load.segments.empty() && phdr.p_vaddr < 0xffff800000000000) {
+                return {{}, MAKE_ERROR(Error::kInvalidFormat)};
+            }
+            if ((phdr.p_vaddr - phdr.p_offset) % 4096 != 0 ||
+                phdr.p_offset + phdr.p_filesz > file_entry.file_size) {
+                return {{}, MAKE_ERROR(Error::kNotImplemented)};
+            }
+
+            const VirtualMemoryArea vma{
+                phdr.p_vaddr & 0xfffffffffffff000,
+                (phdr.p_vaddr + phdr.p_memsz + 4095) & 0xfffffffffffff000,
+                VmaType::kElf,
+                kVmaWritable,
+                -1,
+                phdr.p_offset & 0xfffffffffffff000,
+                phdr.p_vaddr + phdr.p_filesz,
+            };
+            if (!app_load.segments.empty() && vma.begin < app_load.segments.back().end) {
+                return {{}, MAKE_ERROR(Error::kNotImplemented)};
+            }
+            app_load.segments.push_back(vma);
+            app_load.vaddr_end = std::max(app_load.vaddr_end, phdr.p_vaddr + phdr.p_memsz);
+        }
+        return {app_load, MAKE_ERROR(Error::kSuccess)};
+    }
+
     /// 新規の階層ページング構造を生成して有効化
     WithError<PageMapEntry*> SetupPML4(Task& current_task) {
         auto pml4 = NewPageMap();
@@ -139,11 +203,14 @@ namespace {
             return pml4;
         }
 
-        const auto current_pml4 = reinterpret_cast<PageMapEntry*>(GetCR3());
+        const auto current_pml4 = CurrentPML4();
         // OSカーネル用のメモリマッピングだけは共通なので、それに該当する前半部分をコピー
         memcpy(pml4.value, current_pml4, 256 * sizeof(uint64_t));
 
-        const auto cr3 = reinterpret_cast<uint64_t>(pml4.value);
+        // 直前のPML4がAppImageCacheに残される場合も、そのPCIDはここで返す
+        FreePCID(current_task.Context().cr3);
+        // bit 63が0なので、再利用されたPCIDに残っている古いTLBはここで無効化される
+        const auto cr3 = reinterpret_cast<uint64_t>(pml4.value) | AllocatePCID();
         SetCR3(cr3);
         current_task.Context().cr3 = cr3;
         return pml4;
@@ -154,8 +221,9 @@ namespace {
         const auto cr3 = current_task.Context().cr3;
         current_task.Context().cr3 = 0;
         ResetCR3();
+        FreePCID(cr3);
 
-        return FreePageMap(reinterpret_cast<PageMapEntry*>(cr3));
+        return FreePageMap(reinterpret_cast<PageMapEntry*>(cr3 & kCR3AddrMask));
     }
 
     /// 指定ディレクトリの内容を一覧表示
@@ -195,12 +263,18 @@ namespace {
         }
 
         /// 起動されたことがある -> ELFファイルデータが既にメモリに読み込まれている
-        if (auto it = g_app_loads->find(&file_entry); it != g_app_loads->end()) {
-            AppLoadInfo app_load = it->second;
-            // アプリ領域（[256, 511]）をコピー（物理フレームのコピーはしない）
-            auto err = CopyPageMaps(temp_pml4, app_load.pml4, 4, 256);
+        if (auto [app_load, err] = g_app_images->Instantiate(file_entry, temp_pml4);
+            err.Cause() != Error::kNoSuchEntry) {
+            return {app_load, err};
+        }
+
+        // LOADセグメントはページフォルト時にファイルから読み込む
+        if (auto [app_load, err] = ReadLoadSegments(file_entry); !err) {
+            g_app_images->Insert(file_entry, app_load);
             app_load.pml4 = temp_pml4;
             return {app_load, err};
+        } else if (err.Cause() != Error::kNotImplemented) {
+            return {{}, err};
         }
 
         std::vector<uint8_t> file_buf(file_entry.file_size);
@@ -220,8 +294,8 @@ namespace {
             return {{}, err_load};
         }
 
-        AppLoadInfo app_load{last_addr, elf_header->e_entry, temp_pml4};
-        g_app_loads->insert(std::make_pair(&file_entry, app_load));
+        AppLoadInfo app_load{last_addr, elf_header->e_entry, temp_pml4, {}};
+        g_app_images->Insert(file_entry, app_load);
 
         if (auto [pml4, err] = SetupPML4(task); err) {
             return {app_load, err};
@@ -253,9 +327,117 @@ namespace {
         }
         return FindCommand(command, apps_entry.first->FirstCluster());
     }
-} // namespace
 
-std::map<fat::DirectoryEntry*, AppLoadInfo>* g_app_loads;
+    /// アプリの起動（階層ページング構造の用意まで）をcount回繰り返し、かかった時間と新たに使ったフレーム数を表示する
+    /// アプリは実行しない。1回目でアプリイメージキャッシュに載るので、2回目以降がキャッシュからの起動になる
+    void BenchmarkLaunch(fat::DirectoryEntry& file_entry, Task& task, int count, IFileDescriptor& out) {
+        const uint64_t addr_first = 0xffff800000000000;
+        unsigned long first_us = 0, cached_us = 0;
+        size_t cached_frames = 0;
+        bool lazy = false;
+        for (int i = 0; i < count; i++) {
+            const auto frames_before = g_memory_manager->Stat().allocated_frames + g_zeroed_frames.Frames();
+            const uint32_t start = acpi::PMTimerCount();
+            auto [app_load, err] = LoadApp(file_entry, task);
+            const auto elapsed_us = acpi::MicrosecondsSince(start);
+            const auto frames_after = g_memory_manager->Stat().allocated_frames + g_zeroed_frames.Frames();
+            if (err) {
+                PrintToFD(out, "failed to load: %s\n", err.Name());
+                FreePML4(task);
+                return;
+            }
+            lazy = !app_load.segments.empty();
+            if (i == 0) {
+                first_us = elapsed_us;
+            } else {
+                cached_us += elapsed_us;
+                cached_frames += frames_after - frames_before;
+            }
+            CleanPageMaps(LinearAddress4Level{addr_first});
+            FreePML4(task);
+        }
+
+        PrintToFD(out, "First : %lu us (%s)\n", first_us, lazy ? "lazy" : "eager");
+        if (count > 1) {
+            PrintToFD(out, "Cached : %lu us, %lu frames per launch (%d launches)\n",
+                      cached_us / (count - 1), cached_frames / (count - 1), count - 1);
+        }
+    }
+
+    /// cpubenchのタスク。メモリを使わない計算（xorshift）をdata回繰り返す
+    void TaskCPUBench(uint64_t task_id, int64_t data) {
+        uint64_t x = task_id | 1;
+        for (int64_t i = 0; i < data; i++) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+        }
+        g_task_manager->Finish(static_cast<int>(x & 0xff));
+    }
+
+    /// CPU間を移れるタスクをnum_tasks個作ってそれぞれにiterations回の計算をさせ、すべて終わるまでの時間を表示する
+    /// 空いたCPUコアがタスクを引き受けるので、CPUコアの数までは経過時間がほぼ変わらずに処理量が増える
+    void BenchmarkCPU(int num_tasks, int64_t iterations, IFileDescriptor& out) {
+        std::vector<uint64_t> task_ids;
+        const auto start = g_timer_manager->CurrentTick();
+        for (int i = 0; i < num_tasks; i++) {
+            task_ids.push_back(g_task_manager->NewTask()
+                                   .InitContext(TaskCPUBench, iterations)
+                                   .AllowMigration()
+                                   .Wakeup()
+                                   .ID());
+        }
+        for (auto id : task_ids) {
+            g_task_manager->WaitFinish(id);
+        }
+        const auto elapsed_ms = std::max(g_timer_manager->CurrentTick() - start, 1ul) * 1000 / kTimerFreq;
+
+        PrintToFD(out, "%d tasks x %ld iterations on %d CPUs : %lu ms, %lu Miter/s\n",
+                  num_tasks, iterations, CPUCount(), elapsed_ms,
+                  num_tasks * iterations / elapsed_ms / 1000);
+    }
+
+    /// switchbenchのタスク。Yield()で切り替え続ける
+    /// data : 下位2ビットが使うレジスタ（0 : なし、1 : SSE、2 : AVX）、残りが切替え回数
+    void TaskSwitchBench(uint64_t task_id, int64_t data) {
+        const int regs = data & 3;
+        const int64_t n = data >> 2;
+        for (int64_t i = 0; i < n; i++) {
+            // 相手のタスクも同じレジスタを使うので、毎回#NMでFPUの状態を入れ替える
+            if (regs == 1) {
+                __asm__ volatile("xorps %%xmm0, %%xmm0" ::: "xmm0");
+            } else if (regs == 2) {
+                // YMMの上位128ビットを使うので、AVXの状態も保存・復帰する
+                __asm__ volatile("vxorps %%ymm0, %%ymm0, %%ymm0\n\tvpcmpeqd %%ymm1, %%ymm1, %%ymm1" ::: "xmm0", "xmm1");
+            }
+            g_task_manager->Yield();
+        }
+        g_task_manager->Finish(0);
+    }
+
+    /// 2つのタスクにYield()で交互に切り替えさせ、1回の切替えにかかったTSCのサイクル数を表示する
+    /// SSEを使わないタスク同士はFPUの状態を保存・復帰しない。使うタスク同士は切替えのたびに保存・復帰する
+    void BenchmarkSwitch(int64_t iterations, IFileDescriptor& out) {
+        static const char* const kNames[] = {"integer-only", "SSE", "AVX"};
+        const int num_kinds = EnabledXFeatures() & kXFeatureAVX ? 3 : 2;
+        for (int regs = 0; regs < num_kinds; regs++) {
+            std::array<uint64_t, 2> task_ids;
+            const uint64_t start = __builtin_ia32_rdtsc();
+            for (auto& id : task_ids) {
+                id = g_task_manager->NewTask()
+                         .InitContext(TaskSwitchBench, iterations << 2 | regs)
+                         .Wakeup()
+                         .ID();
+            }
+            for (auto id : task_ids) {
+                g_task_manager->WaitFinish(id);
+            }
+            const uint64_t cycles = __builtin_ia32_rdtsc() - start;
+
+            PrintToFD(out, "%s tasks : %lu cycles/switch\n", kNames[regs], cycles / (2 * iterations));
+        }
+    }
+} // namespace
 
 Terminal::Terminal(Task& task, const TerminalDescriptor* term_desc) : task_{task} {
     if (term_desc) {
@@ -267,12 +449,12 @@ Terminal::Terminal(Task& task, const TerminalDescriptor* term_desc) : task_{task
         show_window_ = true;
         for (int i = 0; i < files_.size(); i++) {
             // 標準入出力をターミナルに接続
-            files_[i] = std::make_shared<TerminalFileDescriptor>(*this);
+            files_[i] = MakeSlabShared<TerminalFileDescriptor>(*this);
         }
     }
 
     if (show_window_) {
-        window_ = std::make_shared<TopLevelWindow>(
+        window_ = MakeSlabShared<TopLevelWindow>(
             kColumns * 8 + 8 + TopLevelWindow::kMarginX,
             kRows * 16 + 8 + TopLevelWindow::kMarginY,
             g_screen_config.pixel_format,
@@ -412,7 +594,7 @@ void Terminal::ExecuteLine() {
             return;
         }
         // 標準出力先を指定ファイルに変更
-        files_[1] = std::make_shared<fat::FileDescriptor>(*file);
+        files_[1] = MakeSlabShared<fat::FileDescriptor>(*file);
     }
 
     std::shared_ptr<PipeDescriptor> pipe_fd;
@@ -427,7 +609,7 @@ void Terminal::ExecuteLine() {
         }
 
         auto& subtask = g_task_manager->NewTask();
-        pipe_fd = std::make_shared<PipeDescriptor>(subtask);
+        pipe_fd = MakeSlabShared<PipeDescriptor>(subtask);
         // 送信先タスクの標準入出力を付け替える
         auto term_desc = new TerminalDescriptor{subcommand, true, false, {pipe_fd, files_[1], files_[2]}};
         // 現在のターミナル（送信元）の標準出力をパイプに接続
@@ -499,7 +681,7 @@ void Terminal::ExecuteLine() {
                 PrintToFD(*files_[2], "%s is not a directory\n", name);
                 exit_code = 1;
             } else {
-                fd = std::make_shared<fat::FileDescriptor>(*file_entry);
+                fd = MakeSlabShared<fat::FileDescriptor>(*file_entry);
             }
         }
         if (fd) { // ファイルが見つかった
@@ -520,6 +702,7 @@ void Terminal::ExecuteLine() {
         // 指定したコマンドラインを、画面非表示の新規ターミナル上で実行させる
         g_task_manager->NewTask()
             .InitContext(TaskTerminal, reinterpret_cast<int64_t>(term_desc))
+            .Detach()
             .Wakeup();
     } else if (strcmp(command, "memstat") == 0) { // メモリ使用量を表示
         const auto p_stat = g_memory_manager->Stat();
@@ -530,6 +713,122 @@ void Terminal::ExecuteLine() {
         PrintToFD(*files_[1], "Phys total : %lu frames (%llu MiB)\n",
                   p_stat.total_frames,
                   p_stat.total_frames * kBytesPerFrame / 1024 / 1024);
+
+        const auto h_stat = g_kernel_heap.Stat();
+        PrintToFD(*files_[1], "Heap : %lu KiB (peak %lu KiB, %lu pools)\n",
+                  h_stat.heap_bytes / 1024, h_stat.heap_bytes_peak / 1024, h_stat.pools);
+        PrintToFD(*files_[1], "Heap used : %lu KiB (peak %lu KiB)\n",
+                  h_stat.used_bytes / 1024, h_stat.used_bytes_peak / 1024);
+        // 断片化 : 空き領域のうち最大の空きブロックに含まれない割合
+        const size_t frag = h_stat.free_bytes == 0
+                                ? 0
+                                : 100 - h_stat.largest_free_bytes * 100 / h_stat.free_bytes;
+        PrintToFD(*files_[1], "Heap free : %lu KiB (largest %lu KiB, frag %lu%%)\n",
+                  h_stat.free_bytes / 1024, h_stat.largest_free_bytes / 1024, frag);
+    } else if (strcmp(command, "zeropool") == 0) { // ex. zeropool [watermark]
+        if (first_arg && first_arg[0] != 0) {
+            g_zeroed_frames.SetWatermark(strtoul(first_arg, nullptr, 0));
+        }
+        PrintToFD(*files_[1], "Zeroed frames : %lu / %lu (capacity %lu)\n",
+                  g_zeroed_frames.Frames(), g_zeroed_frames.Watermark(),
+                  ZeroedFramePool::kCapacity);
+        PrintToFD(*files_[1], "Hits : %lu, Misses : %lu\n",
+                  g_zeroed_frames.Hits(), g_zeroed_frames.Misses());
+    } else if (strcmp(command, "faultaround") == 0) { // ex. faultaround [pages]
+        if (first_arg && first_arg[0] != 0) {
+            g_fault_around_pages = std::clamp<size_t>(strtoul(first_arg, nullptr, 0), 1, kMaxFaultAroundPages);
+        }
+        PrintToFD(*files_[1], "Fault-around : %lu pages\n", g_fault_around_pages);
+    } else if (strcmp(command, "pcid") == 0) { // ex. pcid [on|off]
+        if (first_arg && first_arg[0] != 0) {
+            SetPCIDNoFlush(strcmp(first_arg, "off") != 0);
+        }
+        const auto stat = GetPCIDStat();
+        if (!stat.supported) {
+            PrintToFD(*files_[1], "PCID : not supported\n");
+        } else {
+            PrintToFD(*files_[1], "PCID : %s (INVPCID %s), %lu in use\n",
+                      stat.noflush ? "on" : "off", stat.invpcid ? "supported" : "not supported", stat.in_use);
+        }
+    } else if (strcmp(command, "stacksize") == 0) { // ex. stacksize [KiB]
+        if (first_arg && first_arg[0] != 0) {
+            g_app_stack_pages = std::clamp<size_t>(strtoul(first_arg, nullptr, 0) * 1024 / kBytesPerFrame,
+                                                   1, kMaxAppStackPages);
+        }
+        PrintToFD(*files_[1], "App stack : %lu KiB\n", g_app_stack_pages * kBytesPerFrame / 1024);
+    } else if (strcmp(command, "pagecache") == 0) { // ex. pagecache [drop]
+        if (first_arg && strcmp(first_arg, "drop") == 0) {
+            g_page_cache->Reclaim(std::numeric_limits<size_t>::max());
+        }
+        const auto stat = g_page_cache->Stat();
+        PrintToFD(*files_[1], "Resident : %lu pages (%lu dirty, %lu zero-copy)\n",
+                  stat.resident_pages, stat.dirty_pages, stat.direct_pages);
+        PrintToFD(*files_[1], "Hits : %lu, Misses : %lu, Evictions : %lu\n",
+                  stat.hits, stat.misses, stat.evictions);
+    } else if (strcmp(command, "appcache") == 0) { // ex. appcache [budget_KiB]
+        if (first_arg && first_arg[0] != 0) {
+            g_app_images->SetBudget(strtoul(first_arg, nullptr, 0) * 1024 / kBytesPerFrame);
+        }
+        size_t total = 0;
+        PrintToFD(*files_[1], "name          hits  resident  mode\n");
+        for (const auto& s : g_app_images->Stat()) {
+            char name[13];
+            fat::FormatName(*s.file_entry, name);
+            PrintToFD(*files_[1], "%-12s %5lu %6lu KiB  %s\n", name, s.hits,
+                      s.resident_frames * kBytesPerFrame / 1024, s.lazy ? "lazy" : "loaded");
+            total += s.resident_frames;
+        }
+        PrintToFD(*files_[1], "Total : %lu KiB / %lu KiB\n",
+                  total * kBytesPerFrame / 1024, g_app_images->Budget() * kBytesPerFrame / 1024);
+    } else if (strcmp(command, "exectime") == 0) { // 直前に実行したアプリの起動にかかった時間
+        PrintToFD(*files_[1], "Startup : %lu us (load %lu us, %s)\n",
+                  last_exec_.startup_us, last_exec_.load_us, last_exec_.lazy ? "lazy" : "eager");
+    } else if (strcmp(command, "pfstat") == 0) { // 直前に実行したアプリのページフォルトの回数
+        const auto& stat = g_task_manager->CurrentTask().FaultStat();
+        PrintToFD(*files_[1], "Page faults : %lu (cow %lu, anonymous %lu, file %lu)\n",
+                  stat.faults, stat.cow_faults, stat.anonymous_faults, stat.file_faults);
+        PrintToFD(*files_[1], "Prefaulted pages : %lu\n", stat.prefaulted_pages);
+    } else if (strcmp(command, "slabstat") == 0) { // スラブキャッシュの使用状況を表示
+        PrintToFD(*files_[1], "name       objsize  inuse/total  slabs(frames)  waste\n");
+        ForEachSlabCache([](const SlabCache& cache, void* arg) {
+            const auto s = cache.Stat();
+            PrintToFD(*reinterpret_cast<IFileDescriptor*>(arg),
+                      "%-10s %7lu %6lu/%-6lu %6lu(%2lu) %6lu KiB\n",
+                      s.name, s.object_size, s.objects_in_use, s.objects_total,
+                      s.slabs, s.frames_per_slab, s.waste_bytes / 1024);
+        }, files_[1].get());
+    } else if (strcmp(command, "launchbench") == 0) { // ex. launchbench gview 100
+        char* count_arg = first_arg ? strchr(first_arg, ' ') : nullptr;
+        if (count_arg) {
+            *count_arg++ = 0;
+        }
+        const int count = count_arg ? std::max(atoi(count_arg), 1) : 10;
+        auto file_entry = first_arg ? FindCommand(first_arg) : nullptr;
+        if (!file_entry) {
+            PrintToFD(*files_[2], "no such command: %s\n", first_arg ? first_arg : "");
+            exit_code = 1;
+        } else {
+            BenchmarkLaunch(*file_entry, task_, count, *files_[1]);
+        }
+    } else if (strcmp(command, "cpubench") == 0) { // ex. cpubench 4 100000000
+        char* iterations_arg = first_arg ? strchr(first_arg, ' ') : nullptr;
+        if (iterations_arg) {
+            *iterations_arg++ = 0;
+        }
+        const int num_tasks = first_arg ? std::max(atoi(first_arg), 1) : CPUCount();
+        const int64_t iterations = iterations_arg ? std::max(atol(iterations_arg), 1l) : 100000000;
+        BenchmarkCPU(num_tasks, iterations, *files_[1]);
+    } else if (strcmp(command, "switchbench") == 0) { // ex. switchbench 100000
+        const int64_t iterations = first_arg ? std::max(atol(first_arg), 1l) : 100000;
+        BenchmarkSwitch(iterations, *files_[1]);
+    } else if (strcmp(command, "timerstat") == 0) { // ex. timerstat
+        // アイドル中のCPUコアは割り込み回数が増えない
+        PrintToFD(*files_[1], "mode: %s, uptime: %lu ms\n",
+                  TSCDeadlineEnabled() ? "TSC-deadline" : "LAPIC one-shot",
+                  g_timer_manager->CurrentTick() * 1000 / kTimerFreq);
+        for (int cpu = 0; cpu < CPUCount(); cpu++) {
+            PrintToFD(*files_[1], "cpu %d: %lu timer interrupts\n", cpu, TimerInterruptCount(cpu));
+        }
     } else if (command[0] != 0) {
         auto file_entry = FindCommand(command);
         if (!file_entry) { // エントリが見つからない
@@ -566,6 +865,7 @@ void Terminal::ExecuteLine() {
 }
 
 WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry& file_entry, char* command, char* first_arg) {
+    const uint32_t exec_start = acpi::PMTimerCount();
     // アプリ独自の仮想アドレスに実行可能ファイルをロードするため、事前にタスク固有の階層ページング構造を設定
     __asm__("cli");
     auto& task = g_task_manager->CurrentTask();
@@ -575,6 +875,8 @@ WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry& file_entry, char* comm
     if (err) {
         return {0, err};
     }
+    last_exec_.load_us = acpi::MicrosecondsSince(exec_start);
+    last_exec_.lazy = !app_load.segments.empty();
 
     // コマンドライン引数を取得
     // アプリ用のページにargvを構築
@@ -595,11 +897,14 @@ WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry& file_entry, char* comm
     }
 
     // アプリ用スタック領域
-    const int stack_size = 16 * 4096; // 64KiB
-    LinearAddress4Level stack_frame_addr{0xfffffffffffff000 - stack_size};
-    if (auto err = SetupPageMaps(stack_frame_addr, stack_size / 4096)) {
+    // g_app_stack_pagesページ分を予約し、最初に使う先頭の1ページだけを割り当てる（残りはページフォルト時に割り当てる）
+    const uint64_t stack_size = 4096 * std::clamp<size_t>(g_app_stack_pages, 1, kMaxAppStackPages);
+    LinearAddress4Level stack_frame_addr{args_frame_addr.value - stack_size};
+    if (auto err = SetupPageMaps(LinearAddress4Level{args_frame_addr.value - 4096}, 1)) {
         return {0, err};
     }
+    // ガードページ : どの領域にも含めないので、スタックが溢れるとページフォルトでアプリを終了させる
+    const uint64_t stack_guard_addr = stack_frame_addr.value - 4096;
 
     // fd=0,1,2に標準入力、標準出力、標準エラー出力を設定
     for (int i = 0; i < 3; i++) {
@@ -609,31 +914,60 @@ WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry& file_entry, char* comm
     // デマンドページングのアドレス範囲を初期化
     // アプリに関連する仮想アドレス範囲は以下のようになる
     // [0xffff 8000 0000 0000, elf_last_addr] : アプリのELF
-    // [elf_next_page (dpaging_begin_), dpaging_end_) : アプリのデマンドページング範囲
-    // [dpaging_end_, 0xffff ffff ffff f000) : メモリマップドファイル範囲。メモリを拡大するときは前方に進める。
-    // [0xffff ffff ffff f000, 0xffff ffff ffff ffff] : スタック領域 + コマンドライン引数
+    // [elf_next_page, dpaging_end_) : アプリのデマンドページング範囲
+    // [dpaging_end_, stack_guard_addr) : メモリマップドファイル範囲。メモリを拡大するときは前方に進める。
+    // [stack_guard_addr, stack_frame_addr) : ガードページ（マップしない）
+    // [stack_frame_addr, 0xffff ffff ffff f000) : スタック領域
+    // [0xffff ffff ffff f000, 0xffff ffff ffff ffff] : コマンドライン引数
     const uint64_t elf_next_page = (app_load.vaddr_end + 4095) & 0xfffffffffffff000; // 4KiB単位のアドレスに切り上げ
-    task.SetDPagingBegin(elf_next_page);
     task.SetDPagingEnd(elf_next_page);
-
-    task.SetFileMapEnd(stack_frame_addr.value);
+    task.SetFileMapEnd(stack_guard_addr);
+
+    // 起動時に決まる領域を登録。以降の領域はシステムコールで追加される
+    // コマンドライン引数のページは終端が2^64となり表せないので登録しない（起動時に割り当て済み）
+    task.Vmas().Clear();
+    if (app_load.segments.empty()) {
+        if (auto err = task.Vmas().Insert({0xffff800000000000, elf_next_page, VmaType::kElf, kVmaWritable, -1, 0, 0})) {
+            return {0, err};
+        }
+    } else {
+        for (const auto& segment : app_load.segments) {
+            if (auto err = task.Vmas().Insert(segment)) {
+                return {0, err};
+            }
+        }
+        task.ExecFile() = MakeSlabShared<fat::FileDescriptor>(file_entry);
+    }
+    if (auto err = task.Vmas().Insert({stack_frame_addr.value, args_frame_addr.value, VmaType::kStack, kVmaWritable, -1, 0})) {
+        return {0, err};
+    }
+    // ページフォルトの回数はアプリ毎に数える（pfstatで表示）
+    task.FaultStat() = {};
+    last_exec_.startup_us = acpi::MicrosecondsSince(exec_start);
 
     // エントリポイントのアドレスを取得し、実行
     int ret = CallApp(argc.value,
                       argv,
                       3 << 3 | 3,
                       app_load.entry,
-                      stack_frame_addr.value + stack_size - 8,
+                      args_frame_addr.value - 8,
                       &task.OSStackPointer()); // アプリ終了時に復帰するスタックポインタ
 
     task.Files().clear();
-    task.FileMaps().clear();
+    task.Vmas().Clear();
+    task.ExecFile().reset();
+    // タイムアウト前のタイマが残っていると、空きノードを使い続ける
+    __asm__("cli");
+    g_timer_manager->CancelAppTimers(task.ID());
+    __asm__("sti");
 
     // アプリ終了後、使用したメモリ領域を解放
     const uint64_t addr_first = 0xffff800000000000;
     if (auto err = CleanPageMaps(LinearAddress4Level{addr_first})) {
         return {ret, err};
     }
+    // 共有マッピングで書き込まれたページをファイルに書き戻す
+    g_page_cache->Sync();
 
     return {ret, FreePML4(task)};
 }
@@ -759,13 +1093,16 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
 
     if (term_desc && term_desc->exit_after_command) { // タスクを終了させる
         delete term_desc;
-        __asm__("cli");
         g_task_manager->Finish(terminal->LastExitCode());
-        __asm__("sti");
     }
 
     auto add_blink_timer = [task_id](unsigned long t) {
-        g_timer_manager->AddTimer(Timer{t + static_cast<int>(kTimerFreq * 0.5), 1, task_id});
+        __asm__("cli");
+        auto [id, err] = g_timer_manager->AddTimer(Timer{t + static_cast<int>(kTimerFreq * 0.5), 1, task_id});
+        __asm__("sti");
+        if (err) {
+            Log(kError, "failed to add a cursor timer: %s\n", err.Name());
+        }
     };
     add_blink_timer(g_timer_manager->CurrentTick());
 
@@ -814,9 +1151,7 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
             break;
         case Message::kWindowClose:
             CloseLayer(msg->arg.window_close.layer_id);
-            __asm__("cli");
             g_task_manager->Finish(terminal->LastExitCode());
-            __asm__("sti");
             break;
         default:
             break;
@@ -7,24 +7,34 @@
 #include <map>
 #include <memory>
 #include <optional>
+#include <vector>
 
+#include "app_cache.hpp"
 #include "fat.hpp"
 #include "layer.hpp"
 #include "paging.hpp"
 #include "task.hpp"
 #include "window.hpp"
 
-/// アプリをロードした後の状態
-struct AppLoadInfo {
-    /// アプリのLOADセグメントの最終アドレス
-    /// デマンドページングのアドレス範囲開始点として使用
-    uint64_t vaddr_end;
-    /// アプリのエントリポイントのアドレス
-    uint64_t entry;
-    /// アプリ固有の階層ページング構造
-    PageMapEntry* pml4;
+/// 直前に実行したアプリの起動にかかった時間（マイクロ秒）
+struct ExecTiming {
+    /// ELFの読み込み（遅延ロードならプログラムヘッダの解析のみ）
+    unsigned long load_us;
+    /// コマンドの実行開始からアプリに制御を移すまで
+    unsigned long startup_us;
+    /// 遅延ロードした : true
+    bool lazy;
 };
 
+/// アプリ用スタックとして予約する大きさ（4KiBページ数）の初期値（1MiB）
+/// 予約した範囲のページはアクセスされたときに割り当てる
+const size_t kDefaultAppStackPages = 256;
+/// 予約できる大きさの上限（64MiB）
+const size_t kMaxAppStackPages = 16384;
+/// アプリ用スタックとして予約する大きさ（4KiBページ数）
+/// スタックの下には何もマップしないガードページを置き、溢れたアプリはページフォルトで終了させる
+extern size_t g_app_stack_pages;
+
 struct TerminalDescriptor {
     /// コマンドライン引数
     std::string command_line;
@@ -36,9 +46,6 @@ struct TerminalDescriptor {
     std::array<std::shared_ptr<IFileDescriptor>, 3> files;
 };
 
-/// ロード済みアプリの一覧
-extern std::map<fat::DirectoryEntry*, AppLoadInfo>* g_app_loads;
-
 class Terminal {
 public:
     static const int kRows = 15, kColumns = 60;
@@ -77,6 +84,7 @@ private:
     std::array<std::shared_ptr<IFileDescriptor>, 3> files_;
     /// 直前のアプリの終了コード
     int last_exit_code_{0};
+    ExecTiming last_exec_{};
 
     void DrawCursor(bool visible);
     Vector2D<int> CalcCursorPos() const;
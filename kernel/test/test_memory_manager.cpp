@@ -1,8 +1,18 @@
 #include <CppUTest/CommandLineTestRunner.h>
+
+#include <vector>
+
 #include "memory_manager.hpp"
 
+namespace {
+  // 512MiB
+  const size_t kFrameCount = 4 << BitmapMemoryManager::kMaxOrder;
+}
+
 TEST_GROUP(MemoryManager) {
-  BitmapMemoryManager mgr;
+  std::vector<BitmapMemoryManager::MapLineType> map_buf =
+      std::vector<BitmapMemoryManager::MapLineType>(BitmapMemoryManager::MapLinesFor(kFrameCount));
+  BitmapMemoryManager mgr{kFrameCount, map_buf.data()};
 
   TEST_SETUP() {}
 
@@ -26,7 +36,7 @@ TEST(MemoryManager, AllocateMultipleLine) {
 }
 
 TEST(MemoryManager, AllocateNoEnoughMemory) {
-  const auto frame1 = mgr.Allocate(BitmapMemoryManager::kFrameCount + 1);
+  const auto frame1 = mgr.Allocate(kFrameCount + 1);
 
   CHECK_EQUAL(Error::kNoEnoughMemory, frame1.error.Cause());
   CHECK_EQUAL(kNullFrame.ID(), frame1.value.ID());
@@ -65,3 +75,233 @@ TEST(MemoryManager, SetMemoryRange) {
   CHECK_EQUAL(0, frame1.value.ID());
   CHECK_EQUAL(10, frame2.value.ID());
 }
+
+TEST(MemoryManager, OrderOf) {
+  CHECK_EQUAL(0, BitmapMemoryManager::OrderOf(1));
+  CHECK_EQUAL(1, BitmapMemoryManager::OrderOf(2));
+  CHECK_EQUAL(2, BitmapMemoryManager::OrderOf(3));
+  CHECK_EQUAL(15, BitmapMemoryManager::OrderOf(64 * 512));
+}
+
+TEST(MemoryManager, AllocateSplit) {
+  // 最大ブロックが分割され、前半から順に割り当てられる
+  const auto frame1 = mgr.Allocate(1);
+  const auto frame2 = mgr.Allocate(1);
+  const auto frame3 = mgr.Allocate(2);
+  const auto frame4 = mgr.Allocate(4);
+
+  CHECK_EQUAL(0, frame1.value.ID());
+  CHECK_EQUAL(1, frame2.value.ID());
+  CHECK_EQUAL(2, frame3.value.ID());
+  CHECK_EQUAL(4, frame4.value.ID());
+}
+
+TEST(MemoryManager, AllocateAligned) {
+  mgr.Allocate(1);
+  const auto frame1 = mgr.Allocate(8);
+  const auto frame2 = mgr.Allocate(1 << BitmapMemoryManager::kMaxOrder);
+
+  CHECK_EQUAL(8, frame1.value.ID());
+  CHECK_EQUAL(1 << BitmapMemoryManager::kMaxOrder, frame2.value.ID());
+}
+
+TEST(MemoryManager, AllocateReturnsRemainder) {
+  // 5フレームの要求は8フレームのブロックから切り出され、残り3フレームは再利用される
+  const auto frame1 = mgr.Allocate(5);
+  const auto frame2 = mgr.Allocate(1);
+  const auto frame3 = mgr.Allocate(2);
+
+  CHECK_EQUAL(0, frame1.value.ID());
+  CHECK_EQUAL(5, frame2.value.ID());
+  CHECK_EQUAL(6, frame3.value.ID());
+}
+
+TEST(MemoryManager, AllocateTooLarge) {
+  const auto frame1 = mgr.Allocate((1 << BitmapMemoryManager::kMaxOrder) + 1);
+
+  CHECK_EQUAL(Error::kNoEnoughMemory, frame1.error.Cause());
+}
+
+TEST(MemoryManager, FreeCoalesce) {
+  const auto frame1 = mgr.Allocate(1);
+  const auto frame2 = mgr.Allocate(1);
+  mgr.Free(frame1.value, 1);
+  mgr.Free(frame2.value, 1);
+  // バディ同士が結合されて最大ブロックに戻る
+  const auto frame3 = mgr.Allocate(1 << BitmapMemoryManager::kMaxOrder);
+
+  CHECK_EQUAL(0, frame3.value.ID());
+}
+
+TEST(MemoryManager, FreeCoalesceReverseOrder) {
+  const auto frame1 = mgr.Allocate(2);
+  const auto frame2 = mgr.Allocate(2);
+  mgr.Free(frame2.value, 2);
+  mgr.Free(frame1.value, 2);
+  const auto frame3 = mgr.Allocate(4);
+
+  CHECK_EQUAL(0, frame3.value.ID());
+}
+
+TEST(MemoryManager, Fragmentation) {
+  for (int i = 0; i < 64; i++) {
+    mgr.Allocate(1);
+  }
+  // 1フレームおきに解放しても2フレームの連続領域はできない
+  for (int i = 0; i < 64; i += 2) {
+    mgr.Free(FrameID{static_cast<size_t>(i)}, 1);
+  }
+  const auto frame1 = mgr.Allocate(2);
+  const auto frame2 = mgr.Allocate(1);
+
+  CHECK_EQUAL(64, frame1.value.ID());
+  CHECK_EQUAL(0, frame2.value.ID());
+
+  // 残りを解放すれば再び結合される
+  mgr.Free(frame1.value, 2);
+  mgr.Free(frame2.value, 1);
+  for (int i = 1; i < 64; i += 2) {
+    mgr.Free(FrameID{static_cast<size_t>(i)}, 1);
+  }
+  const auto frame3 = mgr.Allocate(64);
+
+  CHECK_EQUAL(0, frame3.value.ID());
+}
+
+TEST(MemoryManager, MarkAllocatedSplit) {
+  mgr.MarkAllocated(FrameID{3}, 2);
+  // 使用中領域の前後は小さなブロックに分割されて残り、要求に合う最小のブロックから使われる
+  const auto frame1 = mgr.Allocate(1);
+  const auto frame2 = mgr.Allocate(2);
+  const auto frame3 = mgr.Allocate(1);
+  const auto frame4 = mgr.Allocate(2);
+
+  CHECK_EQUAL(2, frame1.value.ID());
+  CHECK_EQUAL(0, frame2.value.ID());
+  CHECK_EQUAL(5, frame3.value.ID());
+  CHECK_EQUAL(6, frame4.value.ID());
+}
+
+TEST(MemoryManager, Stat) {
+  mgr.SetMemoryRange(FrameID{0}, FrameID{1024});
+  mgr.Allocate(3);
+  const auto frame1 = mgr.Allocate(100);
+  mgr.Free(frame1.value, 100);
+  const auto stat = mgr.Stat();
+
+  CHECK_EQUAL(3, stat.allocated_frames);
+  CHECK_EQUAL(1024, stat.total_frames);
+}
+
+TEST(MemoryManager, MarkAllocatedLarge) {
+  // 要素（64フレーム）単位でまとめて設定される範囲と端数の両方を含む
+  mgr.MarkAllocated(FrameID{5}, 3 * 4096 + 100);
+  const auto frame1 = mgr.Allocate(4);
+  const auto frame2 = mgr.Allocate(8);
+
+  CHECK_EQUAL(0, frame1.value.ID());
+  CHECK_EQUAL(3 * 4096 + 112, frame2.value.ID());
+  CHECK_EQUAL(3 * 4096 + 100 + 4 + 8, mgr.Stat().allocated_frames);
+}
+
+TEST(MemoryManager, MarkAllocatedTwice) {
+  mgr.MarkAllocated(FrameID{0}, 100);
+  mgr.MarkAllocated(FrameID{50}, 100);
+
+  CHECK_EQUAL(150, mgr.Stat().allocated_frames);
+  CHECK_EQUAL(150, mgr.Allocate(1).value.ID());
+}
+
+TEST(MemoryManager, SetMemoryRangeSkipsAllocated) {
+  mgr.MarkAllocated(FrameID{0}, 2 * 4096 + 3);
+  mgr.SetMemoryRange(FrameID{1}, FrameID{3 * 4096});
+  const auto frame1 = mgr.Allocate(1);
+  const auto frame2 = mgr.Allocate(4096);
+
+  CHECK_EQUAL(2 * 4096 + 3, frame1.value.ID());
+  CHECK_EQUAL(Error::kNoEnoughMemory, frame2.error.Cause());
+  CHECK_EQUAL(2 * 4096 + 3, mgr.Stat().allocated_frames);
+  CHECK_EQUAL(3 * 4096 - 1, mgr.Stat().total_frames);
+}
+
+TEST(MemoryManager, MarkAllocatedBeyondFrameCount) {
+  // 物理メモリの外側（MMIO領域など）の指定は無視される
+  mgr.MarkAllocated(FrameID{kFrameCount - 1}, 10);
+  mgr.MarkAllocated(FrameID{kFrameCount + 10}, 10);
+
+  CHECK_EQUAL(1, mgr.Stat().allocated_frames);
+}
+
+TEST_GROUP(FrameBitmap) {
+  static const size_t kBits = 3 * 4096 + 10;
+  std::vector<FrameBitmap::LineType> buf =
+      std::vector<FrameBitmap::LineType>(FrameBitmap::LinesFor(kBits));
+  FrameBitmap bitmap;
+
+  TEST_SETUP() {
+    bitmap.Init(buf.data(), kBits);
+  }
+};
+
+TEST(FrameBitmap, SetRange) {
+  CHECK_EQUAL(200, bitmap.SetRange(10, 210, true));
+  CHECK_EQUAL(10, bitmap.SetRange(0, 20, true));
+  CHECK_EQUAL(5, bitmap.SetRange(100, 105, false));
+
+  CHECK_TRUE(bitmap.Get(0));
+  CHECK_TRUE(bitmap.Get(10));
+  CHECK_TRUE(bitmap.Get(99));
+  CHECK_FALSE(bitmap.Get(100));
+  CHECK_TRUE(bitmap.Get(209));
+  CHECK_FALSE(bitmap.Get(210));
+  CHECK_EQUAL(205, bitmap.Count(0, kBits));
+}
+
+TEST(FrameBitmap, NextClear) {
+  bitmap.SetRange(0, 2 * 4096 + 70, true);
+
+  CHECK_EQUAL(2 * 4096 + 70, bitmap.NextClear(0));
+  CHECK_EQUAL(2 * 4096 + 70, bitmap.NextClear(4096 + 1));
+  CHECK_EQUAL(3 * 4096, bitmap.NextClear(3 * 4096));
+
+  bitmap.SetRange(4096, 4097, false);
+  CHECK_EQUAL(4096, bitmap.NextClear(1));
+
+  bitmap.SetRange(0, kBits, true);
+  CHECK_EQUAL(kBits, bitmap.NextClear(0));
+}
+
+TEST(FrameBitmap, NextSet) {
+  bitmap.SetRange(4096 + 3, 4096 + 5, true);
+
+  CHECK_EQUAL(4096 + 3, bitmap.NextSet(0));
+  CHECK_EQUAL(4096 + 4, bitmap.NextSet(4096 + 4));
+  CHECK_EQUAL(kBits, bitmap.NextSet(4096 + 5));
+}
+
+TEST_GROUP(FrameRefCounts) {
+  std::vector<FrameRefCounts::CountType> buf = std::vector<FrameRefCounts::CountType>(64, 0xffff);
+  FrameRefCounts refs{64, buf.data()};
+};
+
+TEST(FrameRefCounts, IncrementDecrement) {
+  CHECK_EQUAL(0, refs.Get(FrameID{3}));
+  refs.Set(FrameID{3}, 1);
+  CHECK_EQUAL(2, refs.Increment(FrameID{3}));
+  CHECK_EQUAL(1, refs.Decrement(FrameID{3}));
+  CHECK_EQUAL(0, refs.Decrement(FrameID{3}));
+  CHECK_EQUAL(0, refs.Decrement(FrameID{3}));
+  CHECK_EQUAL(0, refs.Get(FrameID{4}));
+}
+
+TEST(FrameRefCounts, OutOfRange) {
+  CHECK_EQUAL(0, refs.Increment(FrameID{64}));
+  CHECK_EQUAL(0, refs.Get(FrameID{64}));
+}
+
+TEST(FrameRefCounts, Sticky) {
+  refs.Set(FrameID{5}, FrameRefCounts::kStickyCount - 1);
+  CHECK_EQUAL(FrameRefCounts::kStickyCount, refs.Increment(FrameID{5}));
+  CHECK_EQUAL(FrameRefCounts::kStickyCount, refs.Increment(FrameID{5}));
+  CHECK_EQUAL(FrameRefCounts::kStickyCount, refs.Decrement(FrameID{5}));
+}
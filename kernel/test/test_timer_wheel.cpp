@@ -0,0 +1,115 @@
+#include <CppUTest/CommandLineTestRunner.h>
+
+#include <memory>
+#include <vector>
+
+#include "timer_wheel.hpp"
+
+namespace {
+  std::vector<unsigned long> PopAll(TimerWheel& wheel, unsigned long now) {
+    std::vector<unsigned long> timeouts;
+    Timer timer{0, 0, 0};
+    while (wheel.PopExpired(now, timer)) {
+      timeouts.push_back(timer.Timeout());
+    }
+    return timeouts;
+  }
+}
+
+TEST_GROUP(TimerWheel) {
+  std::unique_ptr<TimerWheel> wheel;
+
+  TEST_SETUP() {
+    wheel = std::make_unique<TimerWheel>();
+  }
+
+  TEST_TEARDOWN() {}
+};
+
+TEST(TimerWheel, ExpireInOrder) {
+  // 0段目から上の段まで散らばる期限
+  const unsigned long timeouts[] = {500000, 3, 70, 20000, 64, 1ul << 40, 4095};
+  for (auto t : timeouts) {
+    CHECK_FALSE(wheel->Add(Timer{t, 1, 1}).error);
+  }
+  CHECK_EQUAL(7, wheel->Count());
+  CHECK_EQUAL(3, wheel->NextTimeout());
+
+  CHECK_TRUE(PopAll(*wheel, 2).empty());
+  CHECK_TRUE((PopAll(*wheel, 100) == std::vector<unsigned long>{3, 64, 70}));
+  CHECK_EQUAL(4095, wheel->NextTimeout());
+  CHECK_TRUE((PopAll(*wheel, 499999) == std::vector<unsigned long>{4095, 20000}));
+  CHECK_EQUAL(500000, wheel->NextTimeout());
+  CHECK_TRUE((PopAll(*wheel, 500000) == std::vector<unsigned long>{500000}));
+  CHECK_EQUAL(1ul << 40, wheel->NextTimeout());
+  CHECK_TRUE((PopAll(*wheel, 1ul << 41) == std::vector<unsigned long>{1ul << 40}));
+  CHECK_EQUAL(0, wheel->Count());
+  CHECK_EQUAL(TimerWheel::kNoTimeout, wheel->NextTimeout());
+}
+
+TEST(TimerWheel, PastTimeout) {
+  PopAll(*wheel, 1000);
+  // 処理済みの時刻より前の期限は、次の処理ですぐにタイムアウトする
+  CHECK_FALSE(wheel->Add(Timer{10, 1, 1}).error);
+  CHECK_EQUAL(1001, wheel->NextTimeout());
+  CHECK_TRUE((PopAll(*wheel, 1001) == std::vector<unsigned long>{10}));
+}
+
+TEST(TimerWheel, Cancel) {
+  auto [id1, err1] = wheel->Add(Timer{100, 1, 7});
+  auto [id2, err2] = wheel->Add(Timer{200000, 2, 7});
+  CHECK_FALSE(err1);
+  CHECK_FALSE(err2);
+  CHECK_EQUAL(2, wheel->Find(id2)->Value());
+
+  CHECK_FALSE(wheel->Cancel(id1));
+  CHECK_TRUE(wheel->Find(id1) == nullptr);
+  CHECK_TRUE(wheel->Cancel(id1).Cause() == Error::kNoSuchEntry);
+  CHECK_EQUAL(200000, wheel->NextTimeout());
+
+  // 同じノードを再利用しても、古いIDでは取り消せない
+  auto [id3, err3] = wheel->Add(Timer{300, 3, 7});
+  CHECK_FALSE(err3);
+  CHECK_TRUE(id3 != id1);
+  CHECK_TRUE(wheel->Cancel(id1).Cause() == Error::kNoSuchEntry);
+  CHECK_EQUAL(3, wheel->Find(id3)->Value());
+
+  CHECK_FALSE(wheel->Cancel(id2));
+  CHECK_TRUE((PopAll(*wheel, 1000000) == std::vector<unsigned long>{300}));
+  CHECK_TRUE(wheel->Find(id3) == nullptr);
+}
+
+TEST(TimerWheel, Full) {
+  for (size_t i = 0; i < TimerWheel::kMaxTimers; i++) {
+    CHECK_FALSE(wheel->Add(Timer{i + 1, 1, 1}).error);
+  }
+  CHECK_TRUE(wheel->Add(Timer{1, 1, 1}).error.Cause() == Error::kFull);
+  CHECK_EQUAL(TimerWheel::kMaxTimers, PopAll(*wheel, TimerWheel::kMaxTimers).size());
+  CHECK_FALSE(wheel->Add(Timer{1, 1, 1}).error);
+}
+
+TEST(TimerWheel, Reserve) {
+  for (size_t i = 0; i < TimerWheel::kMaxTimers - 2; i++) {
+    CHECK_FALSE(wheel->Add(Timer{i + 1, -1, 1}, 2).error);
+  }
+  // 残りの2つは予約なしでしか使えない
+  CHECK_TRUE(wheel->Add(Timer{1, -1, 1}, 2).error.Cause() == Error::kFull);
+  CHECK_FALSE(wheel->Add(Timer{1, 1, 1}).error);
+  CHECK_FALSE(wheel->Add(Timer{1, 1, 1}).error);
+  CHECK_TRUE(wheel->Add(Timer{1, 1, 1}).error.Cause() == Error::kFull);
+}
+
+TEST(TimerWheel, CancelIf) {
+  auto [id1, err1] = wheel->Add(Timer{100, -1, 7});
+  auto [id2, err2] = wheel->Add(Timer{200, 1, 7});
+  auto [id3, err3] = wheel->Add(Timer{300, -1, 8});
+  CHECK_FALSE(err1);
+  CHECK_FALSE(err2);
+  CHECK_FALSE(err3);
+  CHECK_EQUAL(1, wheel->CancelIf([](const Timer& t) { return t.TaskID() == 7 && t.Value() < 0; }));
+  CHECK_TRUE(wheel->Find(id1) == nullptr);
+  CHECK_TRUE(wheel->Find(id2) != nullptr);
+  CHECK_TRUE(wheel->Find(id3) != nullptr);
+  CHECK_EQUAL(2, wheel->Count());
+  CHECK_TRUE((PopAll(*wheel, 1000) == std::vector<unsigned long>{200, 300}));
+}
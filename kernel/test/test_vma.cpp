@@ -0,0 +1,88 @@
+#include <CppUTest/CommandLineTestRunner.h>
+
+#include "vma.hpp"
+
+namespace {
+  VirtualMemoryArea Anonymous(uint64_t begin, uint64_t end, uint32_t flags = kVmaWritable) {
+    return {begin, end, VmaType::kAnonymous, flags, -1, 0};
+  }
+}
+
+TEST_GROUP(VmaList) {
+  VmaList vmas;
+
+  TEST_SETUP() {}
+
+  TEST_TEARDOWN() {}
+};
+
+TEST(VmaList, Find) {
+  CHECK_FALSE(vmas.Insert({0x1000, 0x3000, VmaType::kElf, 0, -1, 0}));
+  CHECK_FALSE(vmas.Insert({0x8000, 0x9000, VmaType::kFile, 0, 3, 0}));
+  CHECK_FALSE(vmas.Insert(Anonymous(0x4000, 0x5000)));
+
+  CHECK_TRUE(vmas.Find(0x0fff) == nullptr);
+  CHECK_TRUE(vmas.Find(0x3000) == nullptr);
+  CHECK_TRUE(vmas.Find(0x9000) == nullptr);
+  CHECK_TRUE(vmas.Find(0x1000)->type == VmaType::kElf);
+  CHECK_TRUE(vmas.Find(0x2fff)->type == VmaType::kElf);
+  CHECK_TRUE(vmas.Find(0x4800)->type == VmaType::kAnonymous);
+  CHECK_EQUAL(3, vmas.Find(0x8000)->fd);
+}
+
+TEST(VmaList, Overlap) {
+  CHECK_FALSE(vmas.Insert({0x4000, 0x6000, VmaType::kFile, 0, 3, 0}));
+
+  CHECK_TRUE(vmas.Insert(Anonymous(0x3000, 0x5000)).Cause() == Error::kAlreadyAllocated);
+  CHECK_TRUE(vmas.Insert(Anonymous(0x5000, 0x7000)).Cause() == Error::kAlreadyAllocated);
+  CHECK_TRUE(vmas.Insert(Anonymous(0x3000, 0x7000)).Cause() == Error::kAlreadyAllocated);
+  CHECK_TRUE(vmas.Insert(Anonymous(0x7000, 0x7000)).Cause() == Error::kIndexOutOfRange);
+  CHECK_EQUAL(1, vmas.Size());
+}
+
+TEST(VmaList, MergeAnonymous) {
+  CHECK_FALSE(vmas.Insert(Anonymous(0x1000, 0x2000)));
+  CHECK_FALSE(vmas.Insert(Anonymous(0x2000, 0x3000)));
+  CHECK_EQUAL(1, vmas.Size());
+  CHECK_EQUAL(0x3000, vmas.Find(0x1000)->end);
+
+  // 属性が異なれば結合しない
+  CHECK_FALSE(vmas.Insert(Anonymous(0x3000, 0x4000, kVmaWritable | kVmaHuge)));
+  CHECK_EQUAL(2, vmas.Size());
+}
+
+TEST(VmaList, Remove) {
+  CHECK_FALSE(vmas.Insert(Anonymous(0x1000, 0x4000)));
+  CHECK_FALSE(vmas.Insert({0x6000, 0x9000, VmaType::kFile, 0, 3, 0x10000}));
+
+  // 途中を取り除くと2つに分かれる
+  vmas.Remove(0x2000, 0x3000);
+  CHECK_EQUAL(3, vmas.Size());
+  CHECK_EQUAL(0x2000, vmas.Find(0x1000)->end);
+  CHECK_TRUE(vmas.Find(0x2800) == nullptr);
+  CHECK_EQUAL(0x3000, vmas.Find(0x3000)->begin);
+
+  // 複数の領域にまたがる範囲。ファイルの領域は先頭が削られるのでオフセットもずれる
+  vmas.Remove(0x3800, 0x7000);
+  CHECK_EQUAL(3, vmas.Size());
+  CHECK_EQUAL(0x3800, vmas.Find(0x3000)->end);
+  CHECK_EQUAL(0x7000, vmas.Find(0x8000)->begin);
+  CHECK_EQUAL(0x11000, vmas.Find(0x8000)->file_offset);
+
+  // 全体
+  vmas.Remove(0, 0x10000);
+  CHECK_EQUAL(0, vmas.Size());
+}
+
+TEST(VmaList, RemoveHugePart) {
+  const uint64_t k2M = 512 * 4096;
+  CHECK_FALSE(vmas.Insert(Anonymous(0, 2 * k2M, kVmaWritable | kVmaHuge)));
+  CHECK_TRUE(vmas.Find(3 * k2M / 2)->CoversHugePage(3 * k2M / 2));
+
+  // [0, 3MiB)を取り除くと、残りの[3MiB, 4MiB)は2MiBページを含まない
+  vmas.Remove(0, 3 * k2M / 2);
+  const auto vma = vmas.Find(7 * k2M / 4);
+  CHECK_TRUE(vma != nullptr);
+  CHECK_FALSE(vma->CoversHugePage(7 * k2M / 4));
+  CHECK_TRUE(vmas.Find(5 * k2M / 4) == nullptr);
+}
@@ -1,11 +1,26 @@
 #include "timer.hpp"
 
+#include <algorithm>
+#include <array>
+#include <cpuid.h>
+#include <limits>
+
 #include "acpi.hpp"
+#include "asmfunc.h"
 #include "interrupt.hpp"
+#include "logger.hpp"
+#include "smp.hpp"
 #include "task.hpp"
 
 namespace {
     const uint32_t kCountMax = 0xffffffffu;
+    /// タイマ割り込みを設定していない状態
+    const unsigned long kNoDeadline = TimerWheel::kNoTimeout;
+    /// TSC-deadlineモードで割り込ませるTSCの値を書き込むMSR（0を書くと止まる）
+    const uint32_t kIA32TSCDeadline = 0x6e0;
+    /// 一度に設定する割り込みまでの最長の間隔（1秒）。遠い期限は途中で割り込ませ、そのときに設定し直す
+    const unsigned long kMaxArmInterval = kTimerFreq;
+
     /// Local APICタイマのレジスタ
     /// Local Vector Table Timer : 割り込みの設定
     volatile uint32_t& g_lvt_timer = *reinterpret_cast<uint32_t*>(0xfee00320);
@@ -15,30 +30,125 @@ namespace {
     volatile uint32_t& g_current_count = *reinterpret_cast<uint32_t*>(0xfee00390);
     /// 分周比の設定（クロックをn分の1にする）。分周比を大きくするほどカウンタの減り方がゆっくりになる
     volatile uint32_t& g_divide_config = *reinterpret_cast<uint32_t*>(0xfee003e0);
+
+    /// TSCの周波数（1秒あたりのカウント数）と、CurrentTick()が0のときのTSCの値
+    unsigned long g_tsc_freq;
+    uint64_t g_tsc_base;
+    /// TSC-deadlineモードを使う : true
+    bool g_tsc_deadline = false;
+
+    /// CPUコアごとのタスク切替え時刻（kNoDeadlineなら切り替えない）
+    std::array<unsigned long, kMaxCPUs> g_task_deadline{};
+    /// CPUコアごとの、タイマ割り込みを設定した時刻（kNoDeadlineなら設定していない）
+    std::array<unsigned long, kMaxCPUs> g_armed_deadline{};
+    std::array<unsigned long, kMaxCPUs> g_interrupt_count{};
+
+    uint64_t ReadTSC() {
+        return __builtin_ia32_rdtsc();
+    }
+
+    /// 途中の積がオーバーフローしないよう、商と余りに分けて換算する
+    unsigned long TSCToTick(uint64_t tsc) {
+        const uint64_t elapsed = tsc - g_tsc_base;
+        return elapsed / g_tsc_freq * kTimerFreq + elapsed % g_tsc_freq * kTimerFreq / g_tsc_freq;
+    }
+
+    /// 64ビットに収まらない値はTSCの最大値にする
+    uint64_t TickToTSC(unsigned long tick) {
+        const unsigned __int128 tsc = static_cast<unsigned __int128>(tick) * g_tsc_freq / kTimerFreq + g_tsc_base;
+        return std::min(tsc, static_cast<unsigned __int128>(std::numeric_limits<uint64_t>::max()));
+    }
+
+    /// Local APICタイマを、割り込みを1回だけ起こすモードにする
+    void SetTimerMode() {
+        g_divide_config = 0b1011; // divide 1:1
+        // LVT Timer Mode（bit 17-18） : 0b00 = ワンショット、0b10 = TSC-deadline
+        g_lvt_timer = (g_tsc_deadline ? (0b10u << 17) : 0) | InterruptVector::kLAPICTimer;
+    }
+
+    /// 現在のCPUコアのタイマ割り込みをdeadlineの時刻に1回だけ起こす（kNoDeadlineなら止める）
+    /// 過ぎた時刻ならすぐに割り込む。kMaxArmInterval より先なら、その時点で一度割り込む
+    void SetTimerDeadline(unsigned long deadline) {
+        if (deadline == kNoDeadline) {
+            if (g_tsc_deadline) {
+                WriteMSR(kIA32TSCDeadline, 0);
+            } else {
+                StopLAPICTimer();
+            }
+            return;
+        }
+
+        const unsigned long now = g_timer_manager->CurrentTick();
+        const unsigned long delta = std::min(deadline > now ? deadline - now : 0, kMaxArmInterval);
+        if (g_tsc_deadline) {
+            WriteMSR(kIA32TSCDeadline, TickToTSC(now + delta));
+            return;
+        }
+        // カウンタは32ビットなので、それを超える間隔も途中で一度割り込ませる
+        const unsigned long count = delta * g_lapic_timer_freq / kTimerFreq;
+        g_initial_count = std::clamp(count, 1ul, static_cast<unsigned long>(kCountMax));
+    }
+
+    /// 割り込み禁止中に呼ぶ。タスク切替え時刻と（BSPなら）最も近いタイマの期限のうち早い方に割り込みを合わせる
+    void ArmTimerInterrupt(int cpu) {
+        unsigned long deadline = g_task_deadline[cpu];
+        if (cpu == 0) {
+            deadline = std::min(deadline, g_timer_manager->NextTimeout());
+        }
+        if (deadline == g_armed_deadline[cpu]) {
+            return;
+        }
+        g_armed_deadline[cpu] = deadline;
+        SetTimerDeadline(deadline);
+    }
 } // namespace
 
 void InitializeLAPICTimer() {
+    g_task_deadline.fill(kNoDeadline);
+    g_armed_deadline.fill(kNoDeadline);
     g_timer_manager = new TimerManager;
 
     g_divide_config = 0b1011; // divide 1:1
-    // 割り込み不許可
-    g_lvt_timer = (0b010 << 16);
+    // 割り込み不許可（Mask : bit 16）
+    g_lvt_timer = (1u << 16);
 
     StartLAPICTimer();
+    const uint64_t tsc_start = ReadTSC();
     // 100msec(0.1sec)待機
     acpi::WaitMillisecondes(100);
     const auto elapsed = LAPICTimerElapsed();
+    const uint64_t tsc_end = ReadTSC();
     StopLAPICTimer();
 
     // 1000msec(1sec)当たりのカウント数
     g_lapic_timer_freq = static_cast<unsigned long>(elapsed) * 10;
+    g_tsc_freq = (tsc_end - tsc_start) * 10;
+    g_tsc_base = tsc_end;
+
+    unsigned int eax, ebx, ecx, edx;
+    // CPUID.01H:ECX[24] = TSC-deadline
+    g_tsc_deadline = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && ((ecx >> 24) & 1);
+    // CPUID.80000007H:EDX[8] = Invariant TSC。なければ省電力状態などでTSCの進み方が変わるかもしれない
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || ((edx >> 8) & 1) == 0) {
+        Log(kWarn, "TSC is not invariant; CurrentTick() may drift\n");
+    }
+    Log(kInfo, "timer: TSC %lu Hz, LAPIC %lu Hz, %s\n", g_tsc_freq, g_lapic_timer_freq,
+        g_tsc_deadline ? "TSC-deadline" : "one-shot");
 
-    g_divide_config = 0b1011; // divide 1:1
-    // 割り込み許可
-    // Current Counter レジスタの値が0になるたびに割り込み発生
-    g_lvt_timer = (0b010 << 16) | InterruptVector::kLAPICTimer;
-    // 約10msecごとに割り込みが発生するはず
-    g_initial_count = g_lapic_timer_freq / kTimerFreq;
+    // 割り込み許可。期限を設定するまでは割り込まない
+    SetTimerMode();
+}
+
+void InitializeAPLAPICTimer() {
+    // INIT IPIの後のLocal APICはソフトウェア的に無効なので、Spurious Interrupt Vector RegisterのAPIC Software Enableを立てる
+    volatile uint32_t& spurious_vector = *reinterpret_cast<uint32_t*>(0xfee000f0);
+    spurious_vector = spurious_vector | 0x100 | 0xff;
+    volatile uint32_t& task_priority = *reinterpret_cast<uint32_t*>(0xfee00080);
+    task_priority = 0;
+
+    // 周波数はBSPで測ったg_lapic_timer_freqと同じとみなす
+    // アイドルタスクから始まるので、タスク切替え時刻はStartTaskTimer()まで設定しない
+    SetTimerMode();
 }
 
 void StartLAPICTimer() {
@@ -53,59 +163,91 @@ void StopLAPICTimer() {
     g_initial_count = 0;
 }
 
-Timer::Timer(unsigned long timeout, int value, uint64_t task_id) : timeout_{timeout}, value_{value}, task_id_{task_id} {
+void StartTaskTimer() {
+    InterruptGuard guard;
+    const int cpu = CurrentCPU();
+    if (g_task_deadline[cpu] != kNoDeadline) {
+        return;
+    }
+    g_task_deadline[cpu] = g_timer_manager->CurrentTick() + kTaskTimerPeriod;
+    ArmTimerInterrupt(cpu);
 }
 
-TimerManager::TimerManager() {
-    // 番兵
-    timers_.push(Timer{std::numeric_limits<unsigned long>::max(), 0, 0});
+bool TSCDeadlineEnabled() {
+    return g_tsc_deadline;
 }
 
-bool TimerManager::Tick() {
-    tick_++;
+unsigned long TimerInterruptCount(int cpu) {
+    return __atomic_load_n(&g_interrupt_count[cpu], __ATOMIC_RELAXED);
+}
 
-    bool task_timer_timeout = false;
+void TimerManager::Tick(unsigned long now) {
     // タイムアウト処理
-    while (true) {
-        const auto& t = timers_.top();
-        // 先頭がまだタイムアウトしていない場合にループから抜ける
-        if (t.Timeout() > tick_) {
-            break;
-        }
-
-        if (t.Value() == kTaskTimerValue) {
-            task_timer_timeout = true;
-            timers_.pop();
-            timers_.push(Timer{tick_ + kTaskTimerPeriod, kTaskTimerValue, kMainTaskID});
-            continue;
-        }
-
+    Timer t{0, 0, 0};
+    while (wheel_.PopExpired(now, t)) {
         Message msg{Message::kTimerTimeout};
         msg.arg.timer.timeout = t.Timeout();
         msg.arg.timer.value = t.Value();
         // タイマに記録されているタスクへタイムアウトを通知
         g_task_manager->SendMessage(t.TaskID(), msg);
+    }
+}
 
-        timers_.pop();
+WithError<uint64_t> TimerManager::AddTimer(const Timer& timer) {
+    auto result = wheel_.Add(timer, timer.Value() < 0 ? kReservedTimers : 0);
+    if (!result.error && timer.Timeout() < g_armed_deadline[0]) {
+        ArmTimerInterrupt(0);
     }
+    return result;
+}
+
+Error TimerManager::CancelTimer(uint64_t id) {
+    // 取り消したタイマに合わせた割り込みは、来たときに次の期限で設定し直す
+    return wheel_.Cancel(id);
+}
 
-    return task_timer_timeout;
+void TimerManager::CancelAppTimers(uint64_t task_id) {
+    wheel_.CancelIf([task_id](const Timer& t) {
+        return t.TaskID() == task_id && t.Value() < 0;
+    });
 }
 
-void TimerManager::AddTimer(const Timer& timer) {
-    timers_.push(timer);
+unsigned long TimerManager::CurrentTick() const {
+    return TSCToTick(ReadTSC());
 }
 
 TimerManager* g_timer_manager;
 unsigned long g_lapic_timer_freq;
 
 /// ctx_stack : 割り込みフレームの情報を使って構築したコンテキスト構造体）
-extern "C" void LAPICTimerOnInterrupt(const TaskContext& ctx_stack) {
-    const bool task_timer_timeout = g_timer_manager->Tick();
+extern "C" void LAPICTimerOnInterrupt(const InterruptContext& ctx_stack) {
+    const int cpu = CurrentCPU();
+    g_interrupt_count[cpu]++;
+    // 割り込みは1回きりなので、次に設定する期限は必ずハードウェアに書き込む
+    g_armed_deadline[cpu] = kNoDeadline;
+
+    const unsigned long now = g_timer_manager->CurrentTick();
+    // タイマの管理はBSPだけが行う
+    if (cpu == 0) {
+        g_timer_manager->Tick(now);
+    }
+
+    bool task_timer_timeout = false;
+    if (g_task_deadline[cpu] <= now) {
+        task_timer_timeout = true;
+        // 切替え後にアイドルタスクしか動かないなら、次の切替え時刻を設定せずアイドル中の割り込みをなくす
+        g_task_deadline[cpu] = g_task_manager->HasRunnableTask() ? now + kTaskTimerPeriod : kNoDeadline;
+    }
+    ArmTimerInterrupt(cpu);
     // タスク切り替えの前にコールしておかないと、タスク切り替え後にタイマ割り込みがこなくなる
     NotifyEndOfInterrupt();
 
     if (task_timer_timeout) {
         g_task_manager->SwitchTask(ctx_stack);
     }
+    // 入口でFPUを退避していないのに、この割り込み処理がFPUを使った（#NMで現在のタスクが所有した）なら、
+    // レジスタの内容は書き換わっているので捨てる。タスクの状態はfpu_state_に残っている
+    if (!ctx_stack.regs.fpu_saved) {
+        g_task_manager->AbandonFPU();
+    }
 }
@@ -4,64 +4,59 @@
 /// Local APICタイマ : Local APICのタイマ。CPUコア1つにつき1つのみ搭載。
 #pragma once
 
+#include "error.hpp"
 #include "message.hpp"
+#include "timer_wheel.hpp"
 #include <cstdint>
-#include <limits>
-#include <queue>
-#include <vector>
 
+/// TSCとLocal APICタイマの周波数を測り、タイマ割り込みを1回ずつ設定する方式（ティックレス）にする
 void InitializeLAPICTimer();
+/// APのLocal APICを有効にして、BSPと同じ方式でタイマ割り込みを受けられるようにする（AP自身が呼ぶ）
+void InitializeAPLAPICTimer();
 void StartLAPICTimer();
 uint32_t LAPICTimerElapsed();
 void StopLAPICTimer();
-
-/// Local APICタイマの1カウントを基準とした、論理的なタイマ
-class Timer {
-public:
-    Timer(unsigned long timeout, int value, uint64_t task_id);
-    unsigned long Timeout() const { return timeout_; }
-    int Value() const { return value_; }
-    uint64_t TaskID() const { return task_id_; }
-
-private:
-    /// タイムアウト時刻
-    /// TimeManager::tick_の値以下ならタイムアウトしたと見做す
-    unsigned long timeout_;
-    /// タイムアウト時に送信する値
-    int value_;
-    /// タイムアウトメッセージの通知先
-    uint64_t task_id_;
-};
-
-/// タイマー優先度を比較。タイムアウトが遠いほど優先度低
-inline bool operator<(const Timer& lhs, const Timer& rhs) {
-    return lhs.Timeout() > rhs.Timeout();
-}
-
-/// タイマの割り込み回数を管理
+/// 現在のCPUコアで、タスク切替えの周期（kTaskTimerPeriod）後にタイマ割り込みが起きるようにする
+/// すでに切替え時刻を設定していれば何もしない。アイドルタスクから他のタスクへ移る前に呼ぶ
+void StartTaskTimer();
+/// タイマ割り込みの方式。TSC-deadline : true、Local APICタイマのワンショット : false
+bool TSCDeadlineEnabled();
+/// CPUコアごとのタイマ割り込みの回数
+unsigned long TimerInterruptCount(int cpu);
+
+/// タイマをタイミングホイールで管理し、最も近い期限にBSPのタイマ割り込みを合わせる
 class TimerManager {
 public:
-    TimerManager();
-    void AddTimer(const Timer& timer);
-    /// タスク切り替え用タイマがタイムアウト : true
-    bool Tick();
-    unsigned long CurrentTick() const { return tick_; }
+    /// アプリのタイマ（値が負）で埋まっても、OSカーネルのタイマを登録できるよう残しておく数
+    static const size_t kReservedTimers = 64;
+
+    /// BSPで割り込み禁止中に呼ぶ。設定済みの割り込みより期限が近ければ、割り込みを早める
+    /// return : CancelTimer()に渡すタイマID。同時に登録できる数を超えるとkFull
+    WithError<uint64_t> AddTimer(const Timer& timer);
+    /// BSPで割り込み禁止中に呼ぶ。タイムアウト前のタイマを取り消す
+    Error CancelTimer(uint64_t id);
+    /// BSPで割り込み禁止中に呼ぶ。終了したアプリのタイマ（値が負）をすべて取り消す
+    void CancelAppTimers(uint64_t task_id);
+    /// タイムアウト前のタイマ。なければnullptr（BSPで割り込み禁止中に呼ぶ）
+    const Timer* FindTimer(uint64_t id) const { return wheel_.Find(id); }
+    /// 期限がnow以前のタイマのタスクにタイムアウトを通知する（BSPのタイマ割り込みで呼ぶ）
+    void Tick(unsigned long now);
+    /// 次にタイムアウトするタイマの期限（なければTimerWheel::kNoTimeout）
+    unsigned long NextTimeout() const { return wheel_.NextTimeout(); }
+    /// 起動してからの時刻（1秒あたりkTimerFreq）。TSCから求めるので割り込みを待たずに進み、どのCPUコアからも読める
+    unsigned long CurrentTick() const;
 
 private:
-    // タイマ割り込み回数
-    volatile unsigned long tick_{0};
-    std::priority_queue<Timer> timers_{};
+    TimerWheel wheel_;
 };
 
 extern TimerManager* g_timer_manager;
 /// Local APICタイマの周波数（1秒あたりのカウント数）
 extern unsigned long g_lapic_timer_freq;
-/// 1秒間にTimerManager::Tick()をコールする回数
-const int kTimerFreq = 100;
+/// CurrentTick()が1秒間に進む数（1tick = 1マイクロ秒）
+/// タイマ割り込みは期限ごとに1回だけ起こすので、割り込みの回数とは関係しない
+const int kTimerFreq = 1000000;
 
 /// タスク切り替え用タイマの周期
 /// 0.02secでタイムアウト
 const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 0.02);
-/// タスク切り替え用タイマの値（他のタイマとの識別用）
-/// 正の数値に修正（syscall.cpp::CreateTimer()を参照）
-const int kTaskTimerValue = std::numeric_limits<int>::max();
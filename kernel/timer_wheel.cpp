@@ -0,0 +1,185 @@
+#include "timer_wheel.hpp"
+
+#include <algorithm>
+
+Timer::Timer(unsigned long timeout, int value, uint64_t task_id) : timeout_{timeout}, value_{value}, task_id_{task_id} {
+}
+
+TimerWheel::TimerWheel() {
+    heads_.fill(kNil);
+    for (uint32_t i = 0; i < kMaxTimers; i++) {
+        nodes_[i].next = i + 1 < kMaxTimers ? i + 1 : kNil;
+        // IDが0（無効値）にならないよう、世代番号は1から
+        nodes_[i].generation = 1;
+        nodes_[i].slot = kNil;
+    }
+    free_head_ = 0;
+}
+
+WithError<uint64_t> TimerWheel::Add(const Timer& timer, size_t reserve) {
+    if (free_head_ == kNil || kMaxTimers - count_ <= reserve) {
+        return {0, MAKE_ERROR(Error::kFull)};
+    }
+    const uint32_t index = free_head_;
+    auto& node = nodes_[index];
+    free_head_ = node.next;
+    node.timer = timer;
+    Link(index);
+    ++count_;
+    return {(static_cast<uint64_t>(node.generation) << kIndexBits) | index, MAKE_ERROR(Error::kSuccess)};
+}
+
+Error TimerWheel::Cancel(uint64_t id) {
+    if (Find(id) == nullptr) {
+        return MAKE_ERROR(Error::kNoSuchEntry);
+    }
+    Release(id & ((1u << kIndexBits) - 1));
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+const Timer* TimerWheel::Find(uint64_t id) const {
+    const uint64_t index = id & ((1u << kIndexBits) - 1);
+    if (index >= kMaxTimers) {
+        return nullptr;
+    }
+    const auto& node = nodes_[index];
+    if (node.slot == kNil || node.generation != (id >> kIndexBits)) {
+        return nullptr;
+    }
+    return &node.timer;
+}
+
+unsigned long TimerWheel::NextTimeout() const {
+    unsigned long time;
+    int level, slot;
+    if (!NextEvent(time, level, slot)) {
+        return kNoTimeout;
+    }
+    if (level == 0) {
+        return time;
+    }
+
+    // 下の段がすべて空なら、最初の空でないスロットに最も近い期限がある
+    unsigned long timeout = kNoTimeout;
+    for (uint32_t i = heads_[level * kSlots + slot]; i != kNil; i = nodes_[i].next) {
+        timeout = std::min(timeout, nodes_[i].timer.Timeout());
+    }
+    return std::max(timeout, wheel_time_);
+}
+
+bool TimerWheel::PopExpired(unsigned long now, Timer& timer) {
+    while (true) {
+        unsigned long time;
+        int level, slot;
+        if (!NextEvent(time, level, slot) || time > now) {
+            // now以前に処理するスロットはもうないので、途中の空のスロットは飛ばしてよい
+            if (now >= wheel_time_) {
+                AdvanceTo(now + 1);
+            }
+            return false;
+        }
+        AdvanceTo(time);
+
+        const uint32_t head = heads_[level * kSlots + slot];
+        if (head == kNil) { // AdvanceTo()でカスケード済み
+            continue;
+        }
+        if (level == 0) {
+            timer = nodes_[head].timer;
+            Release(head);
+            return true;
+        }
+
+        Cascade(level, slot);
+    }
+}
+
+void TimerWheel::AdvanceTo(unsigned long time) {
+    wheel_time_ = time;
+    // 上の段で現在の位置にあるスロットは、その開始時刻に達しているので下の段へ移す
+    // 上の段から移すと、移した先が下の段の現在の位置でも続けて移せる
+    for (int lv = kLevels - 1; lv > 0; lv--) {
+        const int slot = (wheel_time_ >> (lv * kSlotBits)) & (kSlots - 1);
+        if (occupied_[lv] & (1ul << slot)) {
+            Cascade(lv, slot);
+        }
+    }
+}
+
+void TimerWheel::Cascade(int level, int slot) {
+    // スロットを空にしてから、各ノードを現在の時刻を基準に入れ直す
+    const uint32_t head = heads_[level * kSlots + slot];
+    heads_[level * kSlots + slot] = kNil;
+    occupied_[level] &= ~(1ul << slot);
+    for (uint32_t i = head; i != kNil;) {
+        const uint32_t next = nodes_[i].next;
+        Link(i);
+        i = next;
+    }
+}
+
+void TimerWheel::Link(uint32_t index) {
+    auto& node = nodes_[index];
+    const unsigned long expiry = std::max(node.timer.Timeout(), wheel_time_);
+    // wheel_time_と異なる最上位のビットの段に入れる。それより上のビットは同じなので、その段の1周以内に収まる
+    const unsigned long diff = expiry ^ wheel_time_;
+    const int level = diff == 0 ? 0 : (63 - __builtin_clzl(diff)) / kSlotBits;
+    const int slot = (expiry >> (level * kSlotBits)) & (kSlots - 1);
+
+    const uint32_t s = level * kSlots + slot;
+    node.slot = s;
+    node.prev = kNil;
+    node.next = heads_[s];
+    if (heads_[s] != kNil) {
+        nodes_[heads_[s]].prev = index;
+    }
+    heads_[s] = index;
+    occupied_[level] |= 1ul << slot;
+}
+
+void TimerWheel::Unlink(uint32_t index) {
+    auto& node = nodes_[index];
+    const uint32_t s = node.slot;
+    if (node.prev != kNil) {
+        nodes_[node.prev].next = node.next;
+    } else {
+        heads_[s] = node.next;
+    }
+    if (node.next != kNil) {
+        nodes_[node.next].prev = node.prev;
+    }
+    if (heads_[s] == kNil) {
+        occupied_[s / kSlots] &= ~(1ul << (s % kSlots));
+    }
+    node.slot = kNil;
+}
+
+void TimerWheel::Release(uint32_t index) {
+    Unlink(index);
+    auto& node = nodes_[index];
+    ++node.generation;
+    node.next = free_head_;
+    free_head_ = index;
+    --count_;
+}
+
+bool TimerWheel::NextEvent(unsigned long& time, int& level, int& slot) const {
+    for (int lv = 0; lv < kLevels; lv++) {
+        const int shift = lv * kSlotBits;
+        const int index = (wheel_time_ >> shift) & (kSlots - 1);
+        // 現在の位置より前のスロットは、この段の次の周回ではなく処理済み（空）
+        const uint64_t bits = occupied_[lv] & (~0ul << index);
+        if (bits == 0) {
+            continue;
+        }
+
+        level = lv;
+        slot = __builtin_ctzl(bits);
+        // 1つ上の段のスロットの先頭時刻に、この段のスロットの開始時刻を足す
+        const int upper_shift = shift + kSlotBits;
+        const unsigned long base = upper_shift >= 64 ? 0 : (wheel_time_ >> upper_shift) << upper_shift;
+        time = std::max(base + (static_cast<unsigned long>(slot) << shift), wheel_time_);
+        return true;
+    }
+    return false;
+}
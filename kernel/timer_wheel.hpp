@@ -0,0 +1,110 @@
+/// 階層タイミングホイール : タイマを期限ごとのスロットに振り分け、追加と取消しをO(1)で行う
+/// n段目のスロットは64^n tickの幅をもつ。期限の近いタイマほど下の段に入り、
+/// 上の段のスロットの時刻に達したら、そのスロットのタイマを下の段へ振り分け直す（カスケード）
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+#include "error.hpp"
+
+/// CurrentTick()の時刻を基準とした、論理的なタイマ
+class Timer {
+public:
+    Timer(unsigned long timeout, int value, uint64_t task_id);
+    unsigned long Timeout() const { return timeout_; }
+    int Value() const { return value_; }
+    uint64_t TaskID() const { return task_id_; }
+
+private:
+    /// タイムアウト時刻
+    /// TimerManager::CurrentTick()の値以下ならタイムアウトしたと見做す
+    unsigned long timeout_;
+    /// タイムアウト時に送信する値
+    int value_;
+    /// タイムアウトメッセージの通知先
+    uint64_t task_id_;
+};
+
+class TimerWheel {
+public:
+    static const int kSlotBits = 6;
+    static const int kSlots = 1 << kSlotBits;
+    /// 64ビットの時刻全体を覆う段数
+    static const int kLevels = (64 + kSlotBits - 1) / kSlotBits;
+    /// 同時に登録できるタイマの数。ノードはすべて先に確保しておき、割り込み処理の中では確保しない
+    static constexpr size_t kMaxTimers = 1024;
+    /// タイマIDの下位kIndexBitsビットはノードの添字、上位は世代番号
+    /// ノードを再利用するたびに世代番号を進めるので、タイムアウトしたタイマの古いIDで別のタイマを取り消すことはない
+    static const int kIndexBits = 16;
+    static constexpr unsigned long kNoTimeout = std::numeric_limits<unsigned long>::max();
+
+    TimerWheel();
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    /// 処理済みの時刻より前の期限は、次に処理する時刻にタイムアウトさせる
+    /// reserve : 他の用途のために残しておく空きノードの数
+    /// return : タイマID。空きノードがreserve個以下ならkFull
+    WithError<uint64_t> Add(const Timer& timer, size_t reserve = 0);
+    /// タイムアウト前のタイマを取り除く。タイムアウト済みか取消し済みならkNoSuchEntry
+    Error Cancel(uint64_t id);
+    /// pred(const Timer&)がtrueとなるタイマをすべて取り除く
+    /// return : 取り除いた数
+    template <class Pred>
+    size_t CancelIf(Pred pred) {
+        size_t n = 0;
+        for (uint32_t i = 0; i < kMaxTimers; i++) {
+            if (nodes_[i].slot != kNil && pred(nodes_[i].timer)) {
+                Release(i);
+                ++n;
+            }
+        }
+        return n;
+    }
+    /// タイムアウト前のタイマ。なければnullptr
+    const Timer* Find(uint64_t id) const;
+    /// 最も近い期限（タイマがなければkNoTimeout）
+    unsigned long NextTimeout() const;
+    /// 期限がnow以前のタイマを1つ取り出す。同じ期限のタイマはまとめて同じスロットに入っている
+    /// return : 取り出した : true、now以前のタイマはもうない : false
+    bool PopExpired(unsigned long now, Timer& timer);
+    size_t Count() const { return count_; }
+
+private:
+    static constexpr uint32_t kNil = std::numeric_limits<uint32_t>::max();
+
+    struct Node {
+        Timer timer{0, 0, 0};
+        /// スロット内の双方向リスト（空きノードはnextだけで空きリストをつなぐ）
+        uint32_t prev, next;
+        uint32_t generation;
+        /// 入っているスロット（段 * kSlots + スロット番号）。空きノードはkNil
+        uint32_t slot;
+    };
+
+    std::array<Node, kMaxTimers> nodes_;
+    /// スロットごとの先頭ノード
+    std::array<uint32_t, kLevels * kSlots> heads_;
+    /// 段ごとに、空でないスロットのビットを立てる。次のタイマを探すときに空のスロットを飛ばす
+    std::array<uint64_t, kLevels> occupied_{};
+    uint32_t free_head_;
+    /// 次に処理する時刻。これより前の期限のタイマはすべて取り出すか、下の段へ振り分け済み
+    unsigned long wheel_time_{0};
+    size_t count_{0};
+
+    /// ノードの期限に合ったスロットに入れる
+    void Link(uint32_t index);
+    void Unlink(uint32_t index);
+    /// スロットから外し、世代番号を進めて空きリストに戻す
+    void Release(uint32_t index);
+    /// wheel_time_を進め、到達した上の段のスロットをカスケードする
+    void AdvanceTo(unsigned long time);
+    void Cascade(int level, int slot);
+    /// 次に処理するスロット（0段目ならタイムアウト、それ以外はカスケード）とその時刻
+    /// return : 空でないスロットがない : false
+    bool NextEvent(unsigned long& time, int& level, int& slot) const;
+};
@@ -0,0 +1,75 @@
+#include "vma.hpp"
+
+#include <algorithm>
+
+namespace {
+    bool BeginLess(uint64_t addr, const VirtualMemoryArea& vma) {
+        return addr < vma.begin;
+    }
+} // namespace
+
+Error VmaList::Insert(const VirtualMemoryArea& vma) {
+    if (vma.begin >= vma.end) {
+        return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+
+    // vma.begin以下から始まる最後の領域の次
+    auto it = std::upper_bound(areas_.begin(), areas_.end(), vma.begin, BeginLess);
+    if (it != areas_.end() && it->begin < vma.end) {
+        return MAKE_ERROR(Error::kAlreadyAllocated);
+    }
+    if (it != areas_.begin()) {
+        auto& prev = *(it - 1);
+        if (vma.begin < prev.end) {
+            return MAKE_ERROR(Error::kAlreadyAllocated);
+        }
+        if (prev.end == vma.begin && prev.type == VmaType::kAnonymous &&
+            vma.type == VmaType::kAnonymous && prev.flags == vma.flags) {
+            prev.end = vma.end;
+            return MAKE_ERROR(Error::kSuccess);
+        }
+    }
+
+    areas_.insert(it, vma);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+VirtualMemoryArea* VmaList::Find(uint64_t addr) {
+    auto it = std::upper_bound(areas_.begin(), areas_.end(), addr, BeginLess);
+    if (it == areas_.begin()) {
+        return nullptr;
+    }
+    --it;
+    return it->Contains(addr) ? &*it : nullptr;
+}
+
+const VirtualMemoryArea* VmaList::Find(uint64_t addr) const {
+    return const_cast<VmaList*>(this)->Find(addr);
+}
+
+void VmaList::Remove(uint64_t begin, uint64_t end) {
+    auto it = std::upper_bound(areas_.begin(), areas_.end(), begin, BeginLess);
+    if (it != areas_.begin() && begin < (it - 1)->end) {
+        --it;
+    }
+
+    while (it != areas_.end() && it->begin < end) {
+        if (begin <= it->begin && it->end <= end) { // 全体
+            it = areas_.erase(it);
+        } else if (it->begin < begin && end < it->end) { // 途中
+            VirtualMemoryArea tail = *it;
+            tail.file_offset += end - it->begin;
+            tail.begin = end;
+            it->end = begin;
+            areas_.insert(it + 1, tail);
+            return;
+        } else if (it->begin < begin) { // 末尾
+            it->end = begin;
+            ++it;
+        } else { // 先頭
+            it->file_offset += end - it->begin;
+            it->begin = end;
+            ++it;
+        }
+    }
+}
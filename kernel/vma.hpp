@@ -0,0 +1,73 @@
+/// 仮想メモリ領域（VMA） : アプリの仮想アドレス空間を、用途の異なる連続した領域の集まりとして管理する
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "error.hpp"
+
+/// 領域の種類
+enum class VmaType {
+    /// アプリのELF（LOADセグメント）。Task::ExecFile()から遅延して読み込む
+    kElf,
+    /// デマンドページングで割り当てる匿名メモリ
+    kAnonymous,
+    /// メモリマップドファイル
+    kFile,
+    /// スタック領域。予約した範囲のうちアクセスされたページを割り当てる
+    kStack,
+};
+
+/// 領域の属性（ビットの組み合わせ）
+const uint32_t kVmaWritable = 1;
+/// 2MiBページで割り当てる
+const uint32_t kVmaHuge = 2;
+/// kFileのみ : 書き込みをタスク間で共有し、ファイルに書き戻す（無ければコピーオンライトで各タスクに閉じる）
+const uint32_t kVmaShared = 4;
+
+/// 仮想アドレス範囲 [begin, end) を占める1つの領域
+struct VirtualMemoryArea {
+    uint64_t begin, end;
+    VmaType type;
+    uint32_t flags;
+    /// kFileのみ有効 : ファイルディスクリプタ
+    int fd;
+    /// kFile, kElf : beginに対応するファイル内のオフセット
+    uint64_t file_offset;
+    /// kElfのみ有効 : ファイルのデータが続く終端。ここから先（.bss）はゼロで埋める
+    uint64_t file_end;
+
+    bool Contains(uint64_t addr) const { return begin <= addr && addr < end; }
+    /// kVmaHugeの領域で、addrを含む2MiBページ全体がこの領域に収まる : true
+    /// 一部を取り除いた領域の端は2MiB境界に揃っていないので、そこは4KiBページで割り当てる
+    bool CoversHugePage(uint64_t addr) const {
+        const uint64_t kHugePageBytes = 512 * 4096;
+        const uint64_t huge_begin = addr & ~(kHugePageBytes - 1);
+        return (flags & kVmaHuge) && begin <= huge_begin && huge_begin + kHugePageBytes <= end;
+    }
+};
+
+/// タスクの仮想メモリ領域の一覧
+/// 先頭アドレス順に並べた配列で、アドレスから領域を二分探索で O(log n) で引ける
+class VmaList {
+public:
+    /// 既存の領域と重なればkAlreadyAllocated
+    /// 直前の領域と隣接し、種類と属性が同じ匿名メモリであれば1つの領域に結合する
+    Error Insert(const VirtualMemoryArea& vma);
+    /// 指定アドレスを含む領域。無ければnullptr
+    VirtualMemoryArea* Find(uint64_t addr);
+    const VirtualMemoryArea* Find(uint64_t addr) const;
+    /// [begin, end)と重なる部分を取り除く。領域の途中であれば2つに分割する
+    /// ファイルを指す領域の先頭を取り除いた場合は、file_offsetを合わせてずらす
+    void Remove(uint64_t begin, uint64_t end);
+    void Clear() { areas_.clear(); }
+
+    size_t Size() const { return areas_.size(); }
+    std::vector<VirtualMemoryArea>::const_iterator begin() const { return areas_.begin(); }
+    std::vector<VirtualMemoryArea>::const_iterator end() const { return areas_.end(); }
+
+private:
+    std::vector<VirtualMemoryArea> areas_{};
+};